@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "buffer.h"
+#include "image.h"
+#include "incremental.h"
+#include "miptex.h"
+#include "pool.h"
+#include "stream.h"
+#include "trace.h"
+
+#ifdef _WIN32
+#define lstat(path, st) stat(path, st)	// no links to tell apart
+#define S_ISLNK(mode) 0
+#endif
+
+/* Images waiting between two stages, per worker */
+#define QUEUE_DEPTH 2
+
+struct batch_job_t
+{
+	const char *src;
+	char *dest;
+	enum image_type_t input_type;
+	enum image_type_t output_type;
+	struct image_t *img_src;
+	struct image_t *img_dst;
+	struct trace_span_t span;	// the whole file, from queueing to its last stage
+	struct incremental_job_t incremental;
+	int done;					// dest was already up to date, the remaining stages are skipped
+	int lump;					// index in options->wad
+	struct quality_t quality;	// measured by the convert stage, reported once the output is written
+};
+
+struct pipeline_t;
+
+typedef int (*stage_func_t)(struct pipeline_t *pipeline, struct batch_job_t *job);
+
+struct stage_t
+{
+	struct pipeline_t *pipeline;
+	stage_func_t func;
+	enum trace_stage_t trace;
+	struct queue_t *in;
+	struct queue_t *out;		// NULL for the last stage
+	pthread_t *threads;
+	unsigned int active;		// workers still running, the last one to exit closes out
+};
+
+struct pipeline_t
+{
+	const struct batch_options_t *options;
+	struct stage_t stages[3];
+	unsigned int stage_count;
+	pthread_mutex_t lock;		// covers stage active counts and the totals below
+	unsigned int converted;
+	unsigned int failed;
+};
+
+struct batch_t *batch_create(void)
+{
+	struct batch_t *batch = malloc(sizeof(struct batch_t));
+	if(!batch)
+		return NULL;
+
+	batch->count = 0;
+	batch->capacity = 64;
+	batch->paths = malloc(batch->capacity * sizeof(char *));
+	if(!batch->paths)
+	{
+		free(batch);
+		return NULL;
+	}
+
+	return batch;
+}
+
+static int batch_add_file(struct batch_t *batch, const char *path)
+{
+	if(batch->count == batch->capacity)
+	{
+		char **paths = realloc(batch->paths, batch->capacity * 2 * sizeof(char *));
+		if(!paths)
+			return 0;
+
+		batch->paths = paths;
+		batch->capacity *= 2;
+	}
+
+	batch->paths[batch->count] = strdup(path);
+	if(!batch->paths[batch->count])
+		return 0;
+
+	batch->count++;
+	return 1;
+}
+
+/* Outputs and --heatmap images of an earlier run, which would otherwise be picked up again */
+static int is_converted_output(const char *name)
+{
+	size_t len = strlen(name);
+	return len >= 9 && (!strncmp(name+len-9, "_conv.", 6) || (len >= 10 && !strncmp(name+len-10, "_error.", 7)));
+}
+
+static int batch_add_dir(struct batch_t *batch, const char *path)
+{
+	DIR *dir = opendir(path);
+	if(!dir)
+	{
+		printf("Error: Failed to open directory %s\n", path);
+		return 0;
+	}
+
+	int ret = 1;
+	struct dirent *entry;
+	while(ret && (entry = readdir(dir)) != NULL)
+	{
+		if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		char *child = malloc(strlen(path) + strlen(entry->d_name) + 2);
+		if(!child)
+		{
+			ret = 0;
+			break;
+		}
+		sprintf(child, "%s/%s", path, entry->d_name);
+
+		/* Links to files are followed, links to directories aren't, so a link back up can't loop */
+		struct stat st;
+		int link = lstat(child, &st) == 0 && S_ISLNK(st.st_mode);
+		if(stat(child, &st) == 0)
+		{
+			if(S_ISDIR(st.st_mode))
+				ret = link || batch_add_dir(batch, child);
+			else if(image_type_from_path(child) >= 0 && image_type_loadable(image_type_from_path(child)) && !is_converted_output(entry->d_name))
+				ret = batch_add_file(batch, child);
+		}
+
+		free(child);
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+int batch_add_path(struct batch_t *batch, const char *path)
+{
+	struct stat st;
+	if(stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+		return batch_add_dir(batch, path);
+
+	return batch_add_file(batch, path);
+}
+
+int batch_add_list(struct batch_t *batch, FILE *list)
+{
+	char line[4096];
+	while(fgets(line, sizeof(line), list))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if(line[0] == '\0')
+			continue;
+
+		if(!batch_add_path(batch, line))
+			return 0;
+	}
+
+	return 1;
+}
+
+void batch_free(struct batch_t *batch)
+{
+	if(!batch)
+		return;
+
+	for(unsigned int i=0; i<batch->count; i++)
+		free(batch->paths[i]);
+	free(batch->paths);
+	free(batch);
+}
+
+static void finish_job(struct pipeline_t *pipeline, struct batch_job_t *job, int ok)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	if(ok)
+		pipeline->converted++;
+	else
+		pipeline->failed++;
+	pthread_mutex_unlock(&pipeline->lock);
+
+	trace_end(&job->span, 0, 0);
+	free_image(job->img_src);
+	free_image(job->img_dst);
+	buffer_free(job->quality.heatmap);
+	free(job->dest);
+	buffer_free(job);
+}
+
+/* Whether the incremental cache already has dest, the job is done if so */
+static int up_to_date(struct pipeline_t *pipeline, struct batch_job_t *job)
+{
+	const struct batch_options_t *options = pipeline->options;
+	if(!options->incremental || !incremental_check(options->incremental, job->src, job->dest, job->output_type, &options->convert, &job->incremental))
+		return 0;
+
+	printf("Up to date: %s\n", job->dest);
+	if(options->convert.quality)
+		printf("Quality: %s not measured, its output was up to date\n", job->src);
+	job->done = 1;
+	return 1;
+}
+
+/* Streaming does load, convert and write in one go, holding a row or band at a time */
+static int stream_job(struct pipeline_t *pipeline, struct batch_job_t *job)
+{
+	if(!convert_stream(job->src, job->input_type, job->dest, job->output_type, &pipeline->options->convert))
+	{
+		printf("Error: Failed to convert image %s\n", job->src);
+		return 0;
+	}
+
+	if(pipeline->options->incremental)
+		incremental_store(pipeline->options->incremental, &job->incremental, job->dest);
+
+	printf("Converted file: %s\n", job->dest);
+	return 1;
+}
+
+static int load_stage(struct pipeline_t *pipeline, struct batch_job_t *job)
+{
+	if(up_to_date(pipeline, job))
+		return 1;
+
+	/* Too big to hold whole, converted in bands right here instead. Lumps need the whole image */
+	if(!pipeline->options->wad && stream_exceeds(job->src, job->input_type, pipeline->options->convert.memory))
+	{
+		job->done = 1;
+		return stream_job(pipeline, job);
+	}
+
+	job->img_src = load_image(job->src, job->input_type);
+	if(job->img_src == NULL)
+	{
+		printf("Error: Failed to load image %s\n", job->src);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int convert_stage(struct pipeline_t *pipeline, struct batch_job_t *job)
+{
+	struct convert_options_t options = pipeline->options->convert;
+	options.mip_levels = image_mip_levels(job->output_type);
+
+	const struct img_info_t *info = job->img_src->info;
+	if(options.quality && !quality_begin(&job->quality, info->width, info->height, options.quality))
+	{
+		printf("Error: Failed to convert image %s\n", job->src);
+		return 0;
+	}
+
+	job->img_dst = to_palette_measured(job->img_src, &options, options.quality ? &job->quality : NULL);
+
+	free_image(job->img_src);
+	job->img_src = NULL;
+
+	if(job->img_dst == NULL)
+	{
+		printf("Error: Failed to convert image %s\n", job->src);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int write_stage(struct pipeline_t *pipeline, struct batch_job_t *job)
+{
+	if(pipeline->options->wad)
+	{
+		if(!wad_write_miptex(pipeline->options->wad, job->lump, job->img_dst))
+		{
+			printf("Error: Failed to pack %s\n", job->src);
+			return 0;
+		}
+
+		printf("Packed texture: %s from %s\n", wad_lump_name(pipeline->options->wad, job->lump), job->src);
+		return !pipeline->options->convert.quality || quality_end(&job->quality, job->src, NULL, job->output_type);
+	}
+
+	if(!write_image(job->img_dst, job->dest, job->output_type))
+	{
+		printf("Error: Failed to write %s\n", job->dest);
+		return 0;
+	}
+
+	if(pipeline->options->incremental)
+		incremental_store(pipeline->options->incremental, &job->incremental, job->dest);
+
+	printf("Converted file: %s\n", job->dest);
+	return !pipeline->options->convert.quality || quality_end(&job->quality, job->src, job->dest, job->output_type);
+}
+
+static int stream_stage(struct pipeline_t *pipeline, struct batch_job_t *job)
+{
+	return up_to_date(pipeline, job) || stream_job(pipeline, job);
+}
+
+static void *stage_worker(void *arg)
+{
+	struct stage_t *stage = arg;
+	struct pipeline_t *pipeline = stage->pipeline;
+	struct batch_job_t *job;
+
+	trace_thread_name(stage->trace == TRACE_STREAM ? "stream" : stage->trace == TRACE_LOAD ? "load" : stage->trace == TRACE_CONVERT ? "convert" : "write");
+
+	while((job = queue_pop(stage->in)) != NULL)
+	{
+		struct trace_span_t span;
+		trace_begin(&span, stage->trace, job->src);
+		int ok = stage->func(pipeline, job);
+		trace_end(&span, stage->trace == TRACE_LOAD || stage->trace == TRACE_STREAM ? trace_file_size(job->src) : 0,
+			stage->trace == TRACE_WRITE || stage->trace == TRACE_STREAM ? trace_file_size(job->dest) : 0);
+
+		if(!ok)
+			finish_job(pipeline, job, 0);
+		else if(stage->out && !job->done)
+			queue_push(stage->out, job);
+		else
+			finish_job(pipeline, job, 1);
+	}
+
+	pthread_mutex_lock(&pipeline->lock);
+	int last = --stage->active == 0;
+	pthread_mutex_unlock(&pipeline->lock);
+
+	if(last && stage->out)
+		queue_close(stage->out);
+
+	return NULL;
+}
+
+/* Add a source's texture to the WAD, -1 if it can't be packed */
+static int wad_source(struct wad_t *wad, const char *src)
+{
+	int input_type = image_type_from_path(src);
+	if(input_type < 0 || !image_type_loadable(input_type))
+	{
+		printf("Error: Unsupported file type %s\n", src);
+		return -1;
+	}
+
+	unsigned int width, height;
+	if(!source_dimensions(src, input_type, &width, &height))
+	{
+		printf("Error: Failed to read %s\n", src);
+		return -1;
+	}
+
+	char name[MIPTEX_NAME_LEN];
+	miptex_name(src, name);
+	return wad_add(wad, name, width, height);
+}
+
+unsigned int batch_run(struct batch_t *batch, const struct batch_options_t *options)
+{
+	/* Every lump's place in the WAD follows from the source sizes, so it's laid out before any conversion */
+	int *lumps = NULL;
+	if(options->wad)
+	{
+		lumps = malloc((batch->count ? batch->count : 1) * sizeof(int));
+		if(!lumps)
+			return batch->count;
+
+		for(unsigned int i=0; i<batch->count; i++)
+			lumps[i] = wad_source(options->wad, batch->paths[i]);
+
+		if(!wad_layout(options->wad))
+		{
+			free(lumps);
+			return batch->count;
+		}
+	}
+
+	struct pipeline_t pipeline;
+	pipeline.options = options;
+	pipeline.converted = 0;
+	pipeline.failed = 0;
+	pthread_mutex_init(&pipeline.lock, NULL);
+
+	unsigned int threads = options->threads > 0 ? options->threads : 1;
+	stage_func_t funcs[3] = { load_stage, convert_stage, write_stage };
+	enum trace_stage_t traces[3] = { TRACE_LOAD, TRACE_CONVERT, TRACE_WRITE };
+
+	if(options->stream)
+	{
+		funcs[0] = stream_stage;
+		traces[0] = TRACE_STREAM;
+		pipeline.stage_count = 1;
+	}
+	else
+		pipeline.stage_count = 3;
+
+	struct queue_t *queues[3];
+	for(unsigned int i=0; i<pipeline.stage_count; i++)
+		queues[i] = queue_create(threads * QUEUE_DEPTH);
+
+	/* Start every stage before queueing work so loading overlaps with the rest */
+	for(unsigned int i=0; i<pipeline.stage_count; i++)
+	{
+		struct stage_t *stage = &pipeline.stages[i];
+		stage->pipeline = &pipeline;
+		stage->func = funcs[i];
+		stage->trace = traces[i];
+		stage->in = queues[i];
+		stage->out = i + 1 < pipeline.stage_count ? queues[i+1] : NULL;
+		stage->threads = malloc(threads * sizeof(pthread_t));
+		stage->active = threads;
+
+		for(unsigned int t=0; t<threads; t++)
+			pthread_create(&stage->threads[t], NULL, stage_worker, stage);
+	}
+
+	for(unsigned int i=0; i<batch->count; i++)
+	{
+		struct batch_job_t *job = buffer_calloc(sizeof(struct batch_job_t));
+		job->src = batch->paths[i];
+		trace_begin(&job->span, TRACE_FILE, job->src);
+
+		int input_type = image_type_from_path(job->src);
+		if(input_type < 0 || !image_type_loadable(input_type) || (lumps && lumps[i] < 0))
+		{
+			if(!lumps)
+				printf("Error: Unsupported file type %s\n", job->src);
+			finish_job(&pipeline, job, 0);
+			continue;
+		}
+
+		job->input_type = input_type;
+		job->output_type = options->output_type >= 0 ? options->output_type : input_type;
+		job->dest = lumps ? NULL : image_default_dest(job->src, job->output_type);
+		job->lump = lumps ? lumps[i] : -1;
+
+		queue_push(queues[0], job);
+	}
+	queue_close(queues[0]);
+
+	for(unsigned int i=0; i<pipeline.stage_count; i++)
+	{
+		for(unsigned int t=0; t<threads; t++)
+			pthread_join(pipeline.stages[i].threads[t], NULL);
+
+		free(pipeline.stages[i].threads);
+		queue_destroy(queues[i]);
+	}
+
+	printf("Converted %u of %u files", pipeline.converted, batch->count);
+	if(pipeline.failed)
+		printf(", %u failed", pipeline.failed);
+	printf("\n");
+
+	pthread_mutex_destroy(&pipeline.lock);
+	free(lumps);
+	return pipeline.failed;
+}
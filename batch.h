@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "convert.h"
+#include "incremental.h"
+#include "wad.h"
+
+struct batch_options_t
+{
+	struct convert_options_t convert;
+	int output_type;			// -1 = same type as each source
+	unsigned int threads;		// workers per pipeline stage
+	unsigned int stream;		// convert each file row by row in a single stage
+	struct incremental_t *incremental;	// skip files whose output is cached, NULL = always convert
+	struct wad_t *wad;			// pack miptex outputs into this archive instead of writing files, NULL = files.
+								// Lumps are added and laid out by batch_run, closing it is up to the caller
+};
+
+/* List of source images to convert in one process */
+struct batch_t
+{
+	char **paths;
+	unsigned int count;
+	unsigned int capacity;
+};
+
+extern struct batch_t *batch_create(void);
+
+/* Add a source image, or every image below a directory */
+extern int batch_add_path(struct batch_t *batch, const char *path);
+
+/* Add one source path per line, e.g. from stdin */
+extern int batch_add_list(struct batch_t *batch, FILE *list);
+
+/* Convert every source through overlapping load, convert and write stages.
+   Failed files are reported and skipped, returns the number of failures */
+extern unsigned int batch_run(struct batch_t *batch, const struct batch_options_t *options);
+
+extern void batch_free(struct batch_t *batch);
@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <png.h>
+
+#include "convert.h"
+#include "image.h"
+#include "png.h"
+
+/* Throughput benchmark, built and run by make bench. Generated images go through the
+   load, convert and write stages separately, each reporting Mpixel/s and the heap
+   allocations it made. Results can also be written as JSON to track them across releases */
+
+#define BENCH_MAX_SIZES 8
+
+/* Above this many pixels a single run of each stage is enough */
+#define BENCH_SINGLE_RUN_PIXELS (4096 * 4096)
+
+enum bench_image_t
+{
+	BENCH_GRADIENT,		// smooth ramps, long runs of near colors
+	BENCH_NOISE,		// every pixel random, worst case for the color cache
+	BENCH_LOWCOLOR,		// 16 colors in 8x8 blocks, like pixel art or flat UI
+	BENCH_TEXTURE,		// smooth color noise plus grain, like photo sourced textures
+	BENCH_IMAGE_COUNT,
+};
+
+static const char *image_names[] = { "gradient", "noise", "lowcolor", "texture" };
+
+enum bench_stage_t
+{
+	STAGE_LOAD,
+	STAGE_CONVERT,
+	STAGE_WRITE,
+	STAGE_COUNT,
+};
+
+static const char *stage_names[] = { "load", "convert", "write" };
+
+struct bench_result_t
+{
+	enum bench_image_t image;
+	unsigned int size;
+	enum image_type_t type;
+	enum bench_stage_t stage;
+	double seconds;					// best of the runs
+	unsigned long allocations;		// malloc, calloc and realloc calls in one run
+	unsigned long long bytes;		// bytes they requested
+};
+
+struct bench_options_t
+{
+	struct convert_options_t convert;
+	const char *method;
+	const char *metric;
+	const char *dither;
+	unsigned int sizes[BENCH_MAX_SIZES];
+	unsigned int size_count;
+	unsigned int runs;
+	const char *json;
+	const char *tmpdir;
+};
+
+/* Heap use, counted by linking with --wrap for the allocation functions */
+static unsigned long alloc_count;
+static unsigned long long alloc_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static void count_alloc(size_t size)
+{
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void *__wrap_malloc(size_t size)
+{
+	count_alloc(size);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+	count_alloc(count * size);
+	return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	count_alloc(size);
+	return __real_realloc(ptr, size);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned int xorshift(unsigned int *state)
+{
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static unsigned char clamp255(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Top-down packed RGB, the same for every run */
+static unsigned char *generate_image(enum bench_image_t kind, unsigned int size)
+{
+	unsigned char *rgb = malloc((size_t)size * size * 3);
+	if(!rgb)
+		return NULL;
+
+	unsigned int seed = 0x9e3779b9u ^ (kind * 7919 + size);
+	unsigned char colors[16][3], grid[33][33][3];
+
+	for(int i=0; i<16; i++)
+		for(int c=0; c<3; c++)
+			colors[i][c] = xorshift(&seed);
+	for(int i=0; i<33; i++)
+		for(int j=0; j<33; j++)
+			for(int c=0; c<3; c++)
+				grid[i][j][c] = xorshift(&seed);
+
+	for(unsigned int y=0; y<size; y++)
+	{
+		unsigned char *p = rgb + (size_t)y * size * 3;
+		for(unsigned int x=0; x<size; x++, p+=3)
+		{
+			switch(kind)
+			{
+				case BENCH_GRADIENT:
+					p[0] = x * 255 / (size - 1);
+					p[1] = y * 255 / (size - 1);
+					p[2] = (x + y) * 255 / (2 * size - 2);
+					break;
+				case BENCH_NOISE:
+				{
+					unsigned int r = xorshift(&seed);
+					p[0] = r;
+					p[1] = r >> 8;
+					p[2] = r >> 16;
+					break;
+				}
+				case BENCH_LOWCOLOR:
+				{
+					unsigned int block = ((y >> 3) * 2654435761u) ^ ((x >> 3) * 40503u);
+					memcpy(p, colors[(block >> 7) & 15], 3);
+					break;
+				}
+				default:
+				{
+					/* Bilinear blend of a 32x32 grid of random colors */
+					unsigned int gx = x * 32 / size, gy = y * 32 / size;
+					unsigned int fx = (x * 32 % size) * 256 / size, fy = (y * 32 % size) * 256 / size;
+					int grain = (int)(xorshift(&seed) & 15) - 8;
+					for(int c=0; c<3; c++)
+					{
+						int top = grid[gy][gx][c] * (256 - fx) + grid[gy][gx+1][c] * fx;
+						int bottom = grid[gy+1][gx][c] * (256 - fx) + grid[gy+1][gx+1][c] * fx;
+						p[c] = clamp255(((top * (256 - fy) + bottom * fy) >> 16) + grain);
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	return rgb;
+}
+
+/* 24bit BMP source, bottom-up BGR rows padded to 4 bytes */
+static int write_source_bmp(const unsigned char *rgb, unsigned int size, const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	if(!f)
+		return 0;
+
+	unsigned int stride = (size * 3 + 3) & ~3u;
+	unsigned int image_size = stride * size;
+	unsigned char header[54] = { 'B', 'M' };
+	unsigned int fields[] = { 2, 54 + image_size, 10, 54, 14, 40, 18, size, 22, size, 34, image_size };
+
+	for(unsigned int i=0; i<sizeof(fields)/sizeof(fields[0]); i+=2)
+		for(int b=0; b<4; b++)
+			header[fields[i]+b] = fields[i+1] >> (b * 8);
+	header[26] = 1;		// planes
+	header[28] = 24;	// bpp
+
+	unsigned char *row = calloc(stride, 1);
+	int ok = row && fwrite(header, sizeof(header), 1, f) == 1;
+
+	for(unsigned int y=0; ok && y<size; y++)
+	{
+		const unsigned char *src = rgb + (size_t)(size - 1 - y) * size * 3;
+		for(unsigned int x=0; x<size; x++)
+		{
+			row[x*3] = src[x*3+2];
+			row[x*3+1] = src[x*3+1];
+			row[x*3+2] = src[x*3];
+		}
+		ok = fwrite(row, stride, 1, f) == 1;
+	}
+
+	free(row);
+	return fclose(f) == 0 && ok;
+}
+
+static int write_source_png(const unsigned char *rgb, unsigned int size, const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	if(!f)
+		return 0;
+
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	if(!info || setjmp(png_jmpbuf(png)))
+	{
+		png_destroy_write_struct(&png, &info);
+		fclose(f);
+		return 0;
+	}
+
+	png_init_io(png, f);
+	png_set_IHDR(png, info, size, size, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png, info);
+	for(unsigned int y=0; y<size; y++)
+		png_write_row(png, (png_bytep)(rgb + (size_t)y * size * 3));
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+
+	return fclose(f) == 0;
+}
+
+/* Best time of 'runs' runs of one stage and the allocations of a single run */
+static void begin_run(unsigned long *count, unsigned long long *bytes, double *start)
+{
+	*count = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+	*bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+	*start = now();
+}
+
+static void end_run(struct bench_result_t *r, unsigned long count, unsigned long long bytes, double start)
+{
+	double seconds = now() - start;
+	if(r->seconds == 0 || seconds < r->seconds)
+		r->seconds = seconds;
+
+	r->allocations = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - count;
+	r->bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED) - bytes;
+}
+
+static int bench_case(const struct bench_options_t *options, enum bench_image_t kind, unsigned int size, enum image_type_t type, const unsigned char *rgb, struct bench_result_t *results)
+{
+	char src_path[4096], dst_path[4096];
+	snprintf(src_path, sizeof(src_path), "%s/qpalette-bench-%d.%s", options->tmpdir, (int)getpid(), type == IMAGE_BMP ? "bmp" : "png");
+	snprintf(dst_path, sizeof(dst_path), "%s/qpalette-bench-%d_conv.%s", options->tmpdir, (int)getpid(), type == IMAGE_BMP ? "bmp" : "png");
+
+	if(!(type == IMAGE_BMP ? write_source_bmp(rgb, size, src_path) : write_source_png(rgb, size, src_path)))
+	{
+		printf("Failed to write benchmark source %s\n", src_path);
+		remove(src_path);
+		return 0;
+	}
+
+	for(int s=0; s<STAGE_COUNT; s++)
+	{
+		memset(&results[s], 0, sizeof(results[s]));
+		results[s].image = kind;
+		results[s].size = size;
+		results[s].type = type;
+		results[s].stage = s;
+	}
+
+	unsigned int runs = (unsigned long)size * size > BENCH_SINGLE_RUN_PIXELS ? 1 : options->runs;
+	int ok = 1;
+
+	for(unsigned int run=0; ok && run<runs; run++)
+	{
+		unsigned long count;
+		unsigned long long bytes;
+		double start;
+
+		begin_run(&count, &bytes, &start);
+		struct image_t *src = load_image(src_path, type);
+		end_run(&results[STAGE_LOAD], count, bytes, start);
+
+		struct image_t *dst = NULL;
+		if(src)
+		{
+			begin_run(&count, &bytes, &start);
+			dst = to_palette_rgb(src, &options->convert);
+			end_run(&results[STAGE_CONVERT], count, bytes, start);
+		}
+
+		if(dst)
+		{
+			begin_run(&count, &bytes, &start);
+			ok = write_image(dst, dst_path, type);
+			end_run(&results[STAGE_WRITE], count, bytes, start);
+		}
+
+		ok = ok && src && dst;
+		free_image(src);
+		free_image(dst);
+	}
+
+	remove(src_path);
+	remove(dst_path);
+
+	if(!ok)
+		printf("Benchmark of %s %ux%u %s failed\n", image_names[kind], size, size, type == IMAGE_BMP ? "bmp" : "png");
+	return ok;
+}
+
+static void print_result(const struct bench_result_t *r)
+{
+	double mpixels = (double)r->size * r->size / 1e6;
+	printf("%-9s %5ux%-5u %-4s %-8s %10.2f %10.3f %8lu %10.2f\n", image_names[r->image], r->size, r->size,
+		r->type == IMAGE_BMP ? "bmp" : "png", stage_names[r->stage], mpixels / r->seconds, r->seconds * 1e3,
+		r->allocations, r->bytes / (1024.0 * 1024.0));
+}
+
+static int write_json(const struct bench_options_t *options, const struct bench_result_t *results, unsigned int count)
+{
+	FILE *f = strcmp(options->json, "-") ? fopen(options->json, "w") : stdout;
+	if(!f)
+	{
+		printf("Failed to open %s for writing\n", options->json);
+		return 0;
+	}
+
+	fprintf(f, "{\n\t\"version\": 1,\n\t\"threads\": %u,\n\t\"method\": \"%s\",\n\t\"metric\": \"%s\",\n\t\"dither\": \"%s\",\n\t\"results\": [\n",
+		options->convert.threads, options->method, options->metric, options->dither);
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		const struct bench_result_t *r = &results[i];
+		fprintf(f, "\t\t{\"image\": \"%s\", \"width\": %u, \"height\": %u, \"format\": \"%s\", \"stage\": \"%s\", "
+			"\"seconds\": %.6f, \"mpixels_per_second\": %.3f, \"allocations\": %lu, \"allocated_bytes\": %llu}%s\n",
+			image_names[r->image], r->size, r->size, r->type == IMAGE_BMP ? "bmp" : "png", stage_names[r->stage],
+			r->seconds, (double)r->size * r->size / 1e6 / r->seconds, r->allocations, r->bytes, i + 1 < count ? "," : "");
+	}
+
+	fprintf(f, "\t]\n}\n");
+	return f == stdout ? 1 : fclose(f) == 0;
+}
+
+static void print_usage(char *argv0)
+{
+	printf("\n-- Usage --\n");
+	printf("%s [options]\n", argv0);
+	printf("\n-- Options --\n");
+	printf("-c   -  Color distance metric, as for qpalette - default is rgb\n");
+	printf("-d   -  Dithering, as for qpalette - default is none\n");
+	printf("-j   -  Number of worker threads used for conversion and PNG compression - default is 1\n");
+	printf("-m   -  Color matching method, as for qpalette - default is auto\n");
+	printf("-o   -  Write the results as JSON to a file, - for stdout\n");
+	printf("-r   -  Runs of each stage, the best is reported - default is 3, 1 above 4096x4096\n");
+	printf("-s   -  Image sizes, e.g. -s 64,512 - default is 64,512,2048,8192\n");
+	printf("-t   -  Directory for the generated images - default is $TMPDIR or /tmp\n");
+}
+
+static int parse_sizes(char *arg, struct bench_options_t *options)
+{
+	options->size_count = 0;
+	for(char *p = strtok(arg, ","); p; p = strtok(NULL, ","))
+	{
+		int size = atoi(p);
+		if(size < 16 || size > 8192 || options->size_count == BENCH_MAX_SIZES)
+		{
+			printf("Invalid image size: %s\n", p);
+			return 0;
+		}
+		options->sizes[options->size_count++] = size;
+	}
+
+	return options->size_count > 0;
+}
+
+static int parse_options(int argc, char **argv, struct bench_options_t *options)
+{
+	static const unsigned int default_sizes[] = { 64, 512, 2048, 8192 };
+
+	memset(options, 0, sizeof(*options));
+	options->convert.threads = 1;
+	options->convert.mip_levels = 1;
+	options->method = "auto";
+	options->metric = "rgb";
+	options->dither = "none";
+	options->runs = 3;
+	options->tmpdir = getenv("TMPDIR") && getenv("TMPDIR")[0] ? getenv("TMPDIR") : "/tmp";
+	options->size_count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+	memcpy(options->sizes, default_sizes, sizeof(default_sizes));
+
+	int c;
+	while ((c = getopt(argc, argv, "c:d:hj:m:o:r:s:t:")) != -1)
+	{
+		switch (c)
+		{
+			case 'c': if(parse_metric(optarg) < 0) return 0; options->convert.metric = parse_metric(optarg); options->metric = optarg; break;
+			case 'd': if(parse_dither_method(optarg) < 0) return 0; options->convert.dither = parse_dither_method(optarg); options->dither = optarg; break;
+			case 'j': if(atoi(optarg) < 1) { printf("Invalid thread count: %s\n", optarg); return 0; } options->convert.threads = atoi(optarg); png_encode.threads = atoi(optarg); break;
+			case 'm': if(parse_match_method(optarg) < 0) return 0; options->convert.match_method = parse_match_method(optarg); options->method = optarg; break;
+			case 'o': options->json = optarg; break;
+			case 'r': if(atoi(optarg) < 1) { printf("Invalid run count: %s\n", optarg); return 0; } options->runs = atoi(optarg); break;
+			case 's': if(!parse_sizes(optarg, options)) return 0; break;
+			case 't': options->tmpdir = optarg; break;
+			default: print_usage(argv[0]); return 0;
+		}
+	}
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_options_t options;
+	if(!parse_options(argc, argv, &options))
+		return 1;
+
+	/* Build the matcher tables up front, so the first conversion doesn't pay for them */
+	struct matcher_t matcher;
+	if(!prepare_matcher(&options.convert, (unsigned long)8192 * 8192, &matcher))
+		return 1;
+
+	unsigned int count = 0;
+	struct bench_result_t *results = malloc(BENCH_IMAGE_COUNT * BENCH_MAX_SIZES * 2 * STAGE_COUNT * sizeof(struct bench_result_t));
+	if(!results)
+		return 1;
+
+	printf("%-9s %11s %-4s %-8s %10s %10s %8s %10s\n", "image", "size", "fmt", "stage", "Mpixel/s", "ms", "allocs", "alloc MB");
+
+	int failed = 0;
+	for(unsigned int s=0; s<options.size_count; s++)
+	{
+		for(int kind=0; kind<BENCH_IMAGE_COUNT; kind++)
+		{
+			unsigned char *rgb = generate_image(kind, options.sizes[s]);
+			if(!rgb)
+			{
+				printf("Failed to malloc benchmark image\n");
+				failed = 1;
+				continue;
+			}
+
+			for(int type=IMAGE_BMP; type<=IMAGE_PNG; type++)
+			{
+				if(!bench_case(&options, kind, options.sizes[s], type, rgb, results + count))
+				{
+					failed = 1;
+					continue;
+				}
+
+				for(int stage=0; stage<STAGE_COUNT; stage++)
+					print_result(&results[count++]);
+			}
+
+			free(rgb);
+		}
+	}
+
+	if(options.json && !write_json(&options, results, count))
+		failed = 1;
+
+	free(results);
+	return failed;
+}
@@ -1,9 +1,23 @@
+/* 64 bit file offsets for the row reader and writer on 32 bit systems */
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
 
 #include "defs.h"
 #include "colormap.h"
+#include "stream.h"
+#include "mapfile.h"
+#include "buffer.h"
+#include "image.h"
 
 #pragma pack(push, 1)
 struct bmp_header_t
@@ -33,154 +47,202 @@ struct bmp_dib_header_t
 };
 #pragma pack(pop)
 
-struct bmp_header_t *read_bmp_header(FILE *file)
+/* Validate BMP header */
+static int check_bmp_header(const struct bmp_header_t *header)
 {
-	struct bmp_header_t *header = malloc(sizeof(struct bmp_header_t));
-	fread(header, sizeof(struct bmp_header_t), 1, file);
-
-	/* Validate BMP header */
 	if(header->header_field != 0x4D42)
 	{
 		printf("Error: Invalid BMP header field\n");
-		free(header);
-		return NULL;
+		return 0;
 	}
 
-	return header;
+	return 1;
 }
 
-struct bmp_dib_header_t *read_bmp_dib_header(FILE *file)
+/* Do basic sanity checks, a negative height means rows are stored top-down */
+static int check_bmp_dib_header(const struct bmp_dib_header_t *dib_header)
 {
-	struct bmp_dib_header_t *dib_header = malloc(sizeof(struct bmp_dib_header_t));
-	fread(dib_header, sizeof(struct bmp_dib_header_t), 1, file);
-
-	/* Do basic sanity checks */
-	if(dib_header->width > 8192 || dib_header->height > 8192)
+	if(dib_header->width <= 0 || dib_header->width > IMAGE_MAX_SIZE || dib_header->height == 0 || dib_header->height > IMAGE_MAX_SIZE || dib_header->height < -IMAGE_MAX_SIZE)
 	{
 		printf("Error: BMP has invalid size dimensions.\n");
-		free(dib_header);
-		return NULL;
+		return 0;
 	}
 
 	if(dib_header->planes != 1)
 	{
 		printf("Error: BMP dib_header->planes != 0.\n");
-		free(dib_header);
-		return NULL;
+		return 0;
 	}
 
 	if(dib_header->bpp <= 8)
 	{
 		printf("Error: BMP is already 8bpp format.\n");
-		free(dib_header);
-		return NULL;
+		return 0;
 	}
 
 	if(dib_header->bpp != 24)
 	{
 		printf("Error: Currently only 24bit RGB images are supported.\n");
-		free(dib_header);
-		return NULL;
+		return 0;
 	}
 
 	if(dib_header->compression != 0)
 	{
 		printf("Error: This reader does not support compressed BMP files.\n");
-		free(dib_header);
-		return NULL;
+		return 0;
 	}
 
-	return dib_header;
+	return 1;
 }
 
-struct image_t *load_bmp(const char *path)
+struct bmp_header_t *read_bmp_header(FILE *file)
 {
-	FILE *f = fopen(path, "rb");
-	if(f == NULL)
-		return NULL;
-
-	struct bmp_header_t *header = read_bmp_header(f);
-	if(header == NULL)
+	struct bmp_header_t *header = malloc(sizeof(struct bmp_header_t));
+	if(!header || fread(header, sizeof(struct bmp_header_t), 1, file) != 1 || !check_bmp_header(header))
 	{
-		fclose(f);
+		free(header);
 		return NULL;
 	}
 
-	struct bmp_dib_header_t *dib_header = read_bmp_dib_header(f);
-	if(dib_header == NULL)
+	return header;
+}
+
+struct bmp_dib_header_t *read_bmp_dib_header(FILE *file)
+{
+	struct bmp_dib_header_t *dib_header = malloc(sizeof(struct bmp_dib_header_t));
+	if(!dib_header || fread(dib_header, sizeof(struct bmp_dib_header_t), 1, file) != 1 || !check_bmp_dib_header(dib_header))
 	{
-		fclose(f);
+		free(dib_header);
 		return NULL;
 	}
 
-	/* Begin reading actual data */
-	unsigned char *image_data = malloc(dib_header->width * dib_header->height * dib_header->bpp / 8);
-	if(!image_data)
+	return dib_header;
+}
+
+/* Point the image straight at the pixel rows in file. The padded, BGR rows
+   are described by stride, order and top_down, so nothing is copied */
+static struct image_t *parse_bmp(unsigned char *file, size_t size)
+{
+	struct bmp_header_t header;
+	struct bmp_dib_header_t dib_header;
+	if(size < sizeof(header) + sizeof(dib_header))
 	{
-		printf("Failed to malloc image_data\n");
-		fclose(f);
+		printf("Error: BMP is truncated\n");
 		return NULL;
 	}
 
-	fseek(f, header->data_offset, SEEK_SET);
-	
-	/* Read BMP data row-by-row, taking row padding into consideration */
-	unsigned int padcount = 0;
-	if((dib_header->width * dib_header->bpp / 8) % 4 != 0)
-		padcount = 4 - ((dib_header->width * dib_header->bpp / 8) % 4);
+	memcpy(&header, file, sizeof(header));
+	memcpy(&dib_header, file + sizeof(header), sizeof(dib_header));
+	if(!check_bmp_header(&header) || !check_bmp_dib_header(&dib_header))
+		return NULL;
 
-	for(int y=0; y<dib_header->height; y++)
-	{
-		unsigned int index = y * dib_header->width * dib_header->bpp / 8;
-		fread(image_data+index, dib_header->width * dib_header->bpp / 8, 1, f);
-		fseek(f, padcount, SEEK_CUR);
-	}
+	unsigned int height = abs(dib_header.height);
+
+	/* Rows are padded to 4 bytes */
+	unsigned int stride = ((size_t)dib_header.width * dib_header.bpp / 8 + 3) & ~(size_t)3;
 
-	/* .BMP files are BGR, Iterate through data and swap BGR data to RGB */
-	for(unsigned int i=0; i<dib_header->width*dib_header->height*dib_header->bpp / 8; i+=3) // FIXME
+	if(header.data_offset > size || (size - header.data_offset) / stride < height)
 	{
-		unsigned char stor = image_data[i];
-		image_data[i] = image_data[i+2];
-		image_data[i+2] = stor;
+		printf("Error: BMP is truncated\n");
+		return NULL;
 	}
 
 	/* Setup return structures */
-	struct image_t *img = malloc(sizeof(struct image_t));
+	struct image_t *img = image_alloc();
 
 	if(!img)
+	{
 		printf("Failed to malloc image_t\n");
+		return NULL;
+	}
 
-	img->info = malloc(sizeof(struct img_info_t));
-	img->info->bpp = dib_header->bpp;
+	img->info->bpp = dib_header.bpp;
 	img->info->channels = 3;
-	img->info->width = dib_header->width;
-	img->info->height = dib_header->height;
-	img->data = image_data;
+	img->info->width = dib_header.width;
+	img->info->height = height;
+	img->info->stride = stride;
+	img->info->order = PIXEL_BGR;
+	img->info->top_down = dib_header.height < 0;
+	img->info->levels = 1;
+	img->data = file + header.data_offset;
+	img->mapping = NULL;
+	img->mapping_size = 0;
 
-	/* Cleanup and return loaded image */
-	free(header);
-	free(dib_header);
-	fclose(f);
+	return img;
+}
+
+/* Map the file, the image keeps the mapping */
+struct image_t *load_bmp(const char *path)
+{
+	size_t size;
+	unsigned char *file = map_file(path, &size);
+	if(file == NULL)
+		return NULL;
+
+	struct image_t *img = parse_bmp(file, size);
+	if(img == NULL)
+	{
+		unmap_file(file, size);
+		return NULL;
+	}
+
+	img->mapping = file;
+	img->mapping_size = size;
 
 	return img;
 }
 
-int write_bmp(struct image_t *image, const char *path)
+struct image_t *load_bmp_memory(const unsigned char *data, size_t size)
+{
+	struct image_t *img = parse_bmp((unsigned char *)data, size);
+	if(img == NULL)
+		return NULL;
+
+	/* The caller keeps its buffer, the image gets its own rows */
+	size_t rows = (size_t)img->info->stride * img->info->height;
+	unsigned char *copy = buffer_alloc(rows);
+	if(!copy)
+	{
+		img->data = NULL;
+		free_image(img);
+		return NULL;
+	}
+
+	memcpy(copy, img->data, rows);
+	img->data = copy;
+
+	return img;
+}
+
+/* Headers and the 256 entry palette in front of 8bit rows */
+#define BMP_HEADERS_SIZE (sizeof(struct bmp_header_t) + sizeof(struct bmp_dib_header_t) + 256*4)
+
+size_t bmp_file_size(unsigned int width, unsigned int height)
+{
+	/* Rows are padded to 4 bytes */
+	return BMP_HEADERS_SIZE + (size_t)((width + 3) & ~3) * height;
+}
+
+/* Fills BMP_HEADERS_SIZE bytes of out */
+static void encode_bmp_headers(unsigned char *out, unsigned int width, unsigned int height)
 {
 	/* Prepare BMP header */
 	struct bmp_header_t header;
 	header.header_field = 0x4D42;
-	header.size = sizeof(struct bmp_header_t) + sizeof(struct bmp_dib_header_t) + 256*4 + image->info->width * image->info->height * image->info->bpp / 8;
-	memset(&header+6, 0, 4); // Set reserved bytes to 0
-	header.data_offset = sizeof(struct bmp_header_t) + sizeof(struct bmp_dib_header_t) + 256*4; // 256*4 = colormap len * 4
+	/* The size field is only 32 bits, readers go by the dimensions for anything larger */
+	size_t size = bmp_file_size(width, height);
+	header.size = size > 0xFFFFFFFFu ? 0 : size;
+	memset(header.reserved1, 0, 2);
+	memset(header.reserved2, 0, 2);
+	header.data_offset = BMP_HEADERS_SIZE;
 
 	/* Prepare BMP DIB header */
 	struct bmp_dib_header_t dib_header;
 	dib_header.dib_length = 40;
-	dib_header.width = image->info->width;
-	dib_header.height = image->info->height;
+	dib_header.width = width;
+	dib_header.height = height;
 	dib_header.planes = 1;
-	dib_header.bpp = image->info->bpp;
+	dib_header.bpp = 8;
 	dib_header.compression = 0;
 	dib_header.image_size = 0;
 	dib_header.res_h = 0;
@@ -188,46 +250,307 @@ int write_bmp(struct image_t *image, const char *path)
 	dib_header.palette_colors = 0; // 0 = 2^n
 	dib_header.imp_colors = 0;
 
-	/* NOTE: Should swap image data RGB to BGR if 24bit here - but since we only ever output paletted images, don't bother */
+	memcpy(out, &header, sizeof(struct bmp_header_t));
+	out += sizeof(struct bmp_header_t);
+	memcpy(out, &dib_header, sizeof(struct bmp_dib_header_t));
+	out += sizeof(struct bmp_dib_header_t);
+
+	/* Colormap, BMP requires 4 byte B, G, R, 0x00 */
+	for(int i=0; i<256; i++)
+	{
+		out[i*4+0] = cmap[i*3+2];
+		out[i*4+1] = cmap[i*3+1];
+		out[i*4+2] = cmap[i*3+0];
+		out[i*4+3] = 0x00;
+	}
+}
+
+size_t write_bmp_memory(const struct image_t *image, unsigned char *buffer, size_t size)
+{
+	unsigned int width = image->info->width, height = image->info->height;
+	size_t file_size = bmp_file_size(width, height);
+	if(size < file_size)
+		return 0;
+
+	encode_bmp_headers(buffer, width, height);
+
+	/* Rows are already bottom-up, only the padding needs adding */
+	unsigned int stride = (width + 3) & ~3;
+	unsigned char *out = buffer + BMP_HEADERS_SIZE;
+	for(unsigned int y=0; y<height; y++, out += stride)
+	{
+		memcpy(out, image->data + (size_t)y * width, width);
+		memset(out + width, 0, stride - width);
+	}
+
+	return file_size;
+}
+
+struct bmp_part_t
+{
+	const void *data;
+	size_t size;
+};
 
-	/* Open file for writing */
+#ifdef _WIN32
+
+static int write_parts(const char *path, const struct bmp_part_t *parts, unsigned int count)
+{
 	FILE *f = fopen(path, "wb");
 	if(!f)
+		return 0;
+
+	int ok = 1;
+	for(unsigned int i=0; i<count; i++)
+		ok &= fwrite(parts[i].data, parts[i].size, 1, f) == 1;
+
+	return fclose(f) == 0 && ok;
+}
+
+#else
+
+/* One writev for the whole file, repeated only if the kernel takes less */
+static int write_parts(const char *path, const struct bmp_part_t *parts, unsigned int count)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0)
+		return 0;
+
+	struct iovec iov[2];
+	for(unsigned int i=0; i<count; i++)
 	{
-		printf("Failed to open %s for writing\n", path);
+		iov[i].iov_base = (void *)parts[i].data;
+		iov[i].iov_len = parts[i].size;
+	}
+
+	struct iovec *v = iov;
+	int ok = 1;
+	while(count)
+	{
+		ssize_t written = writev(fd, v, count);
+		if(written < 0 && errno == EINTR)
+			continue;
+		if(written <= 0)
+		{
+			ok = 0;
+			break;
+		}
+
+		while(count && (size_t)written >= v->iov_len)
+		{
+			written -= v->iov_len;
+			v++;
+			count--;
+		}
+		if(count)
+		{
+			v->iov_base = (char *)v->iov_base + written;
+			v->iov_len -= written;
+		}
+	}
+
+	return close(fd) == 0 && ok;
+}
+
+#endif
+
+int write_bmp(struct image_t *image, const char *path)
+{
+	/* NOTE: Should swap image data RGB to BGR if 24bit here - but since we only ever output paletted images, don't bother */
+
+	unsigned int width = image->info->width, height = image->info->height;
+	int ok;
+
+	if(width % 4 == 0)
+	{
+		/* Rows need no padding, so the image data goes out as is behind the headers */
+		unsigned char headers[BMP_HEADERS_SIZE];
+		encode_bmp_headers(headers, width, height);
+
+		struct bmp_part_t parts[2] = { { headers, sizeof(headers) }, { image->data, (size_t)width * height } };
+		ok = write_parts(path, parts, 2);
+	}
+	else
+	{
+		size_t size = bmp_file_size(width, height);
+		unsigned char *buffer = buffer_alloc(size);
+		if(!buffer)
+			return 0;
+
+		write_bmp_memory(image, buffer, size);
+
+		struct bmp_part_t part = { buffer, size };
+		ok = write_parts(path, &part, 1);
+		buffer_free(buffer);
+	}
+
+	if(!ok)
+		printf("Failed to write %s\n", path);
+
+	return ok;
+}
+
+/* Files past 2GB need 64 bit offsets, long is 32 bits on Windows */
+static int seek_row(FILE *f, unsigned long long offset)
+{
+#ifdef _WIN32
+	return _fseeki64(f, offset, SEEK_SET);
+#else
+	return fseeko(f, offset, SEEK_SET);
+#endif
+}
+
+/* Row reader, seeks to each row since BMP stores them bottom-up */
+struct bmp_row_state_t
+{
+	FILE *f;
+	unsigned int data_offset;
+	unsigned int stride;
+	unsigned int width;
+	unsigned int height;
+	unsigned int top_down;
+	unsigned int y;
+};
+
+static int bmp_read_row(void *state, unsigned char *rgb)
+{
+	struct bmp_row_state_t *s = state;
+	if(s->y >= s->height)
+		return 0;
+
+	unsigned int row = s->top_down ? s->y : s->height - 1 - s->y;
+
+	if(seek_row(s->f, s->data_offset + (unsigned long long)row * s->stride) != 0 || fread(rgb, (size_t)s->width * 3, 1, s->f) != 1)
+	{
+		printf("Error: BMP is truncated\n");
 		return 0;
 	}
 
-	/* Write headers */
-	fwrite(&header, sizeof(struct bmp_header_t), 1, f);
-	fwrite(&dib_header, sizeof(struct bmp_dib_header_t), 1, f);
+	s->y++;
+	return 1;
+}
 
-	/* Write colormap, BMP requires 4 byte R, G, B, 0x00 */
-	for(int i=0; i<256; i++)
+static void bmp_close_reader(void *state)
+{
+	struct bmp_row_state_t *s = state;
+	fclose(s->f);
+	free(s);
+}
+
+int bmp_open_reader(const char *path, struct row_reader_t *reader)
+{
+	FILE *f = fopen(path, "rb");
+	if(f == NULL)
+		return 0;
+
+	struct bmp_header_t *header = read_bmp_header(f);
+	if(header == NULL)
+	{
+		fclose(f);
+		return 0;
+	}
+
+	struct bmp_dib_header_t *dib_header = read_bmp_dib_header(f);
+	if(dib_header == NULL)
 	{
-		/* memcpy would be faster here, but we have to convert RGB to BGR */
-		unsigned char color[4];
-		color[0] = cmap[i*3+2];
-		color[1] = cmap[i*3+1];
-		color[2] = cmap[i*3+0];
-		color[3] = 0x00;
+		free(header);
+		fclose(f);
+		return 0;
+	}
 
-		fwrite(&color, 4, 1, f);
+	struct bmp_row_state_t *s = malloc(sizeof(struct bmp_row_state_t));
+	if(!s)
+	{
+		printf("Failed to malloc BMP reader\n");
+		free(header);
+		free(dib_header);
+		fclose(f);
+		return 0;
 	}
 
-	// Write rows to file. Making sure to pad row length to 4 bytes
-	unsigned int padcount = 0;
-	if(image->info->width % 4 != 0)
-		padcount = 4 - (image->info->width % 4);
+	s->f = f;
+	s->data_offset = header->data_offset;
+	s->width = dib_header->width;
+	s->height = abs(dib_header->height);
+	s->top_down = dib_header->height < 0;
+	s->stride = (s->width * 3 + 3) & ~3;
+	s->y = 0;
+
+	/* Rows are handed out in BGR order, the converter reads them as is */
+	reader->width = s->width;
+	reader->height = s->height;
+	reader->order = PIXEL_BGR;
+	reader->state = s;
+	reader->read_row = bmp_read_row;
+	reader->close = bmp_close_reader;
+
+	free(header);
+	free(dib_header);
+	return 1;
+}
 
-	for(int y=0; y<image->info->height; y++)
+/* Row writer, the headers fix the file layout so each row can be written in place */
+static int bmp_write_row(void *state, const unsigned char *indices)
+{
+	struct bmp_row_state_t *s = state;
+	if(s->y >= s->height)
+		return 0;
+
+	static const unsigned char padding[4] = { 0, 0, 0, 0 };
+
+	if(seek_row(s->f, s->data_offset + (unsigned long long)(s->height - 1 - s->y) * s->stride) != 0)
+		return 0;
+	fwrite(indices, s->width, 1, s->f);
+	fwrite(padding, s->stride - s->width, 1, s->f);
+
+	s->y++;
+	return 1;
+}
+
+static int bmp_close_writer(void *state)
+{
+	struct bmp_row_state_t *s = state;
+	int ok = !ferror(s->f) && s->y == s->height;
+
+	if(fclose(s->f) != 0)
+		ok = 0;
+
+	free(s);
+	return ok;
+}
+
+int bmp_open_writer(const char *path, unsigned int width, unsigned int height, struct row_writer_t *writer)
+{
+	FILE *f = fopen(path, "wb");
+	if(!f)
 	{
-		unsigned int index = y * image->info->width * image->info->bpp / 8;
-		fwrite(image->data+index, image->info->width * image->info->bpp / 8, 1, f);
-		for(int p=0; p<padcount; p++)
-			putc(0, f);
+		printf("Failed to open %s for writing\n", path);
+		return 0;
 	}
 
-	fclose(f);
+	unsigned char headers[BMP_HEADERS_SIZE];
+	encode_bmp_headers(headers, width, height);
+	fwrite(headers, sizeof(headers), 1, f);
+
+	struct bmp_row_state_t *s = malloc(sizeof(struct bmp_row_state_t));
+	if(!s)
+	{
+		printf("Failed to malloc BMP writer\n");
+		fclose(f);
+		return 0;
+	}
+
+	s->f = f;
+	s->data_offset = sizeof(headers);
+	s->width = width;
+	s->height = height;
+	s->top_down = 0;
+	s->stride = (width + 3) & ~3;
+	s->y = 0;
+
+	writer->state = s;
+	writer->write_row = bmp_write_row;
+	writer->close = bmp_close_writer;
+
 	return 1;
 }
\ No newline at end of file
@@ -1,7 +1,21 @@
 #pragma once
 
 #include "defs.h"
+#include "stream.h"
 
 extern struct image_t *load_bmp(const char *path);
 
-extern int write_bmp(struct image_t *image, const char *path);
\ No newline at end of file
+/* load_bmp from a whole file in memory, the image doesn't refer back to data */
+extern struct image_t *load_bmp_memory(const unsigned char *data, size_t size);
+
+extern int write_bmp(struct image_t *image, const char *path);
+
+/* Size of the file write_bmp produces for an 8bit image */
+extern size_t bmp_file_size(unsigned int width, unsigned int height);
+
+/* write_bmp into a caller's buffer, returns the bytes written or 0 if size is too small */
+extern size_t write_bmp_memory(const struct image_t *image, unsigned char *buffer, size_t size);
+
+extern int bmp_open_reader(const char *path, struct row_reader_t *reader);
+
+extern int bmp_open_writer(const char *path, unsigned int width, unsigned int height, struct row_writer_t *writer);
\ No newline at end of file
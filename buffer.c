@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "buffer.h"
+
+/* Smallest class, every request below shares it */
+#define BUFFER_MIN_SHIFT 6
+
+/* Four classes per power of two, up to 2^63 */
+#define BUFFER_CLASSES ((64 - BUFFER_MIN_SHIFT) * 4 + 1)
+
+/* Kept buffers past these limits are freed instead */
+#define BUFFER_CACHE_MAX ((size_t)512 * 1024 * 1024)
+#define BUFFER_CLASS_MAX 16
+
+/* In front of every buffer, keeping the data aligned as malloc would */
+union buffer_header_t
+{
+	struct
+	{
+		union buffer_header_t *next;	// free list of the class while kept
+		size_t capacity;
+		unsigned int size_class;
+	} h;
+	max_align_t align;
+};
+
+static union buffer_header_t *free_lists[BUFFER_CLASSES];
+static unsigned int free_counts[BUFFER_CLASSES];
+static size_t cached;
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Class of a request and the capacity its buffers have */
+static unsigned int size_class(size_t size, size_t *capacity)
+{
+	if(size <= ((size_t)1 << BUFFER_MIN_SHIFT))
+	{
+		*capacity = (size_t)1 << BUFFER_MIN_SHIFT;
+		return 0;
+	}
+
+	unsigned int shift = BUFFER_MIN_SHIFT;
+	while(shift < 63 && ((size_t)1 << (shift + 1)) < size)
+		shift++;
+
+	size_t base = (size_t)1 << shift;
+	size_t step = base / 4;
+	size_t quarters = (size - base + step - 1) / step;
+
+	*capacity = base + quarters * step;
+	return (shift - BUFFER_MIN_SHIFT) * 4 + quarters;
+}
+
+void *buffer_alloc(size_t size)
+{
+	size_t capacity;
+	unsigned int c = size_class(size, &capacity);
+	if(c >= BUFFER_CLASSES || capacity > (size_t)-1 - sizeof(union buffer_header_t))
+		return NULL;
+
+	pthread_mutex_lock(&buffer_lock);
+	union buffer_header_t *header = free_lists[c];
+	if(header)
+	{
+		free_lists[c] = header->h.next;
+		free_counts[c]--;
+		cached -= capacity;
+	}
+	pthread_mutex_unlock(&buffer_lock);
+
+	if(!header)
+	{
+		header = malloc(sizeof(union buffer_header_t) + capacity);
+		if(!header)
+			return NULL;
+
+		header->h.capacity = capacity;
+		header->h.size_class = c;
+	}
+
+	return header + 1;
+}
+
+void *buffer_calloc(size_t size)
+{
+	void *data = buffer_alloc(size);
+	if(data)
+		memset(data, 0, size);
+	return data;
+}
+
+void buffer_free(void *data)
+{
+	if(!data)
+		return;
+
+	union buffer_header_t *header = (union buffer_header_t *)data - 1;
+	unsigned int c = header->h.size_class;
+
+	pthread_mutex_lock(&buffer_lock);
+	int keep = free_counts[c] < BUFFER_CLASS_MAX && cached + header->h.capacity <= BUFFER_CACHE_MAX;
+	if(keep)
+	{
+		header->h.next = free_lists[c];
+		free_lists[c] = header;
+		free_counts[c]++;
+		cached += header->h.capacity;
+	}
+	pthread_mutex_unlock(&buffer_lock);
+
+	if(!keep)
+		free(header);
+}
+
+size_t buffer_cached(void)
+{
+	pthread_mutex_lock(&buffer_lock);
+	size_t bytes = cached;
+	pthread_mutex_unlock(&buffer_lock);
+
+	return bytes;
+}
+
+void buffer_trim(void)
+{
+	pthread_mutex_lock(&buffer_lock);
+	for(unsigned int c=0; c<BUFFER_CLASSES; c++)
+	{
+		while(free_lists[c])
+		{
+			union buffer_header_t *header = free_lists[c];
+			free_lists[c] = header->h.next;
+			free(header);
+		}
+		free_counts[c] = 0;
+	}
+	cached = 0;
+	pthread_mutex_unlock(&buffer_lock);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Recycled allocations for pixel data and everything else made per image. Freed buffers
+   are kept by size class, a quarter of a power of two apart, and handed out again for
+   requests of the same class, so a batch settles into reusing the same few buffers
+   instead of calling malloc for every file. Safe to use from any thread */
+
+extern void *buffer_alloc(size_t size);
+
+/* Zeroed, as calloc */
+extern void *buffer_calloc(size_t size);
+
+/* Only for buffers from buffer_alloc or buffer_calloc, NULL is ignored */
+extern void buffer_free(void *data);
+
+/* Bytes currently kept for reuse */
+extern size_t buffer_cached(void);
+
+/* Release every kept buffer */
+extern void buffer_trim(void);
@@ -1,3 +1,5 @@
+#include "colormap.h"
+
 // Quake 1 colormap
 unsigned int cmap_colors = 256; // We don't use the last 32 colors in Quake since they are used exclusively for fullbright
 unsigned char cmap[768] = {
@@ -258,4 +260,7 @@ unsigned char cmap[768] = {
 	0xff, 0xf7, 0xc7,
 	0xff, 0xff, 0xff,
 	0x9f, 0x5b, 0x53,
-};
\ No newline at end of file
+};
+
+/* Entries 224-255 are the Quake fullbrights */
+unsigned char cmap_flags[256] = { [224 ... 255] = CMAP_FULLBRIGHT };
\ No newline at end of file
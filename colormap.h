@@ -1,4 +1,9 @@
 #pragma once
 
+/* cmap_flags bits */
+#define CMAP_RESERVED 1		// never matched, e.g. a transparency index
+#define CMAP_FULLBRIGHT 2	// only matched with -b
+
 extern unsigned int cmap_colors;
-extern unsigned char cmap[];
\ No newline at end of file
+extern unsigned char cmap[];
+extern unsigned char cmap_flags[];
\ No newline at end of file
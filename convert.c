@@ -0,0 +1,637 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "palette.h"
+#include "image.h"
+#include "pool.h"
+#include "buffer.h"
+#include "simd.h"
+#include "quality.h"
+
+/* Bands per worker, so uneven rows (e.g. flat sky vs detail) still balance out */
+#define BANDS_PER_THREAD 4
+#define MIN_BAND_ROWS 16
+
+struct band_t
+{
+	const struct matcher_t *matcher;
+	const struct image_t *src;
+	unsigned char *dst;
+	unsigned int y0;
+	unsigned int y1;
+	enum dither_method_t dither;
+	unsigned int levels;
+	struct memo_t *memo;	// created by the worker, counters are summed afterwards
+	struct quality_t *quality;	// this band's error, NULL = not measured
+	int ok;
+};
+
+/* Floyd-Steinberg wavefront: worker 'first' runs rows first, first + step, ...
+   each waiting on the progress of the row above it */
+struct fs_worker_t
+{
+	const struct matcher_t *matcher;
+	const struct image_t *src;
+	unsigned char *dst;
+	int *err[2];
+	unsigned int *progress;
+	unsigned int first;
+	unsigned int step;
+	struct memo_t *memo;
+	struct quality_t *quality;
+};
+
+/* Palette matchers, built once per fullbright setting and metric over the usable part of
+   the colormap. The lock covers creating them and building their tables; tables are
+   read-only afterwards */
+static struct matcher_t *matchers[2][METRIC_COUNT];
+static unsigned char usable[2][768];			// colormap entries left after the reserved and fullbright ranges
+static unsigned char usable_index[2][256];
+static unsigned int usable_colors[2];
+static struct quality_palette_t *quality_palette;
+static pthread_mutex_t matchers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Worker pool for conversions with threads > 1, held by one at a time: pool_wait waits
+   for every job, and Floyd-Steinberg workers wait on each other, so each needs a thread */
+static struct pool_t *pool;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Source row for row y of the bottom-up output */
+static const unsigned char *source_row(const struct image_t *src, unsigned int y)
+{
+	const struct img_info_t *info = src->info;
+	unsigned int sy = info->top_down ? info->height - 1 - y : y;
+	return src->data + (size_t)sy * info->stride;
+}
+
+/* Measure a converted row while source and output are still in cache */
+static void measure_row(struct quality_t *quality, const struct image_t *src, const unsigned char *dst, unsigned int y)
+{
+	unsigned int width = src->info->width;
+	unsigned char *heat = quality->heatmap ? quality->heatmap + (size_t)y * width : NULL;
+	quality_row(quality, source_row(src, y), src->info->order, dst + (size_t)y * width, width, heat);
+}
+
+/* Convert rows [y0, y1) of the bottom-up output. Source rows are read in
+   place, whatever their stride, channel order or orientation. Returns 0 if
+   ordered dither has no scratch row, rather than mapping without it */
+static int convert_rows(const struct matcher_t *matcher, struct memo_t *memo, struct quality_t *quality, const struct image_t *src, unsigned char *dst, unsigned int y0, unsigned int y1, enum dither_method_t dither)
+{
+	const struct img_info_t *info = src->info;
+	unsigned char *scratch = NULL;
+	if(dither == DITHER_ORDERED)
+	{
+		scratch = buffer_alloc(info->width * 3);
+		if(!scratch)
+			return 0;
+	}
+
+	for(unsigned int y=y0; y<y1; y++)
+	{
+		if(scratch)
+			dither_ordered_row(matcher, memo, source_row(src, y), info->order, dst + (size_t)y * info->width, info->width, info->height - 1 - y, scratch);
+		else
+			memo_map(memo, matcher, source_row(src, y), info->order, dst + (size_t)y * info->width, info->width);
+
+		if(quality)
+			measure_row(quality, src, dst, y);
+	}
+
+	buffer_free(scratch);
+	return 1;
+}
+
+/* Box filter rows [y0, y1) of the bottom-up output down into the smaller mip levels, a block
+   of 1 << (levels - 1) rows at a time. Run right after convert_rows on the same rows, the
+   source is still in cache. y0 and y1 are multiples of the block. Level rows are mapped
+   as they're made, or with 'rgb' set, stored there (all levels below the full one,
+   bottom-up like dst) for error diffusion afterwards */
+static int convert_mip_rows(const struct matcher_t *matcher, struct memo_t *memo, const struct image_t *src, unsigned char *dst, unsigned int y0, unsigned int y1, unsigned int levels, enum dither_method_t dither, unsigned char *rgb)
+{
+	const struct img_info_t *info = src->info;
+	unsigned int block = 1 << (levels - 1);
+
+	/* Without 'rgb', one block of each level: block / 2 rows of level 1, block / 4 of level 2, ... */
+	unsigned char *base[MAX_MIP_LEVELS];
+	unsigned char *scratch = NULL;
+
+	size_t size = 0;
+	for(unsigned int l=1; l<levels; l++)
+	{
+		unsigned int rows = rgb ? info->height >> l : block >> l;
+		size += (size_t)rows * (info->width >> l) * 3;
+	}
+
+	if(rgb)
+		base[1] = rgb;
+	else
+	{
+		/* Plus a row for ordered dither */
+		scratch = buffer_alloc(size + (info->width / 2) * 3);
+		if(!scratch)
+			return 0;
+		base[1] = scratch;
+	}
+
+	for(unsigned int l=2; l<levels; l++)
+	{
+		unsigned int rows = rgb ? info->height >> (l - 1) : block >> (l - 1);
+		base[l] = base[l-1] + (size_t)rows * (info->width >> (l - 1)) * 3;
+	}
+
+	unsigned char *dither_row = scratch ? scratch + size : NULL;
+
+	for(unsigned int by=y0; by<y1; by+=block)
+	{
+		for(unsigned int l=1; l<levels; l++)
+		{
+			unsigned int lw = info->width >> l, lh = info->height >> l;
+			size_t lstride = (size_t)lw * 3;
+
+			/* First row of this block within the level's buffer */
+			unsigned int first = rgb ? by >> l : 0;
+
+			for(unsigned int r=0; r<(block >> l); r++)
+			{
+				const unsigned char *a, *b;
+				if(l == 1)
+				{
+					a = source_row(src, by + r*2);
+					b = source_row(src, by + r*2 + 1);
+				}
+				else
+				{
+					unsigned int above = (rgb ? by >> (l - 1) : 0) + r*2;
+					a = base[l-1] + (size_t)above * lstride * 2;
+					b = a + lstride * 2;
+				}
+
+				unsigned char *out = base[l] + (first + r) * lstride;
+				simd_downsample(a, b, out, lw);
+
+				if(rgb)
+					continue;
+
+				unsigned int ly = (by >> l) + r;
+				unsigned char *level_dst = dst + image_level_offset(info->width, info->height, l) + (size_t)ly * lw;
+
+				if(dither == DITHER_ORDERED)
+					dither_ordered_row(matcher, memo, out, info->order, level_dst, lw, lh - 1 - ly, dither_row);
+				else
+					memo_map(memo, matcher, out, info->order, level_dst, lw);
+			}
+		}
+	}
+
+	buffer_free(scratch);
+	return 1;
+}
+
+void (*convert_task_runner)(pool_task_t task, void *arg, const char *name) = NULL;
+
+static void run_task(pool_task_t task, void *arg, const char *name)
+{
+	if(convert_task_runner)
+		convert_task_runner(task, arg, name);
+	else
+		task(arg);
+}
+
+static void band_worker(void *arg)
+{
+	struct band_t *band = arg;
+
+	band->memo = memo_create();
+	band->ok = convert_rows(band->matcher, band->memo, band->quality, band->src, band->dst, band->y0, band->y1, band->dither) &&
+		(band->levels < 2 || convert_mip_rows(band->matcher, band->memo, band->src, band->dst, band->y0, band->y1, band->levels, band->dither, NULL));
+}
+
+static void convert_band(void *arg)
+{
+	run_task(band_worker, arg, "band");
+}
+
+/* Error diffuses top to bottom, so rows are visited from the top of the image
+   and written to the matching bottom-up output row */
+static void fs_worker(void *arg)
+{
+	struct fs_worker_t *w = arg;
+	const struct img_info_t *info = w->src->info;
+
+	w->memo = memo_create();
+
+	for(unsigned int row=w->first; row<info->height; row+=w->step)
+	{
+		unsigned int y = info->height - 1 - row;
+		dither_fs_row(w->matcher, w->memo, source_row(w->src, y), info->order, w->dst + (size_t)y * info->width, info->width,
+			w->err[row & 1], w->err[(row + 1) & 1], row ? &w->progress[row-1] : NULL, &w->progress[row]);
+
+		if(w->quality)
+			measure_row(w->quality, w->src, w->dst, y);
+	}
+}
+
+static void fs_task(void *arg)
+{
+	run_task(fs_worker, arg, "fs rows");
+}
+
+/* A quality_t per band or worker, sharing the total's palette and heatmap. Returns 0 if
+   it can't be allocated, and sets *parts to NULL when nothing is measured */
+static int split_quality(const struct quality_t *quality, unsigned int count, struct quality_t **parts)
+{
+	*parts = NULL;
+	if(!quality)
+		return 1;
+
+	*parts = buffer_calloc(count * sizeof(struct quality_t));
+	if(!*parts)
+		return 0;
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		(*parts)[i].palette = quality->palette;
+		(*parts)[i].heatmap = quality->heatmap;
+	}
+
+	return 1;
+}
+
+static void join_quality(struct quality_t *quality, struct quality_t *parts, unsigned int count)
+{
+	if(!parts)
+		return;
+
+	for(unsigned int i=0; i<count; i++)
+		quality_add(quality, &parts[i]);
+	buffer_free(parts);
+}
+
+/* Take the pool with 'threads' workers, until release_pool */
+static int acquire_pool(unsigned int threads)
+{
+	pthread_mutex_lock(&pool_lock);
+
+	if(pool == NULL || pool->thread_count != threads)
+	{
+		pool_destroy(pool);
+		pool = pool_create(threads);
+		if(pool == NULL)
+		{
+			pthread_mutex_unlock(&pool_lock);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void release_pool(void)
+{
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Floyd-Steinberg is serial along the error, but a pixel only depends on the row
+   above up to x+1. Rows are dealt out round-robin and trail each other by a chunk,
+   two error rows are enough since each row stays ahead of the one below. The result
+   is the same as the serial scan for any thread count */
+static int convert_fs(const struct matcher_t *matcher, struct image_t *src, unsigned char *dst, unsigned int threads, struct memo_t *stats, struct quality_t *quality)
+{
+	unsigned int width = src->info->width;
+	unsigned int height = src->info->height;
+
+	if(threads > height)
+		threads = height;
+	if(threads < 1)
+		threads = 1;
+	int *err = buffer_calloc(DITHER_ERR_SIZE(width) * 2 * sizeof(int));
+	unsigned int *progress = buffer_calloc(height * sizeof(unsigned int));
+	struct fs_worker_t *workers = buffer_alloc(threads * sizeof(struct fs_worker_t));
+	struct quality_t *parts = NULL;
+	if(!err || !progress || !workers || !split_quality(quality, threads, &parts))
+	{
+		buffer_free(err);
+		buffer_free(progress);
+		buffer_free(workers);
+		return 0;
+	}
+
+	for(unsigned int i=0; i<threads; i++)
+	{
+		workers[i].matcher = matcher;
+		workers[i].src = src;
+		workers[i].dst = dst;
+		workers[i].err[0] = err;
+		workers[i].err[1] = err + DITHER_ERR_SIZE(width);
+		workers[i].progress = progress;
+		workers[i].first = i;
+		workers[i].step = threads;
+		workers[i].quality = parts ? &parts[i] : NULL;
+	}
+
+	if(threads > 1)
+	{
+		if(!acquire_pool(threads))
+		{
+			buffer_free(err);
+			buffer_free(progress);
+			buffer_free(workers);
+			buffer_free(parts);
+			return 0;
+		}
+
+		/* The queue has room for a job per thread, so the idle pool takes every worker
+		   without growing and none is left waiting on a row that never comes */
+		for(unsigned int i=0; i<threads; i++)
+			pool_submit(pool, fs_task, &workers[i]);
+		pool_wait(pool);
+		release_pool();
+	}
+	else
+		fs_worker(&workers[0]);
+
+	for(unsigned int i=0; i<threads; i++)
+	{
+		memo_add_stats(stats, workers[i].memo);
+		memo_free(workers[i].memo);
+	}
+	join_quality(quality, parts, threads);
+
+	buffer_free(err);
+	buffer_free(progress);
+	buffer_free(workers);
+
+	return 1;
+}
+
+/* Mip levels for Floyd-Steinberg: filtered in one pass over the source, then
+   each level is diffused on its own, top to bottom. Levels are small, so serially */
+static int convert_fs_mips(const struct matcher_t *matcher, struct image_t *src, unsigned char *dst, unsigned int levels, struct memo_t *stats)
+{
+	unsigned int width = src->info->width;
+	unsigned int height = src->info->height;
+
+	size_t full = (size_t)width * height;
+	unsigned char *rgb = buffer_alloc((image_level_offset(width, height, levels) - full) * 3);
+	int *err = buffer_calloc(DITHER_ERR_SIZE(width / 2) * 2 * sizeof(int));
+	struct memo_t *memo = memo_create();
+
+	int ok = rgb && err && convert_mip_rows(matcher, NULL, src, dst, 0, height, levels, DITHER_NONE, rgb);
+
+	for(unsigned int l=1; ok && l<levels; l++)
+	{
+		unsigned int lw = width >> l, lh = height >> l;
+		const unsigned char *level_rgb = rgb + (image_level_offset(width, height, l) - full) * 3;
+		unsigned char *level_dst = dst + image_level_offset(width, height, l);
+
+		memset(err, 0, DITHER_ERR_SIZE(width / 2) * 2 * sizeof(int));
+		for(unsigned int row=0; row<lh; row++)
+		{
+			unsigned int y = lh - 1 - row;
+			dither_fs_row(matcher, memo, level_rgb + (size_t)y * lw * 3, src->info->order, level_dst + (size_t)y * lw, lw,
+				err + (row & 1) * DITHER_ERR_SIZE(lw), err + ((row + 1) & 1) * DITHER_ERR_SIZE(lw), NULL, NULL);
+		}
+	}
+
+	memo_add_stats(stats, memo);
+	memo_free(memo);
+	buffer_free(rgb);
+	buffer_free(err);
+
+	return ok;
+}
+
+/* Split the image into row bands and convert them on the worker pool. Bands
+   write disjoint rows of dst, so the output is identical to the serial path */
+static int convert_parallel(const struct matcher_t *matcher, struct image_t *src, unsigned char *dst, unsigned int threads, enum dither_method_t dither, unsigned int levels, struct memo_t *stats, struct quality_t *quality)
+{
+	unsigned int height = src->info->height;
+
+	unsigned int band_count = threads * BANDS_PER_THREAD;
+	if(band_count > height / MIN_BAND_ROWS)
+		band_count = height / MIN_BAND_ROWS;
+	if(band_count < 1)
+		band_count = 1;
+
+	struct band_t *bands = buffer_alloc(band_count * sizeof(struct band_t));
+	struct quality_t *parts = NULL;
+	if(!bands || !split_quality(quality, band_count, &parts) || !acquire_pool(threads))
+	{
+		buffer_free(bands);
+		buffer_free(parts);
+		return 0;
+	}
+
+	/* With mips, bands start on whole blocks of the smallest level */
+	unsigned int align = ~((1u << (levels - 1)) - 1);
+
+	unsigned int submitted = 0;
+	for(unsigned int i=0; i<band_count; i++)
+	{
+		bands[i].matcher = matcher;
+		bands[i].src = src;
+		bands[i].dst = dst;
+		bands[i].y0 = (unsigned int)((unsigned long long)height * i / band_count) & align;
+		bands[i].y1 = i + 1 < band_count ? (unsigned int)((unsigned long long)height * (i + 1) / band_count) & align : height;
+		bands[i].dither = dither;
+		bands[i].levels = levels;
+		bands[i].quality = parts ? &parts[i] : NULL;
+
+		/* Bands that aren't queued fail the conversion, the ones that are still have to finish */
+		if(!pool_submit(pool, convert_band, &bands[i]))
+			break;
+		submitted++;
+	}
+
+	pool_wait(pool);
+	release_pool();
+
+	int ok = submitted == band_count;
+	for(unsigned int i=0; i<submitted; i++)
+	{
+		ok = ok && bands[i].ok;
+		memo_add_stats(stats, bands[i].memo);
+		memo_free(bands[i].memo);
+	}
+	join_quality(quality, parts, band_count);
+	buffer_free(bands);
+
+	return ok;
+}
+
+/* Tables are built here, before any workers read them, and the matcher is
+   copied so concurrent conversions can each resolve their own strategy */
+int prepare_matcher(const struct convert_options_t *options, unsigned long pixels, struct matcher_t *matcher)
+{
+	unsigned int fullbrights = options->allow_fullbrights > 0;
+
+	pthread_mutex_lock(&matchers_lock);
+
+	if(usable_colors[fullbrights] == 0)
+		usable_colors[fullbrights] = palette_usable(fullbrights, usable[fullbrights], usable_index[fullbrights]);
+
+	unsigned int colors = usable_colors[fullbrights];
+	if(colors == 0)
+	{
+		printf("No palette colors left to match after the reserved and fullbright ranges\n");
+		pthread_mutex_unlock(&matchers_lock);
+		return 0;
+	}
+
+	/* Usable entries that are a prefix of the palette keep their indices */
+	const unsigned char *index = usable_index[fullbrights][colors-1] == colors - 1 ? NULL : usable_index[fullbrights];
+
+	/* The shared matcher keeps the tables of every method asked for so far, each copy
+	   resolves the one its own options ask for */
+	struct matcher_t **shared = &matchers[fullbrights][options->metric];
+	if(*shared == NULL)
+		*shared = matcher_create(usable[fullbrights], colors, index, options->match_method, options->metric);
+	if(*shared)
+		(*shared)->method = options->match_method;
+
+	if(*shared == NULL || !matcher_prepare(*shared, pixels))
+	{
+		pthread_mutex_unlock(&matchers_lock);
+		return 0;
+	}
+
+	*matcher = **shared;
+	pthread_mutex_unlock(&matchers_lock);
+
+	return 1;
+}
+
+int prepare_quality(struct quality_t *quality)
+{
+	if(!quality)
+		return 1;
+
+	pthread_mutex_lock(&matchers_lock);
+	if(quality_palette == NULL)
+		quality_palette = quality_palette_create();
+	quality->palette = quality_palette;
+	pthread_mutex_unlock(&matchers_lock);
+
+	return quality->palette != NULL;
+}
+
+void convert_reset(void)
+{
+	pthread_mutex_lock(&matchers_lock);
+
+	for(unsigned int f=0; f<2; f++)
+	{
+		for(unsigned int m=0; m<METRIC_COUNT; m++)
+		{
+			matcher_free(matchers[f][m]);
+			matchers[f][m] = NULL;
+		}
+		usable_colors[f] = 0;
+	}
+
+	quality_palette_free(quality_palette);
+	quality_palette = NULL;
+
+	pthread_mutex_unlock(&matchers_lock);
+}
+
+int convert_strip(const struct matcher_t *matcher, struct image_t *src, unsigned char *dst, const struct convert_options_t *options, struct memo_t *stats, struct quality_t *quality)
+{
+	if(options->dither == DITHER_FS || !prepare_quality(quality))
+		return 0;
+
+	if(options->threads > 1)
+		return convert_parallel(matcher, src, dst, options->threads, options->dither, 1, stats, quality);
+
+	struct memo_t *memo = memo_create();
+	int ok = convert_rows(matcher, memo, quality, src, dst, 0, src->info->height, options->dither);
+	memo_add_stats(stats, memo);
+	memo_free(memo);
+
+	return ok;
+}
+
+/* Simple RGB comparison */
+struct image_t *to_palette_rgb(struct image_t *src, const struct convert_options_t *options)
+{
+	return to_palette_measured(src, options, NULL);
+}
+
+struct image_t *to_palette_measured(struct image_t *src, const struct convert_options_t *options, struct quality_t *quality)
+{
+	unsigned int width = src->info->width;
+	unsigned int height = src->info->height;
+	unsigned int levels = options->mip_levels > 1 ? options->mip_levels : 1;
+
+	/* Quake wants miptex sizes in multiples of 16, which also keeps every level whole */
+	if(levels > 1 && (levels > MAX_MIP_LEVELS || width % 16 || height % 16))
+	{
+		printf("Error: Mip levels need width and height in multiples of 16, image is %ux%u\n", width, height);
+		return NULL;
+	}
+
+	unsigned char *dst = buffer_alloc(image_level_offset(width, height, levels));
+	if(!dst)
+		return NULL;
+
+	/* Find closest match in colormap */
+	struct matcher_t matcher;
+	if(!prepare_matcher(options, (unsigned long)width * height, &matcher) || !prepare_quality(quality))
+	{
+		buffer_free(dst);
+		return NULL;
+	}
+
+	/* Each band or worker caches its own colors, the totals are for -v */
+	struct memo_t stats = { 0 };
+	int ok;
+
+	if(options->dither == DITHER_FS)
+		ok = convert_fs(&matcher, src, dst, options->threads, &stats, quality) && (levels < 2 || convert_fs_mips(&matcher, src, dst, levels, &stats));
+	else if(options->threads > 1)
+		ok = convert_parallel(&matcher, src, dst, options->threads, options->dither, levels, &stats, quality);
+	else
+	{
+		struct memo_t *memo = memo_create();
+		ok = convert_rows(&matcher, memo, quality, src, dst, 0, height, options->dither) &&
+			(levels < 2 || convert_mip_rows(&matcher, memo, src, dst, 0, height, levels, options->dither, NULL));
+		memo_add_stats(&stats, memo);
+		memo_free(memo);
+	}
+
+	if(!ok)
+	{
+		buffer_free(dst);
+		return NULL;
+	}
+
+	if(options->verbose)
+	{
+		printf("Matcher: %s\n", match_method_name(&matcher));
+		memo_print_stats(&stats);
+	}
+
+	/* Create return structs */
+	struct image_t *img_dst = image_alloc();
+	if(!img_dst)
+	{
+		buffer_free(dst);
+		return NULL;
+	}
+
+	img_dst->info->bpp = 8;
+	img_dst->info->channels = 1;
+	img_dst->info->width = width;
+	img_dst->info->height = height;
+	img_dst->info->stride = width;
+	img_dst->info->order = PIXEL_RGB;
+	img_dst->info->top_down = 0;
+	img_dst->info->levels = levels;
+	img_dst->data = dst;
+	img_dst->mapping = NULL;
+	img_dst->mapping_size = 0;
+
+	return img_dst;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "defs.h"
+#include "match.h"
+#include "dither.h"
+#include "memo.h"
+#include "quality.h"
+#include "pool.h"
+
+#define MAX_MIP_LEVELS 4
+
+struct convert_options_t
+{
+	unsigned int allow_fullbrights;
+	enum match_method_t match_method;
+	enum metric_t metric;
+	enum dither_method_t dither;
+	unsigned int threads;			// worker threads for row bands, 1 = convert on the calling thread.
+									// Concurrent conversions with more take turns on one worker pool
+	unsigned int verbose;			// print the matcher and color cache hit rate
+	unsigned int mip_levels;		// levels to generate, 1 = full image only, 4 for a Quake miptex
+	size_t memory;					// bytes of pixels a conversion may hold, 0 = no limit. Streams convert
+									// in bands that fit, sources that don't fit whole should be streamed
+	enum quality_report_t quality;	// report the error of each image, measured while it is matched
+};
+
+/* Runs each band or Floyd-Steinberg worker on the pool, NULL runs them directly. The command
+   line sets it to count the work in the calling thread's convert span */
+extern void (*convert_task_runner)(pool_task_t task, void *arg, const char *name);
+
+/* Copy of the shared matcher for these options, with tables ready for an image of 'pixels' pixels */
+extern int prepare_matcher(const struct convert_options_t *options, unsigned long pixels, struct matcher_t *matcher);
+
+/* Point quality at the shared Lab copy of the colormap it is measured against, NULL is left alone */
+extern int prepare_quality(struct quality_t *quality);
+
+/* Drop the matchers built so far, after the palette or its reserved and fullbright
+   ranges change. No conversion may be running */
+extern void convert_reset(void);
+
+/* Map a strip of a larger image, as to_palette_rgb without mip levels but with a matcher from
+   prepare_matcher, counting color cache hits into stats and the error into quality unless it
+   is NULL. dst and the quality heatmap get the rows bottom-up.
+   Ordered dither lines up with the whole image when the strip starts on a multiple of 8
+   rows; Floyd-Steinberg error would stop at the strip, so it isn't supported */
+extern int convert_strip(const struct matcher_t *matcher, struct image_t *src, unsigned char *dst, const struct convert_options_t *options, struct memo_t *stats, struct quality_t *quality);
+
+/* Map src to the palette. With mip levels, the smaller levels are box filtered from
+   the source in the same pass and stored after the full image in the result's data */
+extern struct image_t *to_palette_rgb(struct image_t *src, const struct convert_options_t *options);
+
+/* to_palette_rgb, adding the error of the full size level into quality from the same pass
+   that matches it. Reporting it as options->quality asks is up to the caller */
+extern struct image_t *to_palette_measured(struct image_t *src, const struct convert_options_t *options, struct quality_t *quality);
@@ -1,15 +1,30 @@
 #pragma once
 
+#include <stddef.h>
+
+/* Channel order of 24bit pixel data */
+enum pixel_order_t
+{
+	PIXEL_RGB,
+	PIXEL_BGR,
+};
+
 struct img_info_t
 {
 	unsigned int bpp;
 	unsigned int channels;
 	unsigned int width;
 	unsigned int height;
+	unsigned int stride;			// bytes per row, including any padding
+	enum pixel_order_t order;
+	unsigned int top_down;			// data starts with the top row instead of the bottom one
+	unsigned int levels;			// mip levels in data, each half the size of the one before. 1 = none
 };
 
 struct image_t
 {
 	struct img_info_t *info;
 	unsigned char *data;
+	void *mapping;					// file mapping data points into, NULL if data is malloc'd
+	size_t mapping_size;
 };
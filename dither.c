@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+#include "dither.h"
+
+/* Pixels per wavefront step, the previous row must be this far ahead */
+#define FS_CHUNK 64
+
+/* Amplitude of the ordered dither offsets, about one step of a Quake color ramp */
+#define ORDERED_SPREAD 32
+
+static const unsigned char bayer8[8][8] = {
+	{  0, 32,  8, 40,  2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+int parse_dither_method(const char *arg)
+{
+	if(!strcmp(arg, "none"))
+		return DITHER_NONE;
+	else if(!strcmp(arg, "ordered"))
+		return DITHER_ORDERED;
+	else if(!strcmp(arg, "fs"))
+		return DITHER_FS;
+
+	printf("Invalid dither method: %s\n", arg);
+	return -1;
+}
+
+static inline int clamp255(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+void dither_ordered_row(const struct matcher_t *m, struct memo_t *memo, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int width, unsigned int y, unsigned char *scratch)
+{
+	/* One period of the pattern for this row, expanded to 3 channels so the
+	   inner loop is a plain add-and-clamp over bytes the compiler vectorizes */
+	short pattern[24];
+	for(int i=0; i<24; i++)
+		pattern[i] = ((int)bayer8[y & 7][i / 3] * 2 - 63) * ORDERED_SPREAD / 128;
+
+	unsigned int bytes = width * 3;
+	unsigned int i = 0;
+
+	for(; i + 24 <= bytes; i += 24)
+	{
+		for(int k=0; k<24; k++)
+			scratch[i+k] = clamp255(src[i+k] + pattern[k]);
+	}
+
+	for(int k=0; i<bytes; i++, k++)
+		scratch[i] = clamp255(src[i] + pattern[k]);
+
+	memo_map(memo, m, scratch, order, dst, width);
+}
+
+/* Round errors kept in 1/16ths symmetrically, so the pattern doesn't drift dark */
+static inline int err_round(int e)
+{
+	return (e >= 0 ? e + 8 : e - 8) / 16;
+}
+
+void dither_fs_row(const struct matcher_t *m, struct memo_t *memo, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int width, int *err_in, int *err_out, const unsigned int *above, unsigned int *progress)
+{
+	unsigned int ro = order == PIXEL_BGR ? 2 : 0;
+	unsigned int bo = 2 - ro;
+
+	/* Error carried to the right neighbour stays local, only the rows above and
+	   below share buffers. Index 0 of the buffers is the pixel left of x=0 */
+	int carry[3] = { 0, 0, 0 };
+
+	for(unsigned int x0=0; x0<width; x0+=FS_CHUNK)
+	{
+		unsigned int x1 = x0 + FS_CHUNK < width ? x0 + FS_CHUNK : width;
+
+		/* Pixel x takes error from x+1 of the row above */
+		if(above)
+		{
+			unsigned int need = x1 + 1 < width ? x1 + 1 : width;
+			while(__atomic_load_n(above, __ATOMIC_ACQUIRE) < need)
+				sched_yield();
+		}
+
+		for(unsigned int x=x0; x<x1; x++)
+		{
+			int *in = err_in + (x + 1) * 3;
+			int *out = err_out + (x + 1) * 3;
+
+			unsigned char c[3];
+			c[0] = clamp255(src[x*3+ro] + err_round(in[0] + carry[0]));
+			c[1] = clamp255(src[x*3+1] + err_round(in[1] + carry[1]));
+			c[2] = clamp255(src[x*3+bo] + err_round(in[2] + carry[2]));
+			in[0] = in[1] = in[2] = 0;
+
+			unsigned char index;
+			memo_map(memo, m, c, PIXEL_RGB, &index, 1);
+			dst[x] = index;
+
+			for(int ch=0; ch<3; ch++)
+			{
+				int e = c[ch] - m->output[index*3+ch];
+				carry[ch] = e * 7;
+				out[ch-3] += e * 3;
+				out[ch] += e * 5;
+				out[ch+3] += e;
+			}
+		}
+
+		if(progress)
+			__atomic_store_n(progress, x1, __ATOMIC_RELEASE);
+	}
+}
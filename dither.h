@@ -0,0 +1,32 @@
+#pragma once
+
+#include "defs.h"
+#include "match.h"
+#include "memo.h"
+
+enum dither_method_t
+{
+	DITHER_NONE,
+	DITHER_ORDERED,	// 8x8 Bayer threshold map, every pixel is independent
+	DITHER_FS,		// Floyd-Steinberg error diffusion
+};
+
+extern int parse_dither_method(const char *arg);
+
+/* Ordered dither and map one row. y is the row's distance from the top of the
+   image so the pattern lines up whichever way rows are visited. scratch holds width*3 bytes.
+   memo may be NULL here and in dither_fs_row */
+extern void dither_ordered_row(const struct matcher_t *m, struct memo_t *memo, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int width, unsigned int y, unsigned char *scratch);
+
+/* Error buffers for dither_fs_row hold (width + 2) * 3 ints and start zeroed */
+#define DITHER_ERR_SIZE(width) (((width) + 2) * 3)
+
+/* Floyd-Steinberg dither and map one row, top to bottom. Errors for this row
+   are read (and cleared) from err_in, errors for the next row are added to err_out,
+   so two buffers can be swapped between rows.
+
+   For wavefront parallelism, 'above' is the pixel count the previous row has
+   finished, and this row publishes its own through 'progress'. A pixel only
+   needs its upper neighbours done, so rows can run concurrently two pixels apart.
+   Pass NULL for both when rows run in order on one thread */
+extern void dither_fs_row(const struct matcher_t *m, struct memo_t *memo, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int width, int *err_in, int *err_out, const unsigned int *above, unsigned int *progress);
@@ -0,0 +1,100 @@
+#include "hash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static unsigned long long rotl(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/* Little endian reads, so hashes are the same on every host */
+static unsigned long long read64(const unsigned char *p)
+{
+	unsigned long long v = 0;
+	for(int i=7; i>=0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static unsigned long long read32(const unsigned char *p)
+{
+	return (unsigned long long)p[0] | (unsigned long long)p[1] << 8 | (unsigned long long)p[2] << 16 | (unsigned long long)p[3] << 24;
+}
+
+static unsigned long long round64(unsigned long long acc, unsigned long long input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static unsigned long long merge64(unsigned long long acc, unsigned long long val)
+{
+	acc ^= round64(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+unsigned long long hash64(const void *data, size_t len, unsigned long long seed)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	unsigned long long h;
+
+	if(len >= 32)
+	{
+		unsigned long long v1 = seed + PRIME64_1 + PRIME64_2;
+		unsigned long long v2 = seed + PRIME64_2;
+		unsigned long long v3 = seed;
+		unsigned long long v4 = seed - PRIME64_1;
+
+		do
+		{
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		} while(p + 32 <= end);
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	}
+	else
+		h = seed + PRIME64_5;
+
+	h += len;
+
+	for(; p + 8 <= end; p += 8)
+	{
+		h ^= round64(0, read64(p));
+		h = rotl(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+
+	if(p + 4 <= end)
+	{
+		h ^= read32(p) * PRIME64_1;
+		h = rotl(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+
+	for(; p < end; p++)
+	{
+		h ^= *p * PRIME64_5;
+		h = rotl(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stddef.h>
+
+/* XXH64, the 64bit xxHash. Fast enough that hashing a source costs little next to reading it */
+extern unsigned long long hash64(const void *data, size_t len, unsigned long long seed);
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "image.h"
+#include "buffer.h"
+#include "bmp.h"
+#include "png.h"
+#include "mapfile.h"
+#include "miptex.h"
+
+static const char *type_ext[] = { "bmp", "png", "mip", "lmp" };
+
+int image_type_from_path(const char *path)
+{
+	size_t len = strlen(path);
+	if(len < 4 || path[len-4] != '.')
+		return -1;
+
+	for(unsigned int i=0; i<sizeof(type_ext)/sizeof(type_ext[0]); i++)
+	{
+		if(!strcasecmp(path+len-3, type_ext[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+const char *image_type_ext(enum image_type_t type)
+{
+	return type_ext[type];
+}
+
+int image_type_loadable(enum image_type_t type)
+{
+	return type == IMAGE_BMP || type == IMAGE_PNG;
+}
+
+unsigned int image_mip_levels(enum image_type_t type)
+{
+	return type == IMAGE_MIP ? MIPTEX_LEVELS : 1;
+}
+
+size_t image_level_offset(unsigned int width, unsigned int height, unsigned int level)
+{
+	size_t offset = 0;
+	for(unsigned int l=0; l<level; l++)
+		offset += (size_t)(width >> l) * (height >> l);
+
+	return offset;
+}
+
+char *image_default_dest(const char *src, enum image_type_t type)
+{
+	size_t len = strlen(src);
+	if(len < 4)
+		return NULL;
+
+	char *dest = malloc(len + 6);
+	if(!dest)
+		return NULL;
+
+	memcpy(dest, src, len-4);
+	sprintf(dest+len-4, "_conv.%s", type_ext[type]);
+
+	return dest;
+}
+
+struct image_t *load_image(const char *path, enum image_type_t type)
+{
+	if(type == IMAGE_BMP)
+		return load_bmp(path);
+	else if(type == IMAGE_PNG)
+		return load_png(path);
+
+	printf("Error: %s can't be used as a source image\n", path);
+	return NULL;
+}
+
+int write_image(struct image_t *image, const char *path, enum image_type_t type)
+{
+	if(type == IMAGE_BMP)
+		return write_bmp(image, path);
+	else if(type == IMAGE_PNG)
+		return write_png(image, path);
+	else if(type == IMAGE_MIP)
+		return write_miptex(image, path);
+	else if(type == IMAGE_LMP)
+		return write_lmp(image, path);
+
+	return 0;
+}
+
+struct image_block_t
+{
+	struct image_t image;
+	struct img_info_t info;
+};
+
+struct image_t *image_alloc(void)
+{
+	struct image_block_t *block = buffer_calloc(sizeof(struct image_block_t));
+	if(!block)
+		return NULL;
+
+	block->image.info = &block->info;
+	return &block->image;
+}
+
+void free_image(struct image_t *image)
+{
+	if(!image)
+		return;
+
+	if(image->mapping)
+		unmap_file(image->mapping, image->mapping_size);
+	else
+		buffer_free(image->data);
+	buffer_free(image);
+}
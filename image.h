@@ -0,0 +1,41 @@
+#pragma once
+
+#include "defs.h"
+
+/* Largest source width or height, libpng's default limit, so BMP and PNG sources agree */
+#define IMAGE_MAX_SIZE 1000000
+
+enum image_type_t
+{
+	IMAGE_BMP,
+	IMAGE_PNG,
+	IMAGE_MIP,	// Quake miptex with 4 mip levels, output only
+	IMAGE_LMP,	// Quake qpic lump, output only
+};
+
+/* Image type from a path's extension, -1 if it isn't a supported format */
+extern int image_type_from_path(const char *path);
+
+/* File extension of a type, without the dot */
+extern const char *image_type_ext(enum image_type_t type);
+
+/* Whether images of this type can be loaded as a conversion source */
+extern int image_type_loadable(enum image_type_t type);
+
+/* Mip levels a conversion for this output type has to produce */
+extern unsigned int image_mip_levels(enum image_type_t type);
+
+/* Offset of mip level 'level' in 8bit data holding the levels of a width x height image back to back */
+extern size_t image_level_offset(unsigned int width, unsigned int height, unsigned int level);
+
+/* path_conv.ext, the default output name for a source image */
+extern char *image_default_dest(const char *src, enum image_type_t type);
+
+extern struct image_t *load_image(const char *path, enum image_type_t type);
+
+extern int write_image(struct image_t *image, const char *path, enum image_type_t type);
+
+/* image_t and its info in one allocation, data is left NULL. Data should come from buffer_alloc */
+extern struct image_t *image_alloc(void);
+
+extern void free_image(struct image_t *image);
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "incremental.h"
+#include "colormap.h"
+#include "hash.h"
+#include "mapfile.h"
+#include "png.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_dir(path) _mkdir(path)
+#define link(from, to) (-1)	// outputs get copied instead
+#else
+#define make_dir(path) mkdir(path, 0755)
+#endif
+
+/* Bumped whenever conversion output changes for the same source and options */
+#define INCREMENTAL_VERSION 1
+
+static unsigned int temp_counter;
+
+static unsigned long long options_hash(const struct convert_options_t *options, enum image_type_t output_type)
+{
+	/* PNG settings change the bytes, not the pixels, but a new level should still recompress */
+	int png = output_type == IMAGE_PNG;
+	unsigned int fields[] = { INCREMENTAL_VERSION, options->allow_fullbrights > 0, options->metric, options->dither,
+		image_mip_levels(output_type), output_type, cmap_colors, png ? png_encode.level : 0, png ? png_encode.filter : 0 };
+
+	unsigned long long h = hash64(fields, sizeof(fields), 0);
+	h = hash64(cmap, cmap_colors * 3, h);
+	return hash64(cmap_flags, cmap_colors, h);
+}
+
+static unsigned int slot_hash(const char *path, unsigned long long options)
+{
+	unsigned long long h = hash64(path, strlen(path), options);
+	return (unsigned int)(h ^ (h >> 32));
+}
+
+static struct incremental_entry_t *find_entry(struct incremental_t *inc, const char *path, unsigned long long options)
+{
+	unsigned int mask = inc->table_size - 1;
+	for(unsigned int i = slot_hash(path, options) & mask; inc->table[i]; i = (i + 1) & mask)
+	{
+		struct incremental_entry_t *e = &inc->entries[inc->table[i] - 1];
+		if(e->options == options && !strcmp(e->path, path))
+			return e;
+	}
+
+	return NULL;
+}
+
+static int grow_table(struct incremental_t *inc)
+{
+	unsigned int size = inc->table_size ? inc->table_size * 2 : 1024;
+	unsigned int *table = calloc(size, sizeof(unsigned int));
+	if(!table)
+		return 0;
+
+	for(unsigned int j=0; j<inc->count; j++)
+	{
+		unsigned int i = slot_hash(inc->entries[j].path, inc->entries[j].options) & (size - 1);
+		while(table[i])
+			i = (i + 1) & (size - 1);
+		table[i] = j + 1;
+	}
+
+	free(inc->table);
+	inc->table = table;
+	inc->table_size = size;
+	return 1;
+}
+
+/* Takes ownership of entry.path */
+static struct incremental_entry_t *add_entry(struct incremental_t *inc, struct incremental_entry_t *entry)
+{
+	if((inc->count + 1) * 2 > inc->table_size && !grow_table(inc))
+		return NULL;
+
+	if(inc->count == inc->capacity)
+	{
+		unsigned int capacity = inc->capacity ? inc->capacity * 2 : 256;
+		struct incremental_entry_t *grown = realloc(inc->entries, capacity * sizeof(struct incremental_entry_t));
+		if(!grown)
+			return NULL;
+		inc->entries = grown;
+		inc->capacity = capacity;
+	}
+
+	unsigned int i = slot_hash(entry->path, entry->options) & (inc->table_size - 1);
+	while(inc->table[i])
+		i = (i + 1) & (inc->table_size - 1);
+
+	inc->entries[inc->count] = *entry;
+	inc->table[i] = ++inc->count;
+	return &inc->entries[inc->count - 1];
+}
+
+static void load_manifest(struct incremental_t *inc)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/manifest", inc->dir);
+
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return;
+
+	char line[PATH_MAX + 128];
+	while(fgets(line, sizeof(line), f))
+	{
+		struct incremental_entry_t e;
+		int n = 0;
+		line[strcspn(line, "\n")] = '\0';
+
+		if(sscanf(line, "%llx %llx %llu %lld %ld %n", &e.options, &e.key, &e.size, &e.mtime, &e.mtime_nsec, &n) != 5 || n == 0 || line[n] == '\0')
+			continue;
+		if(find_entry(inc, line + n, e.options))
+			continue;
+
+		e.path = strdup(line + n);
+		if(!e.path || !add_entry(inc, &e))
+		{
+			free(e.path);
+			break;
+		}
+	}
+
+	fclose(f);
+}
+
+struct incremental_t *incremental_open(const char *dir)
+{
+	make_dir(dir);
+
+	struct stat st;
+	if(stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		printf("Error: Can't use %s as the incremental cache directory\n", dir);
+		return NULL;
+	}
+
+	struct incremental_t *inc = calloc(1, sizeof(struct incremental_t));
+	if(!inc)
+		return NULL;
+
+	inc->dir = strdup(dir);
+	if(!inc->dir || !grow_table(inc))
+	{
+		free(inc->dir);
+		free(inc);
+		return NULL;
+	}
+
+	pthread_mutex_init(&inc->lock, NULL);
+	load_manifest(inc);
+
+	return inc;
+}
+
+static long mtime_nsec(const struct stat *st)
+{
+#ifdef __linux__
+	return st->st_mtim.tv_nsec;
+#else
+	return 0;
+#endif
+}
+
+static void object_path(const struct incremental_t *inc, const struct incremental_job_t *job, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%016llx.%s", inc->dir, job->key, image_type_ext(job->output_type));
+}
+
+static int copy_file(const char *from, const char *to)
+{
+	size_t size;
+	void *data = map_file(from, &size);
+	if(!data)
+		return 0;
+
+	FILE *f = fopen(to, "wb");
+	int ok = f && fwrite(data, size, 1, f) == 1;
+	if(f && fclose(f) != 0)
+		ok = 0;
+
+	unmap_file(data, size);
+	return ok;
+}
+
+/* Hard link 'from' as 'to', copying where links aren't possible */
+static int place_file(const char *from, const char *to)
+{
+	remove(to);
+	return link(from, to) == 0 || copy_file(from, to);
+}
+
+int incremental_check(struct incremental_t *inc, const char *src, const char *dest, enum image_type_t output_type, const struct convert_options_t *options, struct incremental_job_t *job)
+{
+	struct stat st;
+	if(stat(src, &st) != 0)
+		return 0;
+
+	unsigned long long opts = options_hash(options, output_type);
+	job->output_type = output_type;
+
+	pthread_mutex_lock(&inc->lock);
+	struct incremental_entry_t *e = find_entry(inc, src, opts);
+	int known = e && e->size == (unsigned long long)st.st_size && e->mtime == (long long)st.st_mtime && e->mtime_nsec == mtime_nsec(&st);
+	if(known)
+		job->key = e->key;
+	pthread_mutex_unlock(&inc->lock);
+
+	if(!known)
+	{
+		size_t size;
+		void *data = map_file(src, &size);
+		if(!data)
+			return 0;
+		job->key = hash64(data, size, opts);
+		unmap_file(data, size);
+
+		struct incremental_entry_t entry = { NULL, st.st_size, st.st_mtime, mtime_nsec(&st), opts, job->key };
+
+		pthread_mutex_lock(&inc->lock);
+		e = find_entry(inc, src, opts);
+		if(e)
+			*e = (struct incremental_entry_t){ e->path, entry.size, entry.mtime, entry.mtime_nsec, opts, job->key };
+		else if((entry.path = strdup(src)) != NULL && !add_entry(inc, &entry))
+			free(entry.path);
+		inc->dirty = 1;
+		pthread_mutex_unlock(&inc->lock);
+	}
+
+	char object[PATH_MAX];
+	object_path(inc, job, object);
+
+	struct stat ost, dst;
+	int have_dest = stat(dest, &dst) == 0;
+
+	if(stat(object, &ost) == 0)
+	{
+		int same = have_dest && dst.st_dev == ost.st_dev && dst.st_ino == ost.st_ino;
+		if(same || place_file(object, dest))
+		{
+			pthread_mutex_lock(&inc->lock);
+			if(same)
+				inc->up_to_date++;
+			else
+				inc->linked++;
+			pthread_mutex_unlock(&inc->lock);
+			return 1;
+		}
+	}
+
+	/* dest may still be a link to the output of an older key, writing to it in place would change that */
+	if(have_dest && dst.st_nlink > 1)
+		remove(dest);
+
+	return 0;
+}
+
+void incremental_store(struct incremental_t *inc, const struct incremental_job_t *job, const char *dest)
+{
+	char object[PATH_MAX], tmp[PATH_MAX + 32];
+	object_path(inc, job, object);
+	snprintf(tmp, sizeof(tmp), "%s.%d.%u.tmp", object, (int)getpid(), __atomic_add_fetch(&temp_counter, 1, __ATOMIC_RELAXED));
+
+	if(!place_file(dest, tmp))
+	{
+		remove(tmp);
+		return;
+	}
+
+	/* Another job stored the same key first, share its copy so dest is up to date next time.
+	   Otherwise rename it into place whole, concurrent builds never see a partial output */
+	struct stat st;
+	if(stat(object, &st) == 0)
+	{
+		remove(tmp);
+		place_file(object, dest);
+	}
+	else if(rename(tmp, object) != 0)
+	{
+		remove(tmp);
+		return;
+	}
+
+	pthread_mutex_lock(&inc->lock);
+	inc->stored++;
+	pthread_mutex_unlock(&inc->lock);
+}
+
+static int write_manifest(struct incremental_t *inc)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 32];
+	snprintf(path, sizeof(path), "%s/manifest", inc->dir);
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+	FILE *f = fopen(tmp, "w");
+	if(!f)
+		return 0;
+
+	for(unsigned int i=0; i<inc->count; i++)
+	{
+		const struct incremental_entry_t *e = &inc->entries[i];
+		if(strchr(e->path, '\n'))
+			continue;
+		fprintf(f, "%016llx %016llx %llu %lld %ld %s\n", e->options, e->key, e->size, e->mtime, e->mtime_nsec, e->path);
+	}
+
+	if(fclose(f) != 0 || rename(tmp, path) != 0)
+	{
+		remove(tmp);
+		return 0;
+	}
+
+	return 1;
+}
+
+int incremental_close(struct incremental_t *inc)
+{
+	if(!inc)
+		return 1;
+
+	int ok = !inc->dirty || write_manifest(inc);
+	if(!ok)
+		printf("Error: Failed to write the manifest in %s\n", inc->dir);
+
+	printf("Incremental: %u up to date, %u linked from the cache, %u converted\n", inc->up_to_date, inc->linked, inc->stored);
+
+	for(unsigned int i=0; i<inc->count; i++)
+		free(inc->entries[i].path);
+	free(inc->entries);
+	free(inc->table);
+	free(inc->dir);
+	pthread_mutex_destroy(&inc->lock);
+	free(inc);
+
+	return ok;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "convert.h"
+#include "image.h"
+
+/* Incremental conversion. Outputs are kept in a cache directory under a key hashed from
+   the source bytes, the palette and every option that changes the output, and are hard
+   linked back into place when the key comes up again. A manifest remembers each source's
+   key by path, size and modification time, so unchanged sources aren't even read */
+
+struct incremental_entry_t
+{
+	char *path;
+	unsigned long long size;
+	long long mtime;
+	long mtime_nsec;
+	unsigned long long options;		// hash of the output options the key was made for
+	unsigned long long key;
+};
+
+struct incremental_t
+{
+	char *dir;
+	pthread_mutex_t lock;			// covers the manifest and the counters
+	struct incremental_entry_t *entries;
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int *table;			// open addressing by path and options, entry index + 1, 0 = empty
+	unsigned int table_size;
+	int dirty;						// the manifest needs writing
+	unsigned int up_to_date;
+	unsigned int linked;
+	unsigned int stored;
+};
+
+/* Key of one conversion, from incremental_check to incremental_store */
+struct incremental_job_t
+{
+	unsigned long long key;
+	enum image_type_t output_type;
+};
+
+extern struct incremental_t *incremental_open(const char *dir);
+
+/* Whether dest holds the output of converting src with these options, linking a cached
+   output into place if it doesn't yet. 0 means the conversion has to run */
+extern int incremental_check(struct incremental_t *inc, const char *src, const char *dest, enum image_type_t output_type, const struct convert_options_t *options, struct incremental_job_t *job);
+
+/* Keep a freshly written output in the cache */
+extern void incremental_store(struct incremental_t *inc, const struct incremental_job_t *job, const char *dest);
+
+/* Write the manifest and print what was skipped, returns 0 if the manifest couldn't be written */
+extern int incremental_close(struct incremental_t *inc);
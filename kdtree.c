@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kdtree.h"
+
+#define KD_LEAF_SIZE 16
+
+/* qsort has no context argument, so each axis gets its own comparator and
+   trees can be built on several threads at once */
+static int compare_on_axis(const struct kdentry_t *ea, const struct kdentry_t *eb, int axis)
+{
+	if(ea->rgb[axis] != eb->rgb[axis])
+		return ea->rgb[axis] - eb->rgb[axis];
+
+	return ea->index - eb->index;
+}
+
+static int compare_r(const void *a, const void *b) { return compare_on_axis(a, b, 0); }
+static int compare_g(const void *a, const void *b) { return compare_on_axis(a, b, 1); }
+static int compare_b(const void *a, const void *b) { return compare_on_axis(a, b, 2); }
+
+static int (*const compare_entries[3])(const void *, const void *) = { compare_r, compare_g, compare_b };
+
+/* Split entries [first, first+count) at the median of their widest axis */
+static unsigned int build_node(struct kdtree_t *tree, unsigned int first, unsigned int count)
+{
+	unsigned int id = tree->node_count++;
+	struct kdnode_t *node = &tree->nodes[id];
+
+	for(int axis=0; axis<3; axis++)
+	{
+		node->lo[axis] = 255;
+		node->hi[axis] = 0;
+		for(unsigned int i=first; i<first+count; i++)
+		{
+			if(tree->entries[i].rgb[axis] < node->lo[axis])
+				node->lo[axis] = tree->entries[i].rgb[axis];
+			if(tree->entries[i].rgb[axis] > node->hi[axis])
+				node->hi[axis] = tree->entries[i].rgb[axis];
+		}
+	}
+
+	node->left = 0;
+	node->right = 0;
+	node->first = first;
+	node->count = count;
+
+	if(count <= KD_LEAF_SIZE)
+		return id;
+
+	int axis = 0;
+	for(int a=1; a<3; a++)
+	{
+		if(node->hi[a] - node->lo[a] > node->hi[axis] - node->lo[axis])
+			axis = a;
+	}
+
+	qsort(tree->entries + first, count, sizeof(struct kdentry_t), compare_entries[axis]);
+
+	unsigned int half = count / 2;
+	unsigned int left = build_node(tree, first, half);
+	unsigned int right = build_node(tree, first + half, count - half);
+
+	node->left = left;
+	node->right = right;
+
+	return id;
+}
+
+struct kdtree_t *kdtree_build(const unsigned char *palette, unsigned int colors)
+{
+	struct kdtree_t *tree = malloc(sizeof(struct kdtree_t));
+	if(!tree)
+		return NULL;
+
+	/* A tree with leaves of at least KD_LEAF_SIZE/2 entries never needs more than 2*colors nodes */
+	tree->nodes = malloc(2 * colors * sizeof(struct kdnode_t));
+	tree->entries = malloc(colors * sizeof(struct kdentry_t));
+	tree->node_count = 0;
+
+	if(!tree->nodes || !tree->entries)
+	{
+		printf("Failed to malloc palette k-d tree\n");
+		kdtree_free(tree);
+		return NULL;
+	}
+
+	for(unsigned int j=0; j<colors; j++)
+	{
+		tree->entries[j].rgb[0] = palette[j*3];
+		tree->entries[j].rgb[1] = palette[j*3+1];
+		tree->entries[j].rgb[2] = palette[j*3+2];
+		tree->entries[j].index = j;
+	}
+
+	build_node(tree, 0, colors);
+
+	return tree;
+}
+
+/* Lower bound on the distance from a color to anything inside a node */
+static unsigned int node_bound(const struct kdnode_t *node, const int *c)
+{
+	unsigned int d = 0;
+	for(int axis=0; axis<3; axis++)
+	{
+		if(c[axis] < node->lo[axis])
+			d += node->lo[axis] - c[axis];
+		else if(c[axis] > node->hi[axis])
+			d += c[axis] - node->hi[axis];
+	}
+
+	return d;
+}
+
+static void search(const struct kdtree_t *tree, unsigned int id, const int *c, unsigned int *delta, unsigned int *index)
+{
+	const struct kdnode_t *node = &tree->nodes[id];
+
+	if(node->left == 0)
+	{
+		for(unsigned int i=node->first; i<node->first+node->count; i++)
+		{
+			const struct kdentry_t *e = &tree->entries[i];
+			unsigned int d2 = abs(e->rgb[0]-c[0]) + abs(e->rgb[1]-c[1]) + abs(e->rgb[2]-c[2]);
+
+			/* Entries are not in palette order, so break ties on index explicitly */
+			if(d2 < *delta || (d2 == *delta && e->index < *index))
+			{
+				*delta = d2;
+				*index = e->index;
+			}
+		}
+		return;
+	}
+
+	unsigned int near = node->left;
+	unsigned int far = node->right;
+	unsigned int near_bound = node_bound(&tree->nodes[near], c);
+	unsigned int far_bound = node_bound(&tree->nodes[far], c);
+
+	if(far_bound < near_bound)
+	{
+		unsigned int t = near; near = far; far = t;
+		t = near_bound; near_bound = far_bound; far_bound = t;
+	}
+
+	/* Equal bounds are still visited since they may hold a tie with a lower index */
+	if(near_bound <= *delta)
+		search(tree, near, c, delta, index);
+	if(far_bound <= *delta)
+		search(tree, far, c, delta, index);
+}
+
+void kdtree_map(const struct kdtree_t *tree, const unsigned char *palette, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count)
+{
+	/* Channel offsets, BGR sources are read in place */
+	unsigned int ro = order == PIXEL_BGR ? 2 : 0;
+	unsigned int bo = 2 - ro;
+
+	unsigned int prev = 0;
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		int c[3] = { src[i*3+ro], src[i*3+1], src[i*3+bo] };
+
+		/* Neighbouring pixels are usually close, so the previous match gives a tight starting bound */
+		unsigned int index = prev;
+		unsigned int delta = abs(palette[prev*3]-c[0]) + abs(palette[prev*3+1]-c[1]) + abs(palette[prev*3+2]-c[2]);
+
+		search(tree, 0, c, &delta, &index);
+
+		dst[i] = prev = index;
+	}
+}
+
+void kdtree_free(struct kdtree_t *tree)
+{
+	if(!tree)
+		return;
+
+	free(tree->nodes);
+	free(tree->entries);
+	free(tree);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "defs.h"
+
+/* k-d tree over palette entries, searched with branch-and-bound */
+struct kdnode_t
+{
+	unsigned char lo[3];	// bounding box of every entry below this node
+	unsigned char hi[3];
+	unsigned short left;	// child nodes, 0 for leaves
+	unsigned short right;
+	unsigned short first;	// leaf entries in kdtree_t->entries
+	unsigned short count;
+};
+
+struct kdentry_t
+{
+	unsigned char rgb[3];
+	unsigned char index;
+};
+
+struct kdtree_t
+{
+	struct kdnode_t *nodes;
+	unsigned int node_count;
+	struct kdentry_t *entries;
+};
+
+extern struct kdtree_t *kdtree_build(const unsigned char *palette, unsigned int colors);
+
+/* Map count RGB or BGR pixels, seeding each search with the previous pixel's match. Same
+   Manhattan distance and tie-breaking (lowest index wins) as a full palette scan */
+extern void kdtree_map(const struct kdtree_t *tree, const unsigned char *palette, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count);
+
+extern void kdtree_free(struct kdtree_t *tree);
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "libqpalette.h"
+#include "convert.h"
+#include "palette.h"
+#include "bmp.h"
+#include "png.h"
+#include "image.h"
+#include "buffer.h"
+
+/* Single images convert on the calling thread, so calls can run concurrently */
+static int get_options(const struct qp_options_t *options, struct convert_options_t *convert)
+{
+	memset(convert, 0, sizeof(*convert));
+	convert->threads = 1;
+	convert->mip_levels = 1;
+
+	if(!options)
+		return 1;
+
+	convert->allow_fullbrights = options->fullbrights != 0;
+
+	if(options->metric)
+	{
+		int metric = parse_metric(options->metric);
+		if(metric < 0)
+			return 0;
+		convert->metric = metric;
+	}
+
+	if(options->dither)
+	{
+		int dither = parse_dither_method(options->dither);
+		if(dither < 0)
+			return 0;
+		convert->dither = dither;
+	}
+
+	if(options->method)
+	{
+		int method = parse_match_method(options->method);
+		if(method < 0)
+			return 0;
+		convert->match_method = method;
+	}
+
+	return 1;
+}
+
+int qp_load_palette(const char *path)
+{
+	if(!load_palette(path))
+		return 0;
+
+	convert_reset();
+	return 1;
+}
+
+int qp_set_palette(const unsigned char *rgb, unsigned int colors)
+{
+	if(colors == 0 || colors > 256)
+		return 0;
+
+	use_palette(rgb, colors);
+	convert_reset();
+	return 1;
+}
+
+int qp_set_ranges(const char *reserved, const char *fullbright)
+{
+	if((reserved && !parse_palette_ranges(reserved, CMAP_RESERVED)) || (fullbright && !parse_palette_ranges(fullbright, CMAP_FULLBRIGHT)))
+		return 0;
+
+	convert_reset();
+	return 1;
+}
+
+int qp_convert(const struct qp_options_t *options, const unsigned char *pixels, enum qp_format_t format,
+	unsigned int width, unsigned int height, size_t stride, unsigned char *indices, size_t index_stride)
+{
+	struct convert_options_t convert;
+	if(!get_options(options, &convert))
+		return 0;
+
+	unsigned int channels = format == QP_RGBA || format == QP_BGRA ? 4 : 3;
+	if(width == 0 || height == 0 || stride < (size_t)width * channels || stride > UINT_MAX || index_stride < width)
+		return 0;
+
+	struct img_info_t info = { 24, 3, width, height, stride, format == QP_BGR || format == QP_BGRA ? PIXEL_BGR : PIXEL_RGB, 1, 1 };
+	struct image_t src = { &info, (unsigned char *)pixels, NULL, 0 };
+
+	/* The matchers read packed 3 byte pixels, 4 byte ones are packed into a copy */
+	unsigned char *packed = NULL;
+	if(channels == 4)
+	{
+		packed = buffer_alloc((size_t)width * height * 3);
+		if(!packed)
+			return 0;
+
+		for(unsigned int y=0; y<height; y++)
+		{
+			const unsigned char *in = pixels + y * stride;
+			unsigned char *out = packed + (size_t)y * width * 3;
+			for(unsigned int x=0; x<width; x++, in += 4, out += 3)
+				memcpy(out, in, 3);
+		}
+
+		info.stride = width * 3;
+		src.data = packed;
+	}
+
+	struct image_t *dst = to_palette_rgb(&src, &convert);
+	buffer_free(packed);
+	if(!dst)
+		return 0;
+
+	/* Results are bottom-up, like a BMP */
+	for(unsigned int y=0; y<height; y++)
+		memcpy(indices + y * index_stride, dst->data + (size_t)(height - 1 - y) * width, width);
+	free_image(dst);
+
+	return 1;
+}
+
+unsigned char *qp_decode(const void *data, size_t size, unsigned int *width, unsigned int *height)
+{
+	struct image_t *img;
+	if(size >= 2 && !memcmp(data, "BM", 2))
+		img = load_bmp_memory(data, size);
+	else if(size >= 8 && !memcmp(data, "\x89PNG\r\n\x1a\n", 8))
+		img = load_png_memory(data, size);
+	else
+		return NULL;
+
+	if(!img)
+		return NULL;
+
+	const struct img_info_t *info = img->info;
+	unsigned char *rgb = malloc((size_t)info->width * info->height * 3);
+	if(rgb)
+	{
+		for(unsigned int y=0; y<info->height; y++)
+		{
+			const unsigned char *in = img->data + (size_t)(info->top_down ? y : info->height - 1 - y) * info->stride;
+			unsigned char *out = rgb + (size_t)y * info->width * 3;
+
+			if(info->order == PIXEL_RGB)
+				memcpy(out, in, (size_t)info->width * 3);
+			else
+			{
+				for(unsigned int x=0; x<info->width; x++, in += 3, out += 3)
+				{
+					out[0] = in[2];
+					out[1] = in[1];
+					out[2] = in[0];
+				}
+			}
+		}
+
+		*width = info->width;
+		*height = info->height;
+	}
+
+	free_image(img);
+	return rgb;
+}
+
+void *qp_encode(const unsigned char *indices, unsigned int width, unsigned int height, size_t index_stride, const char *type, size_t *size)
+{
+	int bmp = !strcmp(type, "bmp");
+	if((!bmp && strcmp(type, "png")) || width == 0 || height == 0 || index_stride < width)
+		return NULL;
+
+	/* Writers take bottom-up images, as conversions return them */
+	struct img_info_t info = { 8, 1, width, height, width, PIXEL_RGB, 0, 1 };
+	struct image_t image = { &info, buffer_alloc((size_t)width * height), NULL, 0 };
+	if(!image.data)
+		return NULL;
+
+	for(unsigned int y=0; y<height; y++)
+		memcpy(image.data + (size_t)(height - 1 - y) * width, indices + y * index_stride, width);
+
+	unsigned char *out;
+	if(bmp)
+	{
+		*size = bmp_file_size(width, height);
+		out = malloc(*size);
+		if(out)
+			write_bmp_memory(&image, out, *size);
+	}
+	else
+		out = write_png_memory(&image, size);
+
+	buffer_free(image.data);
+	return out;
+}
+
+void qp_free(void *data)
+{
+	free(data);
+}
+
+void qp_trim(void)
+{
+	buffer_trim();
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+
+/* libqpalette, conversion of pixels in memory to the Quake palette or one set with
+   qp_load_palette or qp_set_palette. Images are top-down here, whatever the file format.
+   Every function but those setting the palette can run on any number of threads at once;
+   the palette functions must not run while anything else is */
+
+/* The shared library is built with hidden visibility, only these functions are exported */
+#if defined(__GNUC__)
+#define QP_API __attribute__((visibility("default")))
+#else
+#define QP_API
+#endif
+
+enum qp_format_t
+{
+	QP_RGB,
+	QP_BGR,
+	QP_RGBA,		// alpha is ignored, as for PNG sources
+	QP_BGRA,
+};
+
+/* NULL or zeroed options convert like qpalette without any options */
+struct qp_options_t
+{
+	int fullbrights;			// allow the fullbright entries, as -b
+	const char *metric;			// as -c, NULL = rgb
+	const char *dither;			// as -d, NULL = none
+	const char *method;			// as -m, NULL = auto
+};
+
+/* Palette from a file, as -p */
+extern QP_API int qp_load_palette(const char *path);
+
+/* Palette from 'colors' RGB triplets, at most 256 */
+extern QP_API int qp_set_palette(const unsigned char *rgb, unsigned int colors);
+
+/* Reserved and fullbright entries as -r and -f, NULL keeps the current ranges */
+extern QP_API int qp_set_ranges(const char *reserved, const char *fullbright);
+
+/* Map width x height pixels, rows 'stride' bytes apart, to palette indices in the
+   caller's buffer, rows 'index_stride' bytes apart */
+extern QP_API int qp_convert(const struct qp_options_t *options, const unsigned char *pixels, enum qp_format_t format,
+	unsigned int width, unsigned int height, size_t stride, unsigned char *indices, size_t index_stride);
+
+/* Decode a BMP or PNG file in memory to packed RGB, free with qp_free */
+extern QP_API unsigned char *qp_decode(const void *data, size_t size, unsigned int *width, unsigned int *height);
+
+/* Encode indices as a paletted file of 'type', "bmp" or "png", free with qp_free */
+extern QP_API void *qp_encode(const unsigned char *indices, unsigned int width, unsigned int height, size_t index_stride, const char *type, size_t *size);
+
+extern QP_API void qp_free(void *data);
+
+/* Release the buffers kept for reuse between conversions, e.g. after a large batch.
+   Safe to call at any time */
+extern QP_API void qp_trim(void);
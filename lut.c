@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "lut.h"
+#include "palcache.h"
+#include "mapfile.h"
+
+#define CELL_SHIFT (8 - LUT_BITS)
+#define CELL_WIDTH (1 << CELL_SHIFT)
+#define CELL_MASK ((1 << LUT_BITS) - 1)
+
+/* Distance from c to the closest and furthest point of [lo, hi] along one axis */
+static unsigned int axis_min(int c, int lo, int hi)
+{
+	if(c < lo)
+		return lo - c;
+	if(c > hi)
+		return c - hi;
+	return 0;
+}
+
+static unsigned int axis_max(int c, int lo, int hi)
+{
+	return (c - lo > hi - c) ? c - lo : hi - c;
+}
+
+struct lut_t *lut_build(const unsigned char *palette, unsigned int colors)
+{
+	struct lut_t *lut = malloc(sizeof(struct lut_t));
+	if(!lut)
+		return NULL;
+
+	lut->palette = palette;
+	lut->colors = colors;
+	lut->mapping = palcache_load("rgb", palette, colors, &lut->cells, &lut->candidates, &lut->mapping_size);
+	if(lut->mapping)
+		return lut;
+
+	lut->cells = malloc(LUT_CELLS * sizeof(struct lut_cell_t));
+
+	unsigned int capacity = LUT_CELLS * 4;
+	unsigned int used = 0;
+	lut->candidates = malloc(capacity);
+
+	unsigned int *dmin = malloc(colors * sizeof(unsigned int));
+
+	if(!lut->cells || !lut->candidates || !dmin)
+	{
+		printf("Failed to malloc palette lookup table\n");
+		free(dmin);
+		lut_free(lut);
+		return NULL;
+	}
+
+	for(unsigned int cell=0; cell<LUT_CELLS; cell++)
+	{
+		int r0 = (cell >> (LUT_BITS * 2)) << CELL_SHIFT;
+		int g0 = ((cell >> LUT_BITS) & CELL_MASK) << CELL_SHIFT;
+		int b0 = (cell & CELL_MASK) << CELL_SHIFT;
+		int r1 = r0 + CELL_WIDTH - 1;
+		int g1 = g0 + CELL_WIDTH - 1;
+		int b1 = b0 + CELL_WIDTH - 1;
+
+		/* Every color in the cell is at most 'bound' away from some palette entry,
+		   so only entries whose closest point in the cell is within 'bound' can win */
+		unsigned int bound = UINT_MAX;
+		for(unsigned int j=0; j<colors; j++)
+		{
+			int cr = palette[j*3];
+			int cg = palette[j*3+1];
+			int cb = palette[j*3+2];
+
+			dmin[j] = axis_min(cr, r0, r1) + axis_min(cg, g0, g1) + axis_min(cb, b0, b1);
+
+			unsigned int dmax = axis_max(cr, r0, r1) + axis_max(cg, g0, g1) + axis_max(cb, b0, b1);
+			if(dmax < bound)
+				bound = dmax;
+		}
+
+		if(used + colors > capacity)
+		{
+			capacity *= 2;
+			unsigned char *grown = realloc(lut->candidates, capacity);
+			if(!grown)
+			{
+				printf("Failed to grow palette lookup table\n");
+				free(dmin);
+				lut_free(lut);
+				return NULL;
+			}
+			lut->candidates = grown;
+		}
+
+		lut->cells[cell].offset = used;
+		for(unsigned int j=0; j<colors; j++)
+		{
+			if(dmin[j] <= bound)
+				lut->candidates[used++] = j;
+		}
+		lut->cells[cell].count = used - lut->cells[cell].offset;
+	}
+
+	free(dmin);
+	palcache_store("rgb", palette, colors, lut->cells, lut->candidates);
+	return lut;
+}
+
+/* Same Manhattan distance and tie-breaking (lowest index wins) as a full palette scan */
+unsigned char lut_lookup(const struct lut_t *lut, unsigned char r, unsigned char g, unsigned char b)
+{
+	unsigned int cell = ((r >> CELL_SHIFT) << (LUT_BITS * 2)) | ((g >> CELL_SHIFT) << LUT_BITS) | (b >> CELL_SHIFT);
+	const struct lut_cell_t *c = &lut->cells[cell];
+	const unsigned char *candidates = lut->candidates + c->offset;
+
+	if(c->count == 1)
+		return candidates[0];
+
+	unsigned int delta = UINT_MAX;
+	unsigned char index = 0;
+
+	for(unsigned int k=0; k<c->count; k++)
+	{
+		unsigned int j = candidates[k];
+		unsigned int d2 = abs(lut->palette[j*3]-r) + abs(lut->palette[j*3+1]-g) + abs(lut->palette[j*3+2]-b);
+		if(d2 < delta)
+		{
+			delta = d2;
+			index = j;
+		}
+	}
+
+	return index;
+}
+
+void lut_free(struct lut_t *lut)
+{
+	if(!lut)
+		return;
+
+	if(lut->mapping)
+		unmap_file(lut->mapping, lut->mapping_size);
+	else
+	{
+		free(lut->cells);
+		free(lut->candidates);
+	}
+	free(lut);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Palette lookup table: the RGB cube is split into a grid of cells, each of
+   which lists the palette entries that can be nearest to some color inside it */
+#define LUT_BITS 5
+#define LUT_CELLS (1 << (LUT_BITS * 3))
+
+struct lut_cell_t
+{
+	unsigned int offset;	// first candidate in lut_t->candidates
+	unsigned int count;		// number of candidates, 1 = cell maps to a single index
+};
+
+struct lut_t
+{
+	const unsigned char *palette;	// RGB triplets the table was built from
+	unsigned int colors;
+	struct lut_cell_t *cells;
+	unsigned char *candidates;		// palette indices, ascending within each cell
+	void *mapping;					// cache file cells and candidates point into, NULL if they are malloc'd
+	size_t mapping_size;
+};
+
+/* Maps the table from the palette cache when it holds one, and stores freshly built ones there */
+extern struct lut_t *lut_build(const unsigned char *palette, unsigned int colors);
+
+extern unsigned char lut_lookup(const struct lut_t *lut, unsigned char r, unsigned char g, unsigned char b);
+
+extern void lut_free(struct lut_t *lut);
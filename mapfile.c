@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mapfile.h"
+
+#ifdef _WIN32
+
+void *map_file(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	if(!f)
+		return NULL;
+
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	void *data = len > 0 ? malloc(len) : NULL;
+	if(!data || fread(data, len, 1, f) != 1)
+	{
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+
+	fclose(f);
+	*size = len;
+	return data;
+}
+
+void unmap_file(void *data, size_t size)
+{
+	free(data);
+}
+
+#else
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void *map_file(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+	return data;
+}
+
+void unmap_file(void *data, size_t size)
+{
+	munmap(data, size);
+}
+
+#endif
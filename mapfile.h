@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Map a whole file read-only, falls back to reading it into memory where mmap isn't available */
+extern void *map_file(const char *path, size_t *size);
+
+extern void unmap_file(void *data, size_t size);
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+
+#include "match.h"
+
+/* Below this many pixels building the lookup table costs more than scanning the palette */
+#define LUT_MIN_PIXELS (1024 * 1024)
+
+/* The perceptual metrics scan slower, so their candidate grid pays off sooner */
+#define METRIC_CELLS_MIN_PIXELS (512 * 512)
+
+static void map_scalar(const struct matcher_t *m, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count)
+{
+	/* Channel offsets, BGR sources are read in place */
+	unsigned int ro = order == PIXEL_BGR ? 2 : 0;
+	unsigned int bo = 2 - ro;
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		unsigned char r = src[i*3+ro];
+		unsigned char g = src[i*3+1];
+		unsigned char b = src[i*3+bo];
+
+		/* Find closest match in colormap */
+		unsigned int delta = UINT_MAX;
+		unsigned int index = 0;
+
+		for(unsigned int j=0; j<m->colors; j++)
+		{
+			unsigned char cr = m->palette[j*3];
+			unsigned char cg = m->palette[j*3+1];
+			unsigned char cb = m->palette[j*3+2];
+
+			unsigned int d2 = abs(cr-r) + abs(cg-g) + abs(cb-b);
+			if(d2 < delta)
+			{
+				delta = d2;
+				index = j;
+			}
+		}
+
+		dst[i] = index;
+	}
+}
+
+struct matcher_t *matcher_create(const unsigned char *palette, unsigned int colors, const unsigned char *index, enum match_method_t method, enum metric_t metric)
+{
+	struct matcher_t *m = malloc(sizeof(struct matcher_t));
+	if(!m)
+		return NULL;
+
+	m->method = method;
+	m->active = MATCH_SCALAR;
+	m->metric = metric;
+	m->palette = palette;
+	m->colors = colors;
+	m->index = index;
+	m->lut = NULL;
+	m->simd = NULL;
+	m->kdtree = NULL;
+	m->metric_palette = NULL;
+
+	memset(m->output, 0, sizeof(m->output));
+	for(unsigned int j=0; j<colors; j++)
+		memcpy(m->output + (index ? index[j] : j) * 3, palette + j*3, 3);
+
+	return m;
+}
+
+int matcher_prepare(struct matcher_t *m, unsigned long pixels)
+{
+	enum match_method_t method = m->method;
+
+	/* Perceptual metrics always scan their own palette tables */
+	if(m->metric != METRIC_RGB)
+	{
+		if(method != MATCH_AUTO && method != MATCH_SCALAR)
+		{
+			printf("Only the auto and scalar match methods support the %s metric\n", metric_name(m->metric));
+			return 0;
+		}
+
+		if(m->metric_palette == NULL)
+			m->metric_palette = metric_palette_create(m->palette, m->colors, m->metric);
+		if(m->metric_palette == NULL)
+			return 0;
+
+		if(method == MATCH_AUTO && (m->metric_palette->cells || pixels >= METRIC_CELLS_MIN_PIXELS) && !metric_build_cells(m->metric_palette))
+			return 0;
+
+		/* Auto scans the grid's candidates once it is built, scalar always the whole palette */
+		m->active = method == MATCH_AUTO && m->metric_palette->cells ? MATCH_AUTO : MATCH_SCALAR;
+		return 1;
+	}
+
+	/* A table built for an earlier image is free to reuse */
+	if(method == MATCH_AUTO)
+		method = (m->lut || pixels >= LUT_MIN_PIXELS) ? MATCH_LUT : MATCH_SIMD;
+
+	if(method == MATCH_LUT && m->lut == NULL)
+		m->lut = lut_build(m->palette, m->colors);
+
+	if(method == MATCH_SIMD && m->simd == NULL)
+		m->simd = simd_palette_create(m->palette, m->colors);
+
+	if(method == MATCH_KDTREE && m->kdtree == NULL)
+		m->kdtree = kdtree_build(m->palette, m->colors);
+
+	if((method == MATCH_LUT && !m->lut) || (method == MATCH_SIMD && !m->simd) || (method == MATCH_KDTREE && !m->kdtree))
+		return 0;
+
+	m->active = method;
+	return 1;
+}
+
+void matcher_map(const struct matcher_t *m, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count)
+{
+	unsigned int ro = order == PIXEL_BGR ? 2 : 0;
+	unsigned int bo = 2 - ro;
+
+	if(m->metric_palette)
+		metric_map(m->metric_palette, m->active == MATCH_AUTO, src, order, dst, count);
+	else
+	{
+		switch(m->active)
+		{
+			case MATCH_LUT:
+				for(unsigned int i=0; i<count; i++)
+					dst[i] = lut_lookup(m->lut, src[i*3+ro], src[i*3+1], src[i*3+bo]);
+				break;
+			case MATCH_KDTREE: kdtree_map(m->kdtree, m->palette, src, order, dst, count); break;
+			case MATCH_SIMD: simd_map(m->simd, src, order, dst, count); break;
+			default: map_scalar(m, src, order, dst, count); break;
+		}
+	}
+
+	if(m->index)
+		for(unsigned int i=0; i<count; i++)
+			dst[i] = m->index[dst[i]];
+}
+
+void matcher_free(struct matcher_t *m)
+{
+	if(!m)
+		return;
+
+	lut_free(m->lut);
+	simd_palette_free(m->simd);
+	kdtree_free(m->kdtree);
+	metric_palette_free(m->metric_palette);
+	free(m);
+}
+
+int parse_match_method(const char *arg)
+{
+	if(!strcmp(arg, "auto"))
+		return MATCH_AUTO;
+	else if(!strcmp(arg, "scalar"))
+		return MATCH_SCALAR;
+	else if(!strcmp(arg, "simd"))
+		return MATCH_SIMD;
+	else if(!strcmp(arg, "lut"))
+		return MATCH_LUT;
+	else if(!strcmp(arg, "kdtree"))
+		return MATCH_KDTREE;
+
+	printf("Invalid match method: %s\n", arg);
+	return -1;
+}
+
+const char *match_method_name(const struct matcher_t *m)
+{
+	if(m->metric_palette)
+		return metric_name(m->metric);
+
+	switch(m->active)
+	{
+		case MATCH_LUT: return "lut";
+		case MATCH_KDTREE: return "kdtree";
+		case MATCH_SIMD: return simd_kernel_name();
+		default: return "scalar";
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "lut.h"
+#include "kdtree.h"
+#include "simd.h"
+#include "metric.h"
+
+/* Nearest palette color search strategies */
+enum match_method_t
+{
+	MATCH_AUTO,		// lookup table for large images, vectorized scan otherwise
+	MATCH_SCALAR,	// reference palette scan
+	MATCH_SIMD,		// vectorized palette scan
+	MATCH_LUT,		// precomputed lookup table
+	MATCH_KDTREE,	// k-d tree over the palette, for large palettes
+};
+
+struct matcher_t
+{
+	enum match_method_t method;	// requested strategy
+	enum match_method_t active;	// strategy used by matcher_map, resolved by matcher_prepare
+	enum metric_t metric;		// the lut, simd and kdtree strategies are built on the rgb metric
+	const unsigned char *palette;	// entries searched
+	unsigned int colors;
+	const unsigned char *index;		// output index of each searched entry, NULL if it is the entry's own
+	unsigned char output[768];		// RGB of each output index
+	struct lut_t *lut;
+	struct simd_palette_t *simd;
+	struct kdtree_t *kdtree;
+	struct metric_palette_t *metric_palette;
+};
+
+/* Search 'colors' palette entries. index maps them to the output indices, so reserved
+   entries can be skipped without renumbering the palette, NULL maps them to themselves */
+extern struct matcher_t *matcher_create(const unsigned char *palette, unsigned int colors, const unsigned char *index, enum match_method_t method, enum metric_t metric);
+
+/* Resolve the strategy for an image of 'pixels' pixels, building any tables it needs */
+extern int matcher_prepare(struct matcher_t *m, unsigned long pixels);
+
+/* Map count packed RGB or BGR pixels to palette indices */
+extern void matcher_map(const struct matcher_t *m, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count);
+
+extern void matcher_free(struct matcher_t *m);
+
+extern int parse_match_method(const char *arg);
+
+extern const char *match_method_name(const struct matcher_t *m);
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "memo.h"
+#include "buffer.h"
+
+/* Start small, double at half load, stop growing at this many slots (1.25MB) */
+#define MEMO_MIN_SLOTS 4096
+#define MEMO_MAX_SLOTS (1 << 18)
+
+static inline unsigned int memo_slot(unsigned int key, unsigned int mask)
+{
+	return (key * 2654435761u >> 8) & mask;
+}
+
+static int memo_alloc(struct memo_t *memo, unsigned int slots)
+{
+	memo->keys = buffer_calloc(slots * sizeof(unsigned int));
+	memo->values = buffer_alloc(slots);
+	if(!memo->keys || !memo->values)
+	{
+		buffer_free(memo->keys);
+		buffer_free(memo->values);
+		return 0;
+	}
+
+	memo->mask = slots - 1;
+	return 1;
+}
+
+struct memo_t *memo_create(void)
+{
+	struct memo_t *memo = buffer_calloc(sizeof(struct memo_t));
+	if(!memo)
+		return NULL;
+
+	if(!memo_alloc(memo, MEMO_MIN_SLOTS))
+	{
+		buffer_free(memo);
+		return NULL;
+	}
+
+	return memo;
+}
+
+static void memo_insert(struct memo_t *memo, unsigned int key, unsigned char value)
+{
+	unsigned int slot = memo_slot(key, memo->mask);
+	while(memo->keys[slot])
+		slot = (slot + 1) & memo->mask;
+
+	memo->keys[slot] = key + 1;
+	memo->values[slot] = value;
+	memo->colors++;
+}
+
+/* Double the table, or mark it full when it can't grow */
+static void memo_grow(struct memo_t *memo)
+{
+	unsigned int slots = memo->mask + 1;
+	unsigned int *keys = memo->keys;
+	unsigned char *values = memo->values;
+
+	if(slots >= MEMO_MAX_SLOTS || !memo_alloc(memo, slots * 2))
+	{
+		memo->full = 1;
+		return;
+	}
+
+	memo->colors = 0;
+	for(unsigned int i=0; i<slots; i++)
+	{
+		if(keys[i])
+			memo_insert(memo, keys[i] - 1, values[i]);
+	}
+
+	buffer_free(keys);
+	buffer_free(values);
+}
+
+void memo_map(struct memo_t *memo, const struct matcher_t *m, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count)
+{
+	if(!memo || memo->bypass)
+	{
+		if(memo)
+			memo->misses += count;
+		matcher_map(m, src, order, dst, count);
+		return;
+	}
+
+	unsigned int ro = order == PIXEL_BGR ? 2 : 0;
+	unsigned int bo = 2 - ro;
+
+	unsigned int last = UINT_MAX;
+	unsigned char last_index = 0;
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		unsigned int key = (src[i*3+ro] << 16) | (src[i*3+1] << 8) | src[i*3+bo];
+		if(key == last)
+		{
+			dst[i] = last_index;
+			memo->runs++;
+			continue;
+		}
+
+		unsigned int slot = memo_slot(key, memo->mask);
+		while(memo->keys[slot] && memo->keys[slot] != key + 1)
+			slot = (slot + 1) & memo->mask;
+
+		unsigned char index;
+		if(memo->keys[slot])
+		{
+			index = memo->values[slot];
+			memo->hits++;
+		}
+		else
+		{
+			matcher_map(m, src + i*3, order, &index, 1);
+			memo->misses++;
+
+			if(!memo->full)
+			{
+				memo->keys[slot] = key + 1;
+				memo->values[slot] = index;
+				memo->colors++;
+
+				if(memo->colors * 2 > memo->mask)
+					memo_grow(memo);
+			}
+			else if(memo->misses > memo->hits + memo->runs)
+			{
+				/* Noise-like image, the matcher does better on whole rows */
+				memo->bypass = 1;
+				memo->misses += count - i - 1;
+				dst[i] = index;
+				matcher_map(m, src + (i + 1) * 3, order, dst + i + 1, count - i - 1);
+				return;
+			}
+		}
+
+		dst[i] = index;
+		last = key;
+		last_index = index;
+	}
+}
+
+void memo_add_stats(struct memo_t *total, const struct memo_t *memo)
+{
+	if(!memo)
+		return;
+
+	total->runs += memo->runs;
+	total->hits += memo->hits;
+	total->misses += memo->misses;
+	total->bypass |= memo->bypass;
+	if(memo->colors > total->colors)
+		total->colors = memo->colors;
+}
+
+void memo_print_stats(const struct memo_t *memo)
+{
+	unsigned long lookups = memo->runs + memo->hits + memo->misses;
+	if(!lookups)
+		return;
+
+	printf("Color cache: %lu lookups, %.1f%% hits (%.1f%% runs), %u colors cached%s\n", lookups,
+		100.0 * (memo->runs + memo->hits) / lookups, 100.0 * memo->runs / lookups, memo->colors,
+		memo->bypass ? ", bypassed on a high miss rate" : "");
+}
+
+void memo_free(struct memo_t *memo)
+{
+	if(!memo)
+		return;
+
+	buffer_free(memo->keys);
+	buffer_free(memo->values);
+	buffer_free(memo);
+}
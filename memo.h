@@ -0,0 +1,34 @@
+#pragma once
+
+#include "defs.h"
+#include "match.h"
+
+/* Per-conversion cache of matched colors. Textures rarely hold more than a few
+   thousand distinct colors, so each one is matched once and every repeat is a
+   hash probe, or a plain copy inside a run of identical pixels.
+   Not shared between threads, each band or worker keeps its own */
+struct memo_t
+{
+	unsigned int *keys;		// packed RGB + 1, 0 = empty slot
+	unsigned char *values;
+	unsigned int mask;		// slot count - 1
+	unsigned int colors;	// occupied slots
+	unsigned int full;		// at the size limit, new colors are no longer stored
+	unsigned int bypass;	// full and mostly missing, rows go straight to the matcher
+	unsigned long runs;		// pixels equal to the one before
+	unsigned long hits;
+	unsigned long misses;
+};
+
+extern struct memo_t *memo_create(void);
+
+/* Same result as matcher_map */
+extern void memo_map(struct memo_t *memo, const struct matcher_t *m, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count);
+
+/* Add another memo's counters into 'total', for conversions split over several memos */
+extern void memo_add_stats(struct memo_t *total, const struct memo_t *memo);
+
+/* One line summary of hit rate and cached colors */
+extern void memo_print_stats(const struct memo_t *memo);
+
+extern void memo_free(struct memo_t *memo);
@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+
+#include "metric.h"
+#include "palcache.h"
+#include "mapfile.h"
+
+/* Delta E 2000 never falls below |dL| / SL, and SL peaks at L = 0 or 100:
+   1 + 0.015 * 2500 / sqrt(2520) = 1.747. Rounded up for float error */
+#define DE2000_MAX_SL 1.75f
+
+#define DEG (180.0f / 3.14159265f)
+#define RAD (3.14159265f / 180.0f)
+
+static float srgb_to_linear(float c)
+{
+	return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static float lab_curve(float t)
+{
+	return t > 0.008856f ? cbrtf(t) : 7.787f * t + 16.0f / 116.0f;
+}
+
+static inline float lab_f(const struct metric_palette_t *mp, float t)
+{
+	if(t <= 0.0f)
+		return mp->lab_f[0];
+	if(t >= 1.0f)
+		return mp->lab_f[LAB_F_STEPS];
+
+	float x = t * LAB_F_STEPS;
+	int i = (int)x;
+	float frac = x - i;
+	return mp->lab_f[i] + (mp->lab_f[i+1] - mp->lab_f[i]) * frac;
+}
+
+/* sRGB (D65) to f(X), f(Y), f(Z) through the cached tables. The matrix rows are
+   pre-divided by the white point so X, Y and Z land in [0, 1]. Every step is
+   monotonic in each channel, which the cell bounds below rely on */
+static inline void rgb_to_f(const struct metric_palette_t *mp, unsigned char r, unsigned char g, unsigned char b, float *f)
+{
+	float lr = mp->linear[r], lg = mp->linear[g], lb = mp->linear[b];
+
+	f[0] = lab_f(mp, 0.4339532f * lr + 0.3762153f * lg + 0.1898430f * lb);
+	f[1] = lab_f(mp, 0.2126729f * lr + 0.7151522f * lg + 0.0721750f * lb);
+	f[2] = lab_f(mp, 0.0177563f * lr + 0.1094678f * lg + 0.8727769f * lb);
+}
+
+static inline void rgb_to_lab(const struct metric_palette_t *mp, unsigned char r, unsigned char g, unsigned char b, float *lab)
+{
+	float f[3];
+	rgb_to_f(mp, r, g, b, f);
+
+	lab[0] = 116.0f * f[1] - 16.0f;
+	lab[1] = 500.0f * (f[0] - f[1]);
+	lab[2] = 200.0f * (f[1] - f[2]);
+}
+
+/* Index of the first smallest distance, ties go to the lowest index like the other matchers */
+static unsigned int first_min_int(const int *dist, unsigned int colors)
+{
+	int best = dist[0];
+	for(unsigned int j=1; j<colors; j++)
+		best = dist[j] < best ? dist[j] : best;
+
+	unsigned int index = 0;
+	while(dist[index] != best)
+		index++;
+
+	return index;
+}
+
+static unsigned int first_min_float(const float *dist, unsigned int colors)
+{
+	float best = dist[0];
+	for(unsigned int j=1; j<colors; j++)
+		best = dist[j] < best ? dist[j] : best;
+
+	unsigned int index = 0;
+	while(dist[index] != best)
+		index++;
+
+	return index;
+}
+
+static inline int weighted_dist(int r, int g, int b, int pr, int pg, int pb)
+{
+	int rmean = (r + pr) >> 1;
+	int dr = r - pr, dg = g - pg, db = b - pb;
+	return (((512 + rmean) * dr * dr) >> 8) + 4 * dg * dg + (((767 - rmean) * db * db) >> 8);
+}
+
+static inline float lab76_dist(const float *lab, float pl, float pa, float pb)
+{
+	/* Squared distance keeps the same order and skips the sqrt */
+	float dl = lab[0] - pl, da = lab[1] - pa, db = lab[2] - pb;
+	return dl * dl + da * da + db * db;
+}
+
+/* Candidate list for a color, NULL when no grid has been built or it isn't used */
+static inline const unsigned char *cell_candidates(const struct metric_palette_t *mp, unsigned int grid, unsigned char r, unsigned char g, unsigned char b, unsigned int *count)
+{
+	if(!grid || !mp->cells)
+		return NULL;
+
+	unsigned int shift = 8 - LUT_BITS;
+	const struct lut_cell_t *c = &mp->cells[((r >> shift) << (LUT_BITS * 2)) | ((g >> shift) << LUT_BITS) | (b >> shift)];
+	*count = c->count;
+	return mp->candidates + c->offset;
+}
+
+static void map_weighted(const struct metric_palette_t *mp, unsigned int grid, const unsigned char *src, unsigned int ro, unsigned int bo, unsigned char *dst, unsigned int count)
+{
+	const int *pr = mp->rgb, *pg = mp->rgb + mp->colors, *pb = mp->rgb + mp->colors * 2;
+	int dist[256];
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		int r = src[i*3+ro], g = src[i*3+1], b = src[i*3+bo];
+
+		unsigned int n;
+		const unsigned char *list = cell_candidates(mp, grid, r, g, b, &n);
+		if(list && n == 1)
+		{
+			dst[i] = list[0];
+			continue;
+		}
+
+		if(list)
+		{
+			/* Candidates are ascending, so the first minimum is the lowest index */
+			int best = INT_MAX;
+			for(unsigned int k=0; k<n; k++)
+			{
+				unsigned int j = list[k];
+				int d = weighted_dist(r, g, b, pr[j], pg[j], pb[j]);
+				if(d < best)
+				{
+					best = d;
+					dst[i] = j;
+				}
+			}
+			continue;
+		}
+
+		/* Plain integer loop over the palette planes, vectorized by the compiler */
+		for(unsigned int j=0; j<mp->colors; j++)
+			dist[j] = weighted_dist(r, g, b, pr[j], pg[j], pb[j]);
+
+		dst[i] = first_min_int(dist, mp->colors);
+	}
+}
+
+static void map_lab76(const struct metric_palette_t *mp, unsigned int grid, const unsigned char *src, unsigned int ro, unsigned int bo, unsigned char *dst, unsigned int count)
+{
+	const float *pl = mp->lab, *pa = mp->lab + mp->colors, *pb = mp->lab + mp->colors * 2;
+	float dist[256];
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		unsigned char r = src[i*3+ro], g = src[i*3+1], b = src[i*3+bo];
+
+		unsigned int n;
+		const unsigned char *list = cell_candidates(mp, grid, r, g, b, &n);
+		if(list && n == 1)
+		{
+			dst[i] = list[0];
+			continue;
+		}
+
+		float lab[3];
+		rgb_to_lab(mp, r, g, b, lab);
+
+		if(list)
+		{
+			float best = FLT_MAX;
+			for(unsigned int k=0; k<n; k++)
+			{
+				unsigned int j = list[k];
+				float d = lab76_dist(lab, pl[j], pa[j], pb[j]);
+				if(d < best)
+				{
+					best = d;
+					dst[i] = j;
+				}
+			}
+			continue;
+		}
+
+		for(unsigned int j=0; j<mp->colors; j++)
+			dist[j] = lab76_dist(lab, pl[j], pa[j], pb[j]);
+
+		dst[i] = first_min_float(dist, mp->colors);
+	}
+}
+
+static inline float pow7(float x)
+{
+	float x2 = x * x;
+	return x2 * x2 * x2 * x;
+}
+
+static float hue_deg(float b, float a)
+{
+	if(a == 0.0f && b == 0.0f)
+		return 0.0f;
+
+	float h = atan2f(b, a) * DEG;
+	return h < 0.0f ? h + 360.0f : h;
+}
+
+/* Squared CIEDE2000 difference (kL = kC = kH = 1), per Sharma, Wu and Dalal. c1 and c2 are the chromas */
+static float de2000_sq(float l1, float a1, float b1, float c1, float l2, float a2, float b2, float c2)
+{
+	float cbar = (c1 + c2) * 0.5f;
+	float cbar7 = pow7(cbar);
+	float g = 0.5f * (1.0f - sqrtf(cbar7 / (cbar7 + 6103515625.0f)));
+
+	float a1p = (1.0f + g) * a1, a2p = (1.0f + g) * a2;
+	float c1p = sqrtf(a1p * a1p + b1 * b1), c2p = sqrtf(a2p * a2p + b2 * b2);
+	float h1p = hue_deg(b1, a1p), h2p = hue_deg(b2, a2p);
+
+	float dlp = l2 - l1;
+	float dcp = c2p - c1p;
+
+	float dhp = 0.0f, hbar = h1p + h2p;
+	if(c1p * c2p != 0.0f)
+	{
+		dhp = h2p - h1p;
+		if(dhp > 180.0f)
+			dhp -= 360.0f;
+		else if(dhp < -180.0f)
+			dhp += 360.0f;
+
+		if(fabsf(h1p - h2p) <= 180.0f)
+			hbar = (h1p + h2p) * 0.5f;
+		else if(h1p + h2p < 360.0f)
+			hbar = (h1p + h2p + 360.0f) * 0.5f;
+		else
+			hbar = (h1p + h2p - 360.0f) * 0.5f;
+	}
+	float dHp = 2.0f * sqrtf(c1p * c2p) * sinf(dhp * 0.5f * RAD);
+
+	float lbar = (l1 + l2) * 0.5f;
+	float cbarp = (c1p + c2p) * 0.5f;
+
+	float t = 1.0f - 0.17f * cosf((hbar - 30.0f) * RAD) + 0.24f * cosf(2.0f * hbar * RAD)
+		+ 0.32f * cosf((3.0f * hbar + 6.0f) * RAD) - 0.20f * cosf((4.0f * hbar - 63.0f) * RAD);
+
+	float dtheta = 30.0f * expf(-((hbar - 275.0f) / 25.0f) * ((hbar - 275.0f) / 25.0f));
+	float cbarp7 = pow7(cbarp);
+	float rc = 2.0f * sqrtf(cbarp7 / (cbarp7 + 6103515625.0f));
+	float l50 = (lbar - 50.0f) * (lbar - 50.0f);
+	float sl = 1.0f + 0.015f * l50 / sqrtf(20.0f + l50);
+	float sc = 1.0f + 0.045f * cbarp;
+	float sh = 1.0f + 0.015f * cbarp * t;
+	float rt = -sinf(2.0f * dtheta * RAD) * rc;
+
+	float x = dlp / sl, y = dcp / sc, z = dHp / sh;
+	return x * x + y * y + z * z + rt * y * z;
+}
+
+/* Lower bound on squared Delta E 2000 without any trig. The cross term is at least
+   -|RT| / 2 of the C and H terms with |RT| <= 2 sin(60), SL <= 1.75, and C' and H'
+   together span at least the a/b distance, scaled down by SC <= 1 + 0.045 * 1.5 * max chroma */
+static inline float de2000_lower_sq(float dl, float dab_sq, float max_chroma)
+{
+	float s = 1.0f + 0.0675f * max_chroma;
+	return dl * dl / (DE2000_MAX_SL * DE2000_MAX_SL) + 0.1339f * dab_sq / (s * s);
+}
+
+/* Tighter bound for one pair, still without trig. G, C', SL, SC and RC are cheap
+   and exact, |dH'|^2 = |da'|^2 + db^2 - dC'^2. Only T and the sign of RT are left
+   open: SH lies in [1, 1 + 0.015 * 1.93 * C'], |RT| <= RC sin(60) */
+static float de2000_pair_lower_sq(float l1, float a1, float b1, float c1, float l2, float a2, float b2, float c2)
+{
+	float cbar = (c1 + c2) * 0.5f;
+	float cbar7 = pow7(cbar);
+	float g = 1.5f - 0.5f * sqrtf(cbar7 / (cbar7 + 6103515625.0f));
+
+	float a1p = g * a1, a2p = g * a2;
+	float c1p = sqrtf(a1p * a1p + b1 * b1), c2p = sqrtf(a2p * a2p + b2 * b2);
+	float dcp = c2p - c1p;
+	float dap = a2p - a1p, db = b2 - b1;
+	float dhp_sq = dap * dap + db * db - dcp * dcp;
+	if(dhp_sq < 0.0f)
+		dhp_sq = 0.0f;
+
+	float lbar = (l1 + l2) * 0.5f;
+	float l50 = (lbar - 50.0f) * (lbar - 50.0f);
+	float sl = 1.0f + 0.015f * l50 / sqrtf(20.0f + l50);
+	float cbarp = (c1p + c2p) * 0.5f;
+	float sc = 1.0f + 0.045f * cbarp;
+	float sh_max = 1.0f + 0.029f * cbarp;
+	float cbarp7 = pow7(cbarp);
+	float rt = 1.7321f * sqrtf(cbarp7 / (cbarp7 + 6103515625.0f));
+
+	/* Minimise y^2 + z^2 - rt |y| z over z in [|dH'| / sh_max, |dH'|], lowest at rt |y| / 2 */
+	float x = (l2 - l1) / sl, y = fabsf(dcp) / sc;
+	float dhp = sqrtf(dhp_sq);
+	float z = rt * y * 0.5f;
+	if(z < dhp / sh_max)
+		z = dhp / sh_max;
+	else if(z > dhp)
+		z = dhp;
+
+	return x * x + y * y + z * z - rt * y * z;
+}
+
+/* Delta E 2000 is too costly to evaluate against every palette entry. The search
+   starts from the closest entry by Delta E 1976 and only evaluates entries whose
+   lower bound can still beat the best match so far */
+static unsigned int search_lab2000(const struct metric_palette_t *mp, const float *lab, const unsigned char *list, unsigned int n)
+{
+	const float *pl = mp->lab, *pa = mp->lab + mp->colors, *pb = mp->lab + mp->colors * 2;
+	float chroma = sqrtf(lab[1] * lab[1] + lab[2] * lab[2]);
+
+	unsigned int seed = list[0];
+	float seed_dist = FLT_MAX;
+	for(unsigned int k=0; k<n; k++)
+	{
+		float d = lab76_dist(lab, pl[list[k]], pa[list[k]], pb[list[k]]);
+		if(d < seed_dist)
+		{
+			seed_dist = d;
+			seed = list[k];
+		}
+	}
+
+	unsigned int index = seed;
+	float best = de2000_sq(lab[0], lab[1], lab[2], chroma, pl[seed], pa[seed], pb[seed], mp->chroma[seed]);
+
+	for(unsigned int k=0; k<n; k++)
+	{
+		unsigned int j = list[k];
+		if(j == seed)
+			continue;
+
+		/* Cheapest bound first. Slack covers float rounding, ties still reach the full evaluation */
+		float dl = lab[0] - pl[j], da = lab[1] - pa[j], db = lab[2] - pb[j];
+		float limit = best * 1.001f + 0.0001f;
+		if(de2000_lower_sq(dl, da * da + db * db, chroma > mp->chroma[j] ? chroma : mp->chroma[j]) > limit)
+			continue;
+		if(de2000_pair_lower_sq(lab[0], lab[1], lab[2], chroma, pl[j], pa[j], pb[j], mp->chroma[j]) > limit)
+			continue;
+
+		float d = de2000_sq(lab[0], lab[1], lab[2], chroma, pl[j], pa[j], pb[j], mp->chroma[j]);
+		if(d < best || (d == best && j < index))
+		{
+			best = d;
+			index = j;
+		}
+	}
+
+	return index;
+}
+
+static void map_lab2000(const struct metric_palette_t *mp, unsigned int grid, const unsigned char *src, unsigned int ro, unsigned int bo, unsigned char *dst, unsigned int count)
+{
+	for(unsigned int i=0; i<count; i++)
+	{
+		unsigned char r = src[i*3+ro], g = src[i*3+1], b = src[i*3+bo];
+
+		unsigned int n = mp->colors;
+		const unsigned char *list = cell_candidates(mp, grid, r, g, b, &n);
+		if(!list)
+			list = mp->all;
+
+		if(n == 1)
+		{
+			dst[i] = list[0];
+			continue;
+		}
+
+		float lab[3];
+		rgb_to_lab(mp, r, g, b, lab);
+		dst[i] = search_lab2000(mp, lab, list, n);
+	}
+}
+
+static float axis_min(float c, float lo, float hi)
+{
+	if(c < lo)
+		return lo - c;
+	if(c > hi)
+		return c - hi;
+	return 0.0f;
+}
+
+static float axis_max(float c, float lo, float hi)
+{
+	return (c - lo > hi - c) ? c - lo : hi - c;
+}
+
+/* Bounds on the distance from each palette entry to any color in the RGB box [lo, hi] */
+static void cell_bounds(const struct metric_palette_t *mp, const int *lo, const int *hi, float *dmin, float *dmax)
+{
+	unsigned int colors = mp->colors;
+
+	if(mp->metric == METRIC_WEIGHTED)
+	{
+		/* Each term is a product of non-negative factors, bounded by their own extremes */
+		for(unsigned int j=0; j<colors; j++)
+		{
+			int pr = mp->rgb[j], pg = mp->rgb[colors+j], pb = mp->rgb[colors*2+j];
+			int rm_lo = (lo[0] + pr) >> 1, rm_hi = (hi[0] + pr) >> 1;
+			int nr = axis_min(pr, lo[0], hi[0]), ng = axis_min(pg, lo[1], hi[1]), nb = axis_min(pb, lo[2], hi[2]);
+			int xr = axis_max(pr, lo[0], hi[0]), xg = axis_max(pg, lo[1], hi[1]), xb = axis_max(pb, lo[2], hi[2]);
+
+			dmin[j] = (((512 + rm_lo) * nr * nr) >> 8) + 4 * ng * ng + (((767 - rm_hi) * nb * nb) >> 8);
+			dmax[j] = (((512 + rm_hi) * xr * xr) >> 8) + 4 * xg * xg + (((767 - rm_lo) * xb * xb) >> 8);
+		}
+		return;
+	}
+
+	/* f(X), f(Y) and f(Z) rise with every channel, so the box corners bound L, a and b */
+	float flo[3], fhi[3];
+	rgb_to_f(mp, lo[0], lo[1], lo[2], flo);
+	rgb_to_f(mp, hi[0], hi[1], hi[2], fhi);
+
+	float box_lo[3] = { 116.0f * flo[1] - 16.0f, 500.0f * (flo[0] - fhi[1]), 200.0f * (flo[1] - fhi[2]) };
+	float box_hi[3] = { 116.0f * fhi[1] - 16.0f, 500.0f * (fhi[0] - flo[1]), 200.0f * (fhi[1] - flo[2]) };
+
+	for(unsigned int j=0; j<colors; j++)
+	{
+		dmin[j] = dmax[j] = 0.0f;
+		for(int c=0; c<3; c++)
+		{
+			float v = mp->lab[c*colors+j];
+			float n = axis_min(v, box_lo[c], box_hi[c]);
+			float x = axis_max(v, box_lo[c], box_hi[c]);
+			dmin[j] += n * n;
+			dmax[j] += x * x;
+		}
+	}
+}
+
+static void drop_cells(struct metric_palette_t *mp)
+{
+	if(mp->mapping)
+		unmap_file(mp->mapping, mp->mapping_size);
+	else
+	{
+		free(mp->cells);
+		free(mp->candidates);
+	}
+	mp->mapping = NULL;
+	mp->cells = NULL;
+	mp->candidates = NULL;
+}
+
+int metric_build_cells(struct metric_palette_t *mp)
+{
+	/* Delta E 2000 has no upper bound over a cell tight enough to rule anything out */
+	if(mp->cells || mp->metric == METRIC_LAB2000)
+		return 1;
+
+	mp->mapping = palcache_load(metric_name(mp->metric), mp->palette, mp->colors, &mp->cells, &mp->candidates, &mp->mapping_size);
+	if(mp->mapping)
+		return 1;
+
+	unsigned int colors = mp->colors;
+	unsigned int capacity = LUT_CELLS * 4;
+	unsigned int used = 0;
+
+	mp->cells = malloc(LUT_CELLS * sizeof(struct lut_cell_t));
+	mp->candidates = malloc(capacity);
+	float *dmin = malloc(colors * sizeof(float));
+	float *dmax = malloc(colors * sizeof(float));
+
+	if(!mp->cells || !mp->candidates || !dmin || !dmax)
+	{
+		printf("Failed to malloc metric lookup table\n");
+		free(dmin);
+		free(dmax);
+		drop_cells(mp);
+		return 0;
+	}
+
+	unsigned int shift = 8 - LUT_BITS, mask = (1 << LUT_BITS) - 1;
+
+	for(unsigned int cell=0; cell<LUT_CELLS; cell++)
+	{
+		int lo[3] = { (cell >> (LUT_BITS * 2)) << shift, ((cell >> LUT_BITS) & mask) << shift, (cell & mask) << shift };
+		int hi[3] = { lo[0] + (1 << shift) - 1, lo[1] + (1 << shift) - 1, lo[2] + (1 << shift) - 1 };
+
+		cell_bounds(mp, lo, hi, dmin, dmax);
+
+		/* As in lut_build: no entry further than the best worst case can win. The slack
+		   covers float rounding in the distance functions, extra candidates are harmless */
+		float bound = FLT_MAX;
+		for(unsigned int j=0; j<colors; j++)
+			bound = dmax[j] < bound ? dmax[j] : bound;
+		bound = bound * 1.001f + 0.01f;
+
+		if(used + colors > capacity)
+		{
+			capacity *= 2;
+			unsigned char *grown = realloc(mp->candidates, capacity);
+			if(!grown)
+			{
+				printf("Failed to grow metric lookup table\n");
+				free(dmin);
+				free(dmax);
+				drop_cells(mp);
+				return 0;
+			}
+			mp->candidates = grown;
+		}
+
+		mp->cells[cell].offset = used;
+		for(unsigned int j=0; j<colors; j++)
+		{
+			if(dmin[j] <= bound)
+				mp->candidates[used++] = j;
+		}
+		mp->cells[cell].count = used - mp->cells[cell].offset;
+	}
+
+	free(dmin);
+	free(dmax);
+	palcache_store(metric_name(mp->metric), mp->palette, colors, mp->cells, mp->candidates);
+	return 1;
+}
+
+struct metric_palette_t *metric_palette_create(const unsigned char *palette, unsigned int colors, enum metric_t metric)
+{
+	if(colors < 1 || colors > 256)
+		return NULL;
+
+	struct metric_palette_t *mp = calloc(1, sizeof(struct metric_palette_t));
+	if(!mp)
+		return NULL;
+
+	mp->metric = metric;
+	mp->palette = palette;
+	mp->colors = colors;
+
+	for(int i=0; i<256; i++)
+		mp->linear[i] = srgb_to_linear(i / 255.0f);
+	for(int i=0; i<=LAB_F_STEPS; i++)
+		mp->lab_f[i] = lab_curve((float)i / LAB_F_STEPS);
+	mp->lab_f[LAB_F_STEPS+1] = mp->lab_f[LAB_F_STEPS];
+
+	if(metric == METRIC_WEIGHTED)
+	{
+		mp->rgb = malloc(colors * 3 * sizeof(int));
+		if(!mp->rgb)
+		{
+			metric_palette_free(mp);
+			return NULL;
+		}
+
+		for(unsigned int j=0; j<colors; j++)
+			for(int c=0; c<3; c++)
+				mp->rgb[c*colors+j] = palette[j*3+c];
+
+		return mp;
+	}
+
+	/* Palette side goes through the same tables as the source, so an exact palette color matches itself */
+	mp->lab = malloc(colors * 3 * sizeof(float));
+	mp->chroma = malloc(colors * sizeof(float));
+	mp->all = malloc(colors);
+	if(!mp->lab || !mp->chroma || !mp->all)
+	{
+		metric_palette_free(mp);
+		return NULL;
+	}
+
+	for(unsigned int j=0; j<colors; j++)
+	{
+		float lab[3];
+		rgb_to_lab(mp, palette[j*3], palette[j*3+1], palette[j*3+2], lab);
+
+		for(int c=0; c<3; c++)
+			mp->lab[c*colors+j] = lab[c];
+		mp->chroma[j] = sqrtf(lab[1] * lab[1] + lab[2] * lab[2]);
+		mp->all[j] = j;
+	}
+
+	return mp;
+}
+
+void metric_map(const struct metric_palette_t *mp, unsigned int grid, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count)
+{
+	unsigned int ro = order == PIXEL_BGR ? 2 : 0;
+	unsigned int bo = 2 - ro;
+
+	switch(mp->metric)
+	{
+		case METRIC_WEIGHTED: map_weighted(mp, grid, src, ro, bo, dst, count); break;
+		case METRIC_LAB76: map_lab76(mp, grid, src, ro, bo, dst, count); break;
+		case METRIC_LAB2000: map_lab2000(mp, grid, src, ro, bo, dst, count); break;
+		default: break;
+	}
+}
+
+void metric_delta_e(const struct metric_palette_t *mp, const unsigned char *src, enum pixel_order_t order, const unsigned char *indices, float *de, unsigned int count)
+{
+	unsigned int ro = order == PIXEL_BGR ? 2 : 0;
+	unsigned int bo = 2 - ro;
+	const float *pl = mp->lab, *pa = mp->lab + mp->colors, *pb = mp->lab + mp->colors * 2;
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		const unsigned char *p = src + i*3;
+
+		/* Flat areas repeat the same pixel and index */
+		if(i > 0 && indices[i] == indices[i-1] && !memcmp(p, p - 3, 3))
+		{
+			de[i] = de[i-1];
+			continue;
+		}
+
+		float lab[3];
+		rgb_to_lab(mp, p[ro], p[1], p[bo], lab);
+
+		unsigned int j = indices[i];
+		de[i] = sqrtf(lab76_dist(lab, pl[j], pa[j], pb[j]));
+	}
+}
+
+void metric_palette_free(struct metric_palette_t *mp)
+{
+	if(!mp)
+		return;
+
+	free(mp->rgb);
+	free(mp->lab);
+	free(mp->chroma);
+	free(mp->all);
+	drop_cells(mp);
+	free(mp);
+}
+
+int parse_metric(const char *arg)
+{
+	if(!strcmp(arg, "rgb"))
+		return METRIC_RGB;
+	else if(!strcmp(arg, "weighted"))
+		return METRIC_WEIGHTED;
+	else if(!strcmp(arg, "lab76"))
+		return METRIC_LAB76;
+	else if(!strcmp(arg, "lab2000"))
+		return METRIC_LAB2000;
+
+	printf("Invalid color metric: %s\n", arg);
+	return -1;
+}
+
+const char *metric_name(enum metric_t metric)
+{
+	switch(metric)
+	{
+		case METRIC_WEIGHTED: return "weighted";
+		case METRIC_LAB76: return "lab76";
+		case METRIC_LAB2000: return "lab2000";
+		default: return "rgb";
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "defs.h"
+#include "lut.h"
+
+/* Color distance metrics */
+enum metric_t
+{
+	METRIC_RGB,			// sum of absolute channel differences, the original metric
+	METRIC_WEIGHTED,	// "redmean" weighted RGB, cheap but tracks hue in dark ramps far better
+	METRIC_LAB76,		// CIELAB Delta E 1976
+	METRIC_LAB2000,		// CIELAB Delta E 2000
+	METRIC_COUNT,
+};
+
+/* Size of the table the CIELAB f(t) curve is sampled into */
+#define LAB_F_STEPS 4096
+
+/* Palette converted once for a perceptual metric, plus the tables that convert
+   source pixels without per-pixel pow() and cbrt() calls */
+struct metric_palette_t
+{
+	enum metric_t metric;
+	const unsigned char *palette;	// RGB triplets, keys the cached candidate grid
+	unsigned int colors;
+	int *rgb;				// weighted: palette channels, structure of arrays
+	float *lab;				// Lab metrics: L, a and b planes of 'colors' entries
+	float *chroma;			// Delta E 2000: palette chroma
+	unsigned char *all;		// Lab metrics: every palette index, the candidate list without cells
+	float linear[256];		// sRGB byte to linear
+	float lab_f[LAB_F_STEPS + 2];
+	struct lut_cell_t *cells;	// optional grid of candidate lists, laid out like lut_t
+	unsigned char *candidates;
+	void *mapping;			// cache file the grid points into, NULL if it is malloc'd
+	size_t mapping_size;
+};
+
+extern struct metric_palette_t *metric_palette_create(const unsigned char *palette, unsigned int colors, enum metric_t metric);
+
+/* Build the candidate grid, worth it once an image has more pixels than the grid has cells */
+extern int metric_build_cells(struct metric_palette_t *mp);
+
+/* Map count packed RGB or BGR pixels to the nearest palette indices under the metric,
+   narrowed down by the candidate grid if 'grid' is set and it has been built */
+extern void metric_map(const struct metric_palette_t *mp, unsigned int grid, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count);
+
+/* Delta E 1976 between count packed RGB or BGR pixels and the palette entries at their
+   indices, through the same tables the Lab metrics match with. mp must be a Lab metric */
+extern void metric_delta_e(const struct metric_palette_t *mp, const unsigned char *src, enum pixel_order_t order, const unsigned char *indices, float *de, unsigned int count);
+
+extern void metric_palette_free(struct metric_palette_t *mp);
+
+extern int parse_metric(const char *arg);
+
+extern const char *metric_name(enum metric_t metric);
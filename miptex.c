@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miptex.h"
+#include "image.h"
+
+struct miptex_header_t
+{
+	char name[MIPTEX_NAME_LEN];
+	unsigned int width;
+	unsigned int height;
+	unsigned int offsets[MIPTEX_LEVELS];	// from the start of the header
+};
+
+struct qpic_header_t
+{
+	unsigned int width;
+	unsigned int height;
+};
+
+void miptex_name(const char *path, char *name)
+{
+	const char *base = strrchr(path, '/');
+	const char *bslash = strrchr(path, '\\');
+	if(bslash && (!base || bslash > base))
+		base = bslash;
+	base = base ? base + 1 : path;
+
+	size_t len = strlen(base);
+	const char *dot = strrchr(base, '.');
+	if(dot)
+		len = dot - base;
+
+	/* qpalette's own default output names end in _conv, the texture shouldn't */
+	if(len > 5 && !strncmp(base + len - 5, "_conv", 5))
+		len -= 5;
+	if(len > MIPTEX_NAME_LEN - 1)
+		len = MIPTEX_NAME_LEN - 1;
+
+	memset(name, 0, MIPTEX_NAME_LEN);
+	memcpy(name, base, len);
+}
+
+/* Copy a bottom-up level to dst, top row first */
+static void copy_top_down(const unsigned char *level, unsigned int width, unsigned int height, unsigned char *dst)
+{
+	for(unsigned int y=0; y<height; y++)
+		memcpy(dst + (size_t)y * width, level + (size_t)(height - 1 - y) * width, width);
+}
+
+size_t miptex_size(unsigned int width, unsigned int height)
+{
+	return sizeof(struct miptex_header_t) + image_level_offset(width, height, MIPTEX_LEVELS);
+}
+
+int miptex_encode(const struct image_t *image, const char *name, unsigned char *out)
+{
+	const struct img_info_t *info = image->info;
+	if(info->bpp != 8 || info->levels < MIPTEX_LEVELS)
+	{
+		printf("Error: Miptex needs an 8bit image with %d mip levels\n", MIPTEX_LEVELS);
+		return 0;
+	}
+
+	struct miptex_header_t header;
+	memset(&header, 0, sizeof(header));
+	strncpy(header.name, name, MIPTEX_NAME_LEN - 1);
+	header.width = info->width;
+	header.height = info->height;
+
+	for(unsigned int l=0; l<MIPTEX_LEVELS; l++)
+	{
+		size_t offset = image_level_offset(info->width, info->height, l);
+		header.offsets[l] = sizeof(struct miptex_header_t) + offset;
+		copy_top_down(image->data + offset, info->width >> l, info->height >> l, out + header.offsets[l]);
+	}
+
+	memcpy(out, &header, sizeof(header));
+	return 1;
+}
+
+unsigned char *miptex_build(const struct image_t *image, const char *name, size_t *size)
+{
+	*size = miptex_size(image->info->width, image->info->height);
+	unsigned char *lump = malloc(*size);
+	if(!lump)
+	{
+		printf("Failed to malloc miptex\n");
+		return NULL;
+	}
+
+	if(!miptex_encode(image, name, lump))
+	{
+		free(lump);
+		return NULL;
+	}
+
+	return lump;
+}
+
+int write_miptex(struct image_t *image, const char *path)
+{
+	char name[MIPTEX_NAME_LEN];
+	miptex_name(path, name);
+
+	size_t size;
+	unsigned char *lump = miptex_build(image, name, &size);
+	if(!lump)
+		return 0;
+
+	FILE *f = fopen(path, "wb");
+	if(!f)
+	{
+		printf("Failed to open %s for writing\n", path);
+		free(lump);
+		return 0;
+	}
+
+	int ok = fwrite(lump, size, 1, f) == 1;
+	if(fclose(f) != 0)
+		ok = 0;
+
+	free(lump);
+	return ok;
+}
+
+int write_lmp(struct image_t *image, const char *path)
+{
+	const struct img_info_t *info = image->info;
+
+	FILE *f = fopen(path, "wb");
+	if(!f)
+	{
+		printf("Failed to open %s for writing\n", path);
+		return 0;
+	}
+
+	struct qpic_header_t header = { info->width, info->height };
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+	for(unsigned int y=0; ok && y<info->height; y++)
+		ok = fwrite(image->data + (size_t)(info->height - 1 - y) * info->stride, info->width, 1, f) == 1;
+
+	if(fclose(f) != 0)
+		ok = 0;
+
+	return ok;
+}
+
+/* qpic rows are top-down, so streamed rows go straight out */
+struct lmp_row_state_t
+{
+	FILE *f;
+	unsigned int width;
+};
+
+static int lmp_write_row(void *state, const unsigned char *indices)
+{
+	struct lmp_row_state_t *s = state;
+	return fwrite(indices, s->width, 1, s->f) == 1;
+}
+
+static int lmp_close_writer(void *state)
+{
+	struct lmp_row_state_t *s = state;
+	int ok = fclose(s->f) == 0;
+
+	free(s);
+	return ok;
+}
+
+int lmp_open_writer(const char *path, unsigned int width, unsigned int height, struct row_writer_t *writer)
+{
+	FILE *f = fopen(path, "wb");
+	if(!f)
+	{
+		printf("Failed to open %s for writing\n", path);
+		return 0;
+	}
+
+	struct qpic_header_t header = { width, height };
+	struct lmp_row_state_t *s = malloc(sizeof(struct lmp_row_state_t));
+	if(!s || fwrite(&header, sizeof(header), 1, f) != 1)
+	{
+		free(s);
+		fclose(f);
+		return 0;
+	}
+
+	s->f = f;
+	s->width = width;
+
+	writer->state = s;
+	writer->write_row = lmp_write_row;
+	writer->close = lmp_close_writer;
+
+	return 1;
+}
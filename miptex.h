@@ -0,0 +1,30 @@
+#pragma once
+
+#include "defs.h"
+#include "stream.h"
+
+/* Quake texture lumps, written from 8bit images */
+
+#define MIPTEX_LEVELS 4
+#define MIPTEX_NAME_LEN 16
+
+/* Texture name for a path: the file name without extension or a trailing _conv, cut to 15 characters */
+extern void miptex_name(const char *path, char *name);
+
+/* Length of the miptex lump of a width x height texture */
+extern size_t miptex_size(unsigned int width, unsigned int height);
+
+/* Encode a miptex lump (header and all 4 levels, top-down) into miptex_size bytes at out.
+   The image must carry MIPTEX_LEVELS levels, see convert_options_t.mip_levels */
+extern int miptex_encode(const struct image_t *image, const char *name, unsigned char *out);
+
+/* miptex_encode into a malloc'd lump, *size is set to its length */
+extern unsigned char *miptex_build(const struct image_t *image, const char *name, size_t *size);
+
+/* .mip: a single miptex lump, as found in BSP texture lumps and WAD2 files */
+extern int write_miptex(struct image_t *image, const char *path);
+
+/* .lmp: a qpic lump (width, height, then top-down pixels), as used for gfx/ lumps */
+extern int write_lmp(struct image_t *image, const char *path);
+
+extern int lmp_open_writer(const char *path, unsigned int width, unsigned int height, struct row_writer_t *writer);
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "palcache.h"
+#include "mapfile.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_dir(path) _mkdir(path)
+#else
+#define make_dir(path) mkdir(path, 0755)
+#endif
+
+/* Bumped whenever the grid layout or the bounds the grids are built with change */
+#define PALCACHE_MAGIC "QPGRID1"
+
+struct palcache_header_t
+{
+	char magic[8];
+	unsigned long long hash;
+	unsigned int colors;
+	unsigned int cells;
+	unsigned int candidates;
+	unsigned int reserved;
+	unsigned char palette[768];		// checked on load, a hash collision can't hand out a wrong grid
+};
+
+/* FNV-1a over everything the grid depends on */
+static unsigned long long grid_hash(const char *kind, const unsigned char *palette, unsigned int colors)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	const unsigned char *parts[3] = { (const unsigned char *)PALCACHE_MAGIC, (const unsigned char *)kind, palette };
+	size_t sizes[3] = { sizeof(PALCACHE_MAGIC), strlen(kind) + 1, colors * 3 };
+
+	for(int p=0; p<3; p++)
+	{
+		for(size_t i=0; i<sizes[p]; i++)
+		{
+			h ^= parts[p][i];
+			h *= 1099511628211ULL;
+		}
+	}
+
+	h ^= LUT_BITS;
+	h *= 1099511628211ULL;
+	return h;
+}
+
+/* Cache directory, created if 'create' is set. 0 if caching is disabled */
+static int cache_dir(char *dir, int create)
+{
+	const char *env = getenv("QPALETTE_CACHE");
+	if(env)
+	{
+		if(env[0] == '\0' || strlen(env) >= PATH_MAX - 64)
+			return 0;
+		strcpy(dir, env);
+	}
+	else
+	{
+		const char *base = getenv("XDG_CACHE_HOME");
+		const char *home = getenv("HOME");
+		if(base && base[0] && strlen(base) < PATH_MAX - 64)
+			snprintf(dir, PATH_MAX, "%s/qpalette", base);
+		else if(home && home[0] && strlen(home) < PATH_MAX - 64)
+		{
+			snprintf(dir, PATH_MAX, "%s/.cache", home);
+			if(create)
+				make_dir(dir);
+			strcat(dir, "/qpalette");
+		}
+		else
+			return 0;
+	}
+
+	if(create)
+		make_dir(dir);
+
+	return 1;
+}
+
+static int grid_path(const char *kind, unsigned long long hash, char *path, int create)
+{
+	char dir[PATH_MAX];
+	if(!cache_dir(dir, create))
+		return 0;
+
+	return snprintf(path, PATH_MAX, "%s/%s-%016llx.grid", dir, kind, hash) < PATH_MAX;
+}
+
+void *palcache_load(const char *kind, const unsigned char *palette, unsigned int colors, struct lut_cell_t **cells, unsigned char **candidates, size_t *size)
+{
+	unsigned long long hash = grid_hash(kind, palette, colors);
+
+	char path[PATH_MAX];
+	if(!grid_path(kind, hash, path, 0))
+		return NULL;
+
+	size_t len;
+	unsigned char *data = map_file(path, &len);
+	if(!data)
+		return NULL;
+
+	/* The file is validated fully, lookups index with it unchecked */
+	const struct palcache_header_t *header = (const struct palcache_header_t *)data;
+	const struct lut_cell_t *c = (const struct lut_cell_t *)(data + sizeof(struct palcache_header_t));
+	const unsigned char *list = (const unsigned char *)(c + LUT_CELLS);
+
+	int ok = len >= sizeof(struct palcache_header_t) && !memcmp(header->magic, PALCACHE_MAGIC, sizeof(header->magic)) &&
+		header->hash == hash && header->colors == colors && header->cells == LUT_CELLS &&
+		!memcmp(header->palette, palette, colors * 3) &&
+		len == sizeof(struct palcache_header_t) + LUT_CELLS * sizeof(struct lut_cell_t) + (size_t)header->candidates;
+
+	for(unsigned int i=0; ok && i<LUT_CELLS; i++)
+		ok = c[i].count > 0 && c[i].count <= colors && c[i].count <= header->candidates && c[i].offset <= header->candidates - c[i].count;
+	for(unsigned int i=0; ok && i<header->candidates; i++)
+		ok = list[i] < colors;
+
+	if(!ok)
+	{
+		unmap_file(data, len);
+		return NULL;
+	}
+
+	*cells = (struct lut_cell_t *)c;
+	*candidates = (unsigned char *)list;
+	*size = len;
+	return data;
+}
+
+void palcache_store(const char *kind, const unsigned char *palette, unsigned int colors, const struct lut_cell_t *cells, const unsigned char *candidates)
+{
+	unsigned long long hash = grid_hash(kind, palette, colors);
+
+	char path[PATH_MAX], tmp[PATH_MAX + 32];
+	if(!grid_path(kind, hash, path, 1))
+		return;
+
+	struct palcache_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PALCACHE_MAGIC, sizeof(header.magic));
+	header.hash = hash;
+	header.colors = colors;
+	header.cells = LUT_CELLS;
+	header.candidates = cells[LUT_CELLS-1].offset + cells[LUT_CELLS-1].count;
+	memcpy(header.palette, palette, colors * 3);
+
+	/* Readers only ever see a missing file or a complete one */
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	FILE *f = fopen(tmp, "wb");
+	if(!f)
+		return;
+
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		fwrite(cells, sizeof(struct lut_cell_t), LUT_CELLS, f) == LUT_CELLS &&
+		fwrite(candidates, 1, header.candidates, f) == header.candidates;
+
+	if(fclose(f) != 0 || !ok || rename(tmp, path) != 0)
+		remove(tmp);
+}
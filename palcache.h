@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "lut.h"
+
+/* Compiled candidate grids (the lookup table and the metric cells) persisted per palette
+   under $QPALETTE_CACHE, $XDG_CACHE_HOME/qpalette or ~/.cache/qpalette. A grid is written
+   once under a temporary name and renamed into place, then only ever mapped read-only, so
+   concurrent processes share it without rebuilding. An empty QPALETTE_CACHE disables it */
+
+/* Map the grid cached for 'kind' over palette, returns the mapping or NULL if there is none */
+extern void *palcache_load(const char *kind, const unsigned char *palette, unsigned int colors, struct lut_cell_t **cells, unsigned char **candidates, size_t *size);
+
+/* Persist a grid of LUT_CELLS cells, failures only cost a rebuild next time */
+extern void palcache_store(const char *kind, const unsigned char *palette, unsigned int colors, const struct lut_cell_t *cells, const unsigned char *candidates);
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "palette.h"
+
+#define PALETTE_MAX_COLORS 256
+
+/* Largest palette file read, text palettes carry a color name on every line */
+#define PALETTE_FILE_MAX (64 * 1024)
+
+/* Text palettes hold one "r g b" entry per line after the header. GIMP entries may
+   be followed by a name, JASC files give the entry count on their third line */
+static int parse_text(char *text, int jasc, unsigned char *rgb, unsigned int *colors)
+{
+	unsigned int count = 0, expected = 0, line_no = 0;
+	char *save;
+
+	for(char *line = strtok_r(text, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save))
+	{
+		line_no++;
+		if(line_no == 1 || (jasc && line_no == 2)) // header and JASC version
+			continue;
+		if(jasc && line_no == 3)
+		{
+			expected = atoi(line);
+			continue;
+		}
+
+		while(isspace((unsigned char)*line))
+			line++;
+		if(*line == '\0' || *line == '#' || !strncmp(line, "Name:", 5) || !strncmp(line, "Columns:", 8))
+			continue;
+
+		int r, g, b;
+		if(sscanf(line, "%d %d %d", &r, &g, &b) != 3 || r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255)
+		{
+			printf("Invalid palette entry: %s\n", line);
+			return 0;
+		}
+
+		if(count == PALETTE_MAX_COLORS)
+		{
+			printf("Palette has more than %d colors\n", PALETTE_MAX_COLORS);
+			return 0;
+		}
+
+		rgb[count*3] = r;
+		rgb[count*3+1] = g;
+		rgb[count*3+2] = b;
+		count++;
+	}
+
+	if(jasc && count != expected)
+	{
+		printf("Palette lists %u colors but has %u\n", expected, count);
+		return 0;
+	}
+
+	*colors = count;
+	return count > 0;
+}
+
+/* Microsoft RIFF palette, a "data" chunk holding a LOGPALETTE of R, G, B, flags entries */
+static int parse_riff(const unsigned char *data, size_t len, unsigned char *rgb, unsigned int *colors)
+{
+	if(len < 24 || memcmp(data + 8, "PAL data", 8))
+		return 0;
+
+	unsigned int count = data[22] | data[23] << 8;
+	if(count < 1 || count > PALETTE_MAX_COLORS || 24 + (size_t)count * 4 > len)
+		return 0;
+
+	for(unsigned int i=0; i<count; i++)
+		memcpy(rgb + i*3, data + 24 + i*4, 3);
+
+	*colors = count;
+	return 1;
+}
+
+int load_palette(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if(!f)
+	{
+		printf("Can't open palette %s\n", path);
+		return 0;
+	}
+
+	char *data = malloc(PALETTE_FILE_MAX + 1);
+	if(!data)
+	{
+		fclose(f);
+		return 0;
+	}
+
+	size_t len = fread(data, 1, PALETTE_FILE_MAX + 1, f);
+	fclose(f);
+	data[len < PALETTE_FILE_MAX ? len : PALETTE_FILE_MAX] = '\0';
+
+	unsigned char rgb[PALETTE_MAX_COLORS * 3];
+	unsigned int colors = 0;
+	int ok;
+
+	if(len > PALETTE_FILE_MAX)
+		ok = 0;
+	else if(len >= 8 && !memcmp(data, "JASC-PAL", 8))
+		ok = parse_text(data, 1, rgb, &colors);
+	else if(len >= 12 && !memcmp(data, "GIMP Palette", 12))
+		ok = parse_text(data, 0, rgb, &colors);
+	else if(len >= 4 && !memcmp(data, "RIFF", 4))
+		ok = parse_riff((unsigned char *)data, len, rgb, &colors);
+	else if(len > 0 && len % 3 == 0 && len <= sizeof(rgb))
+	{
+		memcpy(rgb, data, len);
+		colors = len / 3;
+		ok = 1;
+	}
+	else
+		ok = 0;
+
+	free(data);
+
+	if(!ok)
+	{
+		printf("Invalid palette file: %s\n", path);
+		return 0;
+	}
+
+	use_palette(rgb, colors);
+	return 1;
+}
+
+void use_palette(const unsigned char *rgb, unsigned int colors)
+{
+	memset(cmap, 0, PALETTE_MAX_COLORS * 3);
+	memcpy(cmap, rgb, colors * 3);
+	cmap_colors = colors;
+}
+
+int parse_palette_ranges(const char *arg, unsigned char flag)
+{
+	unsigned char set[PALETTE_MAX_COLORS] = {0};
+
+	if(strcmp(arg, "none"))
+	{
+		const char *p = arg;
+		for(;;)
+		{
+			char *end;
+			long first = strtol(p, &end, 10);
+			long last = first;
+			if(end != p && *end == '-')
+			{
+				p = end + 1;
+				last = strtol(p, &end, 10);
+			}
+
+			if(end == p || first < 0 || last < first || last >= PALETTE_MAX_COLORS || (*end != ',' && *end != '\0'))
+			{
+				printf("Invalid palette range: %s\n", arg);
+				return 0;
+			}
+
+			memset(set + first, 1, last - first + 1);
+
+			if(*end == '\0')
+				break;
+			p = end + 1;
+		}
+	}
+
+	for(int i=0; i<PALETTE_MAX_COLORS; i++)
+		cmap_flags[i] = set[i] ? cmap_flags[i] | flag : cmap_flags[i] & ~flag;
+
+	return 1;
+}
+
+unsigned int palette_usable(unsigned int allow_fullbrights, unsigned char *palette, unsigned char *index)
+{
+	unsigned int count = 0;
+
+	for(unsigned int i=0; i<cmap_colors; i++)
+	{
+		if((cmap_flags[i] & CMAP_RESERVED) || ((cmap_flags[i] & CMAP_FULLBRIGHT) && !allow_fullbrights))
+			continue;
+
+		memcpy(palette + count*3, cmap + i*3, 3);
+		index[count++] = i;
+	}
+
+	return count;
+}
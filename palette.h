@@ -0,0 +1,18 @@
+#pragma once
+
+#include "colormap.h"
+
+/* Replace the Quake colormap with a palette file: a Quake palette.lmp or other raw RGB
+   triplets, a GIMP .gpl, or a JASC or RIFF .pal */
+extern int load_palette(const char *path);
+
+/* Replace the colormap with 'colors' RGB triplets, at most 256 */
+extern void use_palette(const unsigned char *rgb, unsigned int colors);
+
+/* Set 'flag' on the entries in a list of indices and ranges like "0,240-255" and clear
+   it everywhere else, "none" clears it on every entry */
+extern int parse_palette_ranges(const char *arg, unsigned char flag);
+
+/* Copy the colormap entries usable for matching into 'palette' and their colormap
+   index into 'index', returns the number of entries copied */
+extern unsigned int palette_usable(unsigned int allow_fullbrights, unsigned char *palette, unsigned char *index);
@@ -3,21 +3,130 @@
 #include <string.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #include "defs.h"
 #include "colormap.h"
+#include "stream.h"
+#include "png.h"
+#include "pool.h"
+#include "buffer.h"
 
-struct image_t *load_png(const char *path)
+/* Rows go to the parallel encoder once there's at least this much raw data per thread */
+#define PNG_CHUNK_BYTES (256 * 1024)
+
+/* Deflate window, chunks are primed with this much of the data before them */
+#define PNG_WINDOW (32 * 1024)
+
+struct png_encode_options_t png_encode = { -1, ROW_FILTER_NONE, 1 };
+
+static struct pool_t *pool;
+
+/* libpng's own structs, row buffers and zlib state come from the recycled buffers too */
+static png_voidp png_buffer_alloc(png_structp png, png_alloc_size_t size)
 {
-	FILE *f = fopen(path, "rb");
-	if(!f)
-		return NULL;
+	(void)png;
+	return buffer_alloc(size);
+}
+
+static void png_buffer_free(png_structp png, png_voidp ptr)
+{
+	(void)png;
+	buffer_free(ptr);
+}
+
+static voidpf zlib_buffer_alloc(voidpf opaque, uInt items, uInt size)
+{
+	(void)opaque;
+	return buffer_alloc((size_t)items * size);
+}
+
+static void zlib_buffer_free(voidpf opaque, voidpf ptr)
+{
+	(void)opaque;
+	buffer_free(ptr);
+}
+
+int parse_png_filter(const char *arg)
+{
+	if(!strcmp(arg, "none"))
+		return ROW_FILTER_NONE;
+	else if(!strcmp(arg, "sub"))
+		return ROW_FILTER_SUB;
+	else if(!strcmp(arg, "up"))
+		return ROW_FILTER_UP;
+	else if(!strcmp(arg, "avg"))
+		return ROW_FILTER_AVG;
+	else if(!strcmp(arg, "paeth"))
+		return ROW_FILTER_PAETH;
+	else if(!strcmp(arg, "adaptive"))
+		return ROW_FILTER_ADAPTIVE;
+
+	printf("Invalid PNG filter: %s\n", arg);
+	return -1;
+}
+
+/* Have libpng expand every color type to packed 8bpc RGB. Alpha is ignored, as is tRNS
+   transparency, which palette expansion turns into alpha too. Returns 0 if the rows
+   still don't come out as width*3 bytes */
+static int set_rgb_transforms(png_structp png, png_infop info)
+{
+	png_byte color_type = png_get_color_type(png, info);
+	png_byte bit_depth  = png_get_bit_depth(png, info);
+
+	if(bit_depth == 16)	// Strip 16 bpc images down to 8bpc
+		png_set_strip_16(png);
+
+	if(color_type == PNG_COLOR_TYPE_PALETTE) // Convert indexed images to RGB
+		png_set_palette_to_rgb(png);
+
+	if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) // Expand narrow greyscale to 8bpc
+		png_set_expand_gray_1_2_4_to_8(png);
+
+	if((color_type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS))
+		png_set_strip_alpha(png);
+
+	if(color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) // Greyscale to RGB
+		png_set_gray_to_rgb(png);
+
+	png_read_update_info(png, info);
+
+	if(png_get_rowbytes(png, info) != (size_t)png_get_image_width(png, info) * 3)
+	{
+		printf("Error: PNG rows don't expand to 8 bit RGB\n");
+		return 0;
+	}
+
+	return 1;
+}
 
-	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+/* PNG file already in memory */
+struct png_source_t
+{
+	const unsigned char *data;
+	size_t size;
+	size_t offset;
+};
+
+static void png_source_read(png_structp png, png_bytep out, png_size_t len)
+{
+	struct png_source_t *source = png_get_io_ptr(png);
+	if(len > source->size - source->offset)
+		png_error(png, "PNG is truncated");
+
+	memcpy(out, source->data + source->offset, len);
+	source->offset += len;
+}
+
+/* Decode straight into one contiguous RGB buffer. libpng writes through a
+   row pointer array, which is laid out bottom-up to match image_t.
+   Reads from f, or source when f is NULL. f is left open */
+static struct image_t *decode_png(FILE *f, struct png_source_t *source)
+{
+	png_structp png = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, NULL, png_buffer_alloc, png_buffer_free);
 	if(png == NULL)
 	{
 		printf("Failed to create PNG read struct\n");
-		fclose(f);
 		return NULL;
 	}
 
@@ -25,77 +134,467 @@ struct image_t *load_png(const char *path)
 	if(info == NULL)
 	{
 		printf("Failed to create PNG info struct\n");
-		fclose(f);
+		png_destroy_read_struct(&png, NULL, NULL);
 		return NULL;
 	}
 
+	/* Set before the jump target, so they must survive a longjmp */
+	unsigned char *volatile data = NULL;
+	png_bytep *volatile row_pointers = NULL;
+
 	if(setjmp(png_jmpbuf(png))) 
 	{
 		printf("Failed to set PNG jmp\n");
-		fclose(f);
+		buffer_free(data);
+		buffer_free(row_pointers);
+		png_destroy_read_struct(&png, &info, NULL);
 		return NULL;
 	}
 
-	png_init_io(png, f);
+	if(f)
+		png_init_io(png, f);
+	else
+		png_set_read_fn(png, source, png_source_read);
 	png_read_info(png, info);
+	if(!set_rgb_transforms(png, info))
+		png_error(png, "Unsupported PNG pixel layout");
+
+	unsigned int width = png_get_image_width(png, info);
+	unsigned int height = png_get_image_height(png, info);
+	size_t stride = png_get_rowbytes(png, info);
+
+	/* Start actually reading the image */
+	data = buffer_alloc(stride * height);
+	row_pointers = buffer_alloc(sizeof(png_bytep) * height);
+	if(!data || !row_pointers)
+		png_error(png, "Failed to malloc image data");
 
-	struct img_info_t *img_info = malloc(sizeof(struct img_info_t));
-	img_info->width      = png_get_image_width(png, info);
-	img_info->height     = png_get_image_height(png, info);
+	for(unsigned int y = 0; y < height; y++)
+		row_pointers[y] = data + (height - 1 - y) * stride;
+
+	png_read_image(png, row_pointers);
+	png_read_end(png, NULL);
+
+	/* Create return structs */
+	struct image_t *img = image_alloc();
+	if(!img)
+		png_error(png, "Failed to malloc image");
+
+	struct img_info_t *img_info = img->info;
+	img_info->width      = width;
+	img_info->height     = height;
 	img_info->channels	 = 3;
 	img_info->bpp		 = 24;
+	img_info->stride	 = stride;
+	img_info->order		 = PIXEL_RGB;
+	img_info->top_down	 = 0;
+	img_info->levels	 = 1;
 
-	png_byte color_type = png_get_color_type(png, info);
-	png_byte bit_depth  = png_get_bit_depth(png, info);
+	img->data = data;
+	img->mapping = NULL;
+	img->mapping_size = 0;
 
-	if(bit_depth == 16)	// Strip 16 bpc images down to 8bpc
-		png_set_strip_16(png);
+	buffer_free(row_pointers);
+	png_destroy_read_struct(&png, &info, NULL);
 
-	if(color_type == PNG_COLOR_TYPE_PALETTE) // Convert indexed images to RGB
-		png_set_palette_to_rgb(png);
+	return img;
+}
 
-	if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) // Expand narrow greyscale to 8bpc
-		png_set_expand_gray_1_2_4_to_8(png);
+struct image_t *load_png(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if(!f)
+		return NULL;
 
-	if(png_get_valid(png, info, PNG_INFO_tRNS))
-		png_set_tRNS_to_alpha(png);
+	struct image_t *img = decode_png(f, NULL);
+	fclose(f);
 
-	/* Convert all non-RGBA images to RGBA for easier reading later on */
-	if(color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_PALETTE)
-		png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+	return img;
+}
 
-	if(color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) // Greyscale to RGB
-		png_set_gray_to_rgb(png);
+struct image_t *load_png_memory(const unsigned char *data, size_t size)
+{
+	struct png_source_t source = { data, size, 0 };
+	return decode_png(NULL, &source);
+}
 
-	png_read_update_info(png, info);
+/* Filtered rows favour Z_FILTERED, like libpng picks for them */
+static int encode_strategy(void)
+{
+	return png_encode.filter == ROW_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+}
 
-	/* Start actually reading the image */
-	png_bytep *row_pointers = malloc(sizeof(png_bytep) * img_info->height);
-	for(int y = 0; y < img_info->height; y++)
-    	row_pointers[y] = malloc(png_get_rowbytes(png, info));
+/* Same filter and compression settings on a libpng writer */
+static void set_encode_options(png_structp png)
+{
+	static const int filters[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS };
 
-    png_read_image(png, row_pointers);
+	png_set_filter(png, PNG_FILTER_TYPE_BASE, filters[png_encode.filter]);
+	png_set_compression_level(png, png_encode.level);
+	png_set_compression_strategy(png, encode_strategy());
+}
 
-    /* Create return structs and convert the img into the RGB format we need */
-    struct image_t *img = malloc(sizeof(struct image_t));
-    img->info = img_info;
-    img->data = malloc(img_info->height * img_info->width * img_info->bpp/8);
+static void set_palette(png_structp png, png_infop info)
+{
+	/* libpng keeps its own copy */
+	png_color palette[256];
 
-    for(int y=0; y<img_info->height; y++)
-    {
-    	unsigned int siy = (img_info->height-1-y) * img_info->width * img_info->bpp/8;
-    	unsigned int sx = 0;
-    	for(int dx=0; dx<img_info->width * 4; dx+=4, sx+=3)
-    		memcpy(img->data+siy+sx, row_pointers[y]+dx, 3);
-    }
+	for (unsigned int i=0; i<cmap_colors; i++)
+	{
+		png_color* col = &palette[i];
+		col->red = cmap[i*3];
+		col->green = cmap[i*3+1];
+		col->blue = cmap[i*3+2];
+	}
 
-    for(int y = 0; y < img_info->height; y++)
-    	free(row_pointers[y]);
-	free(row_pointers);
+	png_set_PLTE(png, info, palette, cmap_colors);
+}
 
-	fclose(f);
+static inline int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if(pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
 
-	return img;
+/* out[0] is the filter type, prev is NULL for the top row. Paletted rows are 1 byte per pixel */
+static void filter_row(enum png_row_filter_t filter, const unsigned char *row, const unsigned char *prev, unsigned int width, unsigned char *out)
+{
+	out[0] = filter;
+	out++;
+
+	for(unsigned int x=0; x<width; x++)
+	{
+		int a = x ? row[x-1] : 0;
+		int b = prev ? prev[x] : 0;
+		int c = prev && x ? prev[x-1] : 0;
+
+		switch(filter)
+		{
+			case ROW_FILTER_SUB: out[x] = row[x] - a; break;
+			case ROW_FILTER_UP: out[x] = row[x] - b; break;
+			case ROW_FILTER_AVG: out[x] = row[x] - ((a + b) >> 1); break;
+			case ROW_FILTER_PAETH: out[x] = row[x] - paeth(a, b, c); break;
+			default: out[x] = row[x]; break;
+		}
+	}
+}
+
+/* Sum of the filtered bytes as signed values, libpng's heuristic for picking a filter */
+static unsigned long filter_cost(const unsigned char *out, unsigned int width)
+{
+	unsigned long sum = 0;
+	for(unsigned int x=1; x<=width; x++)
+		sum += out[x] < 128 ? out[x] : 256 - out[x];
+	return sum;
+}
+
+/* Writes width + 1 bytes to out, scratch holds another width + 1 */
+static void encode_row(const unsigned char *row, const unsigned char *prev, unsigned int width, unsigned char *out, unsigned char *scratch)
+{
+	if(png_encode.filter != ROW_FILTER_ADAPTIVE)
+	{
+		filter_row(png_encode.filter, row, prev, width, out);
+		return;
+	}
+
+	filter_row(ROW_FILTER_NONE, row, prev, width, out);
+	unsigned long best = filter_cost(out, width);
+
+	for(int f=ROW_FILTER_SUB; f<=ROW_FILTER_PAETH; f++)
+	{
+		filter_row(f, row, prev, width, scratch);
+		unsigned long cost = filter_cost(scratch, width);
+		if(cost < best)
+		{
+			best = cost;
+			memcpy(out, scratch, width + 1);
+		}
+	}
+}
+
+/* One run of rows, deflated on its own and flushed to a byte boundary so
+   the chunks can be concatenated into a single zlib stream */
+struct png_chunk_t
+{
+	const struct image_t *image;
+	unsigned int first;			// rows from the top
+	unsigned int last;
+	int final;
+	unsigned char *out;			// IDAT chunk type and data
+	size_t out_size;
+	unsigned long adler;		// of the filtered rows
+	size_t raw_size;
+	unsigned long crc;			// of out, not finalized by the trailer of the last chunk yet
+	int ok;
+};
+
+static const unsigned char *top_row(const struct image_t *image, unsigned int y)
+{
+	return image->data + (size_t)(image->info->height - 1 - y) * image->info->width;
+}
+
+static void encode_chunk(void *arg)
+{
+	struct png_chunk_t *chunk = arg;
+	unsigned int width = chunk->image->info->width;
+	size_t row_size = (size_t)width + 1;
+
+	/* Filter the rows before this chunk that make up the deflate window too */
+	unsigned int window_rows = chunk->first ? (PNG_WINDOW + row_size - 1) / row_size : 0;
+	if(window_rows > chunk->first)
+		window_rows = chunk->first;
+
+	unsigned int first = chunk->first - window_rows;
+	size_t raw_size = (chunk->last - first) * row_size;
+	unsigned char *raw = buffer_alloc(raw_size + row_size);
+	if(!raw)
+		return;
+
+	for(unsigned int y=first; y<chunk->last; y++)
+		encode_row(top_row(chunk->image, y), y ? top_row(chunk->image, y-1) : NULL, width, raw + (y - first) * row_size, raw + raw_size);
+
+	unsigned char *data = raw + window_rows * row_size;
+	chunk->raw_size = (chunk->last - chunk->first) * row_size;
+	chunk->adler = adler32(adler32(0, NULL, 0), data, chunk->raw_size);
+
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	z.zalloc = zlib_buffer_alloc;
+	z.zfree = zlib_buffer_free;
+	if(deflateInit2(&z, png_encode.level, Z_DEFLATED, -MAX_WBITS, 8, encode_strategy()) != Z_OK)
+	{
+		buffer_free(raw);
+		return;
+	}
+
+	if(window_rows)
+	{
+		size_t dict = window_rows * row_size > PNG_WINDOW ? PNG_WINDOW : window_rows * row_size;
+		deflateSetDictionary(&z, data - dict, dict);
+	}
+
+	/* IDAT, then the zlib header in front of the first chunk. A sync flush takes up to 6 more bytes */
+	size_t header = chunk->first ? 4 : 6;
+	size_t bound = header + deflateBound(&z, chunk->raw_size) + 16;
+	chunk->out = buffer_alloc(bound);
+	if(chunk->out)
+	{
+		memcpy(chunk->out, "IDAT", 4);
+		if(!chunk->first)
+		{
+			/* 32K window, FLEVEL hints at the level, FCHECK makes the header a multiple of 31 */
+			int level = png_encode.level < 0 ? 6 : png_encode.level;
+			unsigned int cmf = 0x78, flg = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+			flg |= 31 - (cmf * 256 + flg) % 31;
+			chunk->out[4] = cmf;
+			chunk->out[5] = flg;
+		}
+
+		z.next_in = data;
+		z.avail_in = chunk->raw_size;
+		z.next_out = chunk->out + header;
+		z.avail_out = bound - header;
+
+		int ret = deflate(&z, chunk->final ? Z_FINISH : Z_SYNC_FLUSH);
+		if(ret == (chunk->final ? Z_STREAM_END : Z_OK) && z.avail_in == 0)
+		{
+			chunk->out_size = bound - z.avail_out;
+			chunk->crc = crc32(crc32(0, NULL, 0), chunk->out, chunk->out_size);
+			chunk->ok = 1;
+		}
+	}
+
+	deflateEnd(&z);
+	buffer_free(raw);
+}
+
+/* Where an encoded PNG goes, a file or a growing buffer when f is NULL */
+struct png_sink_t
+{
+	FILE *f;
+	unsigned char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static int sink_write(struct png_sink_t *sink, const void *data, size_t size)
+{
+	if(sink->f)
+		return fwrite(data, size, 1, sink->f) == 1;
+
+	if(sink->size + size > sink->capacity)
+	{
+		size_t capacity = sink->capacity ? sink->capacity : 64 * 1024;
+		while(capacity < sink->size + size)
+			capacity *= 2;
+
+		unsigned char *grown = realloc(sink->data, capacity);
+		if(!grown)
+			return 0;
+		sink->data = grown;
+		sink->capacity = capacity;
+	}
+
+	memcpy(sink->data + sink->size, data, size);
+	sink->size += size;
+	return 1;
+}
+
+static void png_sink_write(png_structp png, png_bytep data, png_size_t len)
+{
+	if(!sink_write(png_get_io_ptr(png), data, len))
+		png_error(png, "Write failed");
+}
+
+static void png_sink_flush(png_structp png)
+{
+	(void)png;
+}
+
+static int write_be32(struct png_sink_t *sink, unsigned long v)
+{
+	unsigned char b[4] = { v >> 24, v >> 16, v >> 8, v };
+	return sink_write(sink, b, 4);
+}
+
+/* type is the 4 byte chunk type followed by size bytes of data */
+static int write_chunk(struct png_sink_t *sink, const unsigned char *type, size_t size)
+{
+	return write_be32(sink, size) && sink_write(sink, type, size + 4) && write_be32(sink, crc32(crc32(0, NULL, 0), type, size + 4));
+}
+
+/* Each chunk of rows becomes its own IDAT. Together they hold one zlib stream, whose adler32
+   is combined from the chunks' and appended to the last */
+static int write_png_parallel(struct image_t *image, struct png_sink_t *sink, unsigned int chunk_count)
+{
+	unsigned int width = image->info->width, height = image->info->height;
+	unsigned int rows = (height + chunk_count - 1) / chunk_count;
+	chunk_count = (height + rows - 1) / rows;
+
+	struct png_chunk_t *chunks = buffer_calloc(chunk_count * sizeof(struct png_chunk_t));
+	if(!chunks)
+		return 0;
+
+	if(pool == NULL || pool->thread_count != png_encode.threads)
+	{
+		pool_destroy(pool);
+		pool = pool_create(png_encode.threads);
+		if(pool == NULL)
+		{
+			buffer_free(chunks);
+			return 0;
+		}
+	}
+
+	for(unsigned int i=0; i<chunk_count; i++)
+	{
+		chunks[i].image = image;
+		chunks[i].first = i * rows;
+		chunks[i].last = i == chunk_count - 1 ? height : (i + 1) * rows;
+		chunks[i].final = i == chunk_count - 1;
+
+		/* Chunks that aren't queued stay !ok, the ones that are still have to finish */
+		if(!pool_submit(pool, encode_chunk, &chunks[i]))
+			break;
+	}
+	pool_wait(pool);
+
+	int ok = 1;
+	unsigned long adler = adler32(0, NULL, 0);
+	for(unsigned int i=0; i<chunk_count; i++)
+	{
+		ok &= chunks[i].ok;
+		adler = adler32_combine(adler, chunks[i].adler, chunks[i].raw_size);
+	}
+
+	/* Signature, IHDR and PLTE */
+	unsigned char header[4 + 256*3] = "IHDR";
+	unsigned char *p = header + 4;
+	*p++ = width >> 24; *p++ = width >> 16; *p++ = width >> 8; *p++ = width;
+	*p++ = height >> 24; *p++ = height >> 16; *p++ = height >> 8; *p++ = height;
+	*p++ = 8; *p++ = PNG_COLOR_TYPE_PALETTE; *p++ = 0; *p++ = 0; *p++ = 0;
+
+	ok = ok && sink_write(sink, "\x89PNG\r\n\x1a\n", 8) && write_chunk(sink, header, 13);
+
+	memcpy(header, "PLTE", 4);
+	memcpy(header + 4, cmap, cmap_colors * 3);
+	ok = ok && write_chunk(sink, header, cmap_colors * 3);
+
+	for(unsigned int i=0; ok && i<chunk_count; i++)
+	{
+		struct png_chunk_t *chunk = &chunks[i];
+		if(!chunk->final)
+		{
+			ok = write_be32(sink, chunk->out_size - 4) && sink_write(sink, chunk->out, chunk->out_size) && write_be32(sink, chunk->crc);
+			continue;
+		}
+
+		unsigned char trailer[4] = { adler >> 24, adler >> 16, adler >> 8, adler };
+		ok = write_be32(sink, chunk->out_size) && sink_write(sink, chunk->out, chunk->out_size) &&
+			sink_write(sink, trailer, 4) && write_be32(sink, crc32(chunk->crc, trailer, 4));
+	}
+
+	ok = ok && write_chunk(sink, (const unsigned char *)"IEND", 0);
+
+	for(unsigned int i=0; i<chunk_count; i++)
+		buffer_free(chunks[i].out);
+	buffer_free(chunks);
+
+	return ok;
+}
+
+static int encode_png(struct image_t *image, struct png_sink_t *sink)
+{
+	/* Large images are split across the threads */
+	size_t raw_size = (size_t)image->info->height * (image->info->width + 1);
+	unsigned int chunks = raw_size / PNG_CHUNK_BYTES;
+	if(chunks > png_encode.threads * 4)
+		chunks = png_encode.threads * 4;
+
+	if(png_encode.threads > 1 && chunks > 1)
+		return write_png_parallel(image, sink, chunks);
+
+	/* Initialize and configure libPNG */
+
+	png_structp png = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, NULL, png_buffer_alloc, png_buffer_free);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	if(info == NULL)
+	{
+		printf("Failed to create PNG write struct\n");
+		png_destroy_write_struct(&png, NULL);
+		return 0;
+	}
+
+	if(setjmp(png_jmpbuf(png))) 
+	{
+		printf("Failed to set PNG jmp\n");
+		png_destroy_write_struct(&png, &info);
+		return 0;
+	}
+
+	png_set_write_fn(png, sink, png_sink_write, png_sink_flush);
+	set_encode_options(png);
+
+	png_set_IHDR(png, info, image->info->width, image->info->height, 8, 
+		PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+	set_palette(png, info);
+
+	/* Write PNG Header Data */
+	png_write_info(png, info);
+
+	/* Rows are written straight from the bottom-up image */
+	for(unsigned int y=0; y<image->info->height; y++)
+		png_write_row(png, top_row(image, y));
+
+	png_write_end(png, NULL);
+
+	/* Cleanup */
+	png_destroy_write_struct(&png, &info);
+	return 1;
 }
 
 int write_png(struct image_t *image, const char *path)
@@ -104,71 +603,223 @@ int write_png(struct image_t *image, const char *path)
 	if(!f)
 		return 0;
 
-	/* Initialize and configure libPNG */
+	struct png_sink_t sink = { f, NULL, 0, 0 };
+	int ok = encode_png(image, &sink);
+	if(fclose(f) != 0)
+		ok = 0;
 
-	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if(png == NULL)
+	return ok;
+}
+
+unsigned char *write_png_memory(struct image_t *image, size_t *size)
+{
+	struct png_sink_t sink = { NULL, NULL, 0, 0 };
+	if(!encode_png(image, &sink))
 	{
-		printf("Failed to create PNG write struct\n");
-		fclose(f);
+		free(sink.data);
+		return NULL;
+	}
+
+	*size = sink.size;
+	return sink.data;
+}
+
+/* Row reader and writer, PNG rows are already top to bottom */
+struct png_row_state_t
+{
+	FILE *f;
+	png_structp png;
+	png_infop info;
+	unsigned int height;
+	unsigned int y;
+};
+
+static int png_read_next_row(void *state, unsigned char *rgb)
+{
+	struct png_row_state_t *s = state;
+	if(s->y >= s->height)
+		return 0;
+
+	if(setjmp(png_jmpbuf(s->png)))
+	{
+		printf("Error: Failed to read PNG row\n");
 		return 0;
 	}
 
-	png_infop info = png_create_info_struct(png);
+	png_read_row(s->png, rgb, NULL);
+	s->y++;
+	return 1;
+}
+
+static void png_close_reader(void *state)
+{
+	struct png_row_state_t *s = state;
+	png_destroy_read_struct(&s->png, &s->info, NULL);
+	fclose(s->f);
+	free(s);
+}
+
+int png_open_reader(const char *path, struct row_reader_t *reader)
+{
+	FILE *f = fopen(path, "rb");
+	if(!f)
+		return 0;
+
+	png_structp png = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, NULL, png_buffer_alloc, png_buffer_free);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
 	if(info == NULL)
 	{
-		printf("Failed to create PNG info struct\n");
+		printf("Failed to create PNG read struct\n");
+		png_destroy_read_struct(&png, NULL, NULL);
 		fclose(f);
 		return 0;
 	}
 
-	if(setjmp(png_jmpbuf(png))) 
+	if(setjmp(png_jmpbuf(png)))
 	{
 		printf("Failed to set PNG jmp\n");
+		png_destroy_read_struct(&png, &info, NULL);
 		fclose(f);
 		return 0;
 	}
 
 	png_init_io(png, f);
+	png_read_info(png, info);
 
-	png_set_IHDR(png, info, image->info->width, image->info->height, 8, 
-		PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	/* Interlaced rows only become complete after the last pass, the size is still known */
+	if(png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+	{
+		reader->width = png_get_image_width(png, info);
+		reader->height = png_get_image_height(png, info);
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(f);
+		return -1;
+	}
 
-	/* Convert colormap to PNG palette */
-	png_color* palette = png_malloc(png, cmap_colors*sizeof(png_color));
+	if(!set_rgb_transforms(png, info))
+	{
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(f);
+		return 0;
+	}
 
-	for (unsigned int i=0; i<cmap_colors; i++)
+	struct png_row_state_t *s = malloc(sizeof(struct png_row_state_t));
+	if(!s)
 	{
-		png_color* col = &palette[i];
-		col->red = cmap[i*3];
-		col->green = cmap[i*3+1];
-		col->blue = cmap[i*3+2];
+		printf("Failed to malloc PNG reader\n");
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(f);
+		return 0;
 	}
 
-	png_set_PLTE(png, info, palette, cmap_colors);
+	s->f = f;
+	s->png = png;
+	s->info = info;
+	s->height = png_get_image_height(png, info);
+	s->y = 0;
 
-	/* Write PNG Header Data */
-	png_write_info(png, info);
+	reader->width = png_get_image_width(png, info);
+	reader->height = s->height;
+	reader->order = PIXEL_RGB;
+	reader->state = s;
+	reader->read_row = png_read_next_row;
+	reader->close = png_close_reader;
 
-	/* Start writing image data */
-	png_bytep row = malloc(image->info->width * sizeof(png_byte));
+	return 1;
+}
 
-	for(unsigned int y=0; y<image->info->height; y++)
-	{
-		unsigned int yindex = (image->info->height-1-y) * image->info->width;
-		for(int x=0; x<image->info->width; x++)
-			row[x] = image->data[yindex + x];
+static int png_write_next_row(void *state, const unsigned char *indices)
+{
+	struct png_row_state_t *s = state;
+	if(s->y >= s->height)
+		return 0;
 
-		png_write_row(png, row);
+	if(setjmp(png_jmpbuf(s->png)))
+	{
+		printf("Error: Failed to write PNG row\n");
+		return 0;
 	}
 
+	png_write_row(s->png, indices);
+	s->y++;
+	return 1;
+}
+
+static int png_finish_write(png_structp png)
+{
+	if(setjmp(png_jmpbuf(png)))
+		return 0;
+
 	png_write_end(png, NULL);
+	return 1;
+}
 
+static int png_close_writer(void *state)
+{
+	struct png_row_state_t *s = state;
+	int ok = s->y == s->height && png_finish_write(s->png);
+
+	png_destroy_write_struct(&s->png, &s->info);
+	if(fclose(s->f) != 0)
+		ok = 0;
+
+	free(s);
+	return ok;
+}
+
+int png_open_writer(const char *path, unsigned int width, unsigned int height, struct row_writer_t *writer)
+{
+	FILE *f = fopen(path, "wb");
+	if(!f)
+		return 0;
+
+	png_structp png = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, NULL, png_buffer_alloc, png_buffer_free);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	if(info == NULL)
+	{
+		printf("Failed to create PNG write struct\n");
+		png_destroy_write_struct(&png, NULL);
+		fclose(f);
+		return 0;
+	}
+
+	if(setjmp(png_jmpbuf(png)))
+	{
+		printf("Failed to set PNG jmp\n");
+		png_destroy_write_struct(&png, &info);
+		fclose(f);
+		return 0;
+	}
+
+	png_init_io(png, f);
+	set_encode_options(png);
+
+	png_set_IHDR(png, info, width, height, 8,
+		PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+	set_palette(png, info);
+
+	/* Write PNG Header Data */
+	png_write_info(png, info);
+
+	struct png_row_state_t *s = malloc(sizeof(struct png_row_state_t));
+	if(!s)
+	{
+		printf("Failed to malloc PNG writer\n");
+		png_destroy_write_struct(&png, &info);
+		fclose(f);
+		return 0;
+	}
+
+	s->f = f;
+	s->png = png;
+	s->info = info;
+	s->height = height;
+	s->y = 0;
+
+	writer->state = s;
+	writer->write_row = png_write_next_row;
+	writer->close = png_close_writer;
 
-	/* Cleanup */
-	free(row);
-	png_destroy_write_struct(&png, &info);
-	png_free(png, palette);
-	fclose(f);
 	return 1;
 }
\ No newline at end of file
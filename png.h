@@ -1,7 +1,42 @@
 #pragma once
 
 #include "defs.h"
+#include "stream.h"
+
+/* Row filter written before each PNG row */
+enum png_row_filter_t
+{
+	ROW_FILTER_NONE,
+	ROW_FILTER_SUB,
+	ROW_FILTER_UP,
+	ROW_FILTER_AVG,
+	ROW_FILTER_PAETH,
+	ROW_FILTER_ADAPTIVE,	// whichever of the above has the smallest sum for each row
+};
+
+struct png_encode_options_t
+{
+	int level;						// zlib level 0-9, -1 = zlib's default
+	enum png_row_filter_t filter;
+	unsigned int threads;			// large images are deflated in chunks across this many threads
+};
+
+/* Used by every PNG writer, set before any are running */
+extern struct png_encode_options_t png_encode;
+
+extern int parse_png_filter(const char *arg);
 
 extern struct image_t *load_png(const char *path);
 
-extern int write_png(struct image_t *image, const char *path);
\ No newline at end of file
+/* load_png from a whole file in memory */
+extern struct image_t *load_png_memory(const unsigned char *data, size_t size);
+
+extern int write_png(struct image_t *image, const char *path);
+
+/* write_png into a malloc'd buffer, *size is set to its length */
+extern unsigned char *write_png_memory(struct image_t *image, size_t *size);
+
+/* Returns -1 for interlaced images, which can't be read row by row. Their width and height are still set */
+extern int png_open_reader(const char *path, struct row_reader_t *reader);
+
+extern int png_open_writer(const char *path, unsigned int width, unsigned int height, struct row_writer_t *writer);
\ No newline at end of file
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+static void *worker(void *arg)
+{
+	struct pool_t *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	for(;;)
+	{
+		while(pool->queued == 0 && !pool->shutdown)
+			pthread_cond_wait(&pool->job_ready, &pool->lock);
+
+		if(pool->queued == 0 && pool->shutdown)
+			break;
+
+		struct pool_job_t job = pool->jobs[pool->head];
+		pool->head = (pool->head + 1) % pool->capacity;
+		pool->queued--;
+
+		pthread_mutex_unlock(&pool->lock);
+		job.task(job.arg);
+		pthread_mutex_lock(&pool->lock);
+
+		if(--pool->pending == 0)
+			pthread_cond_broadcast(&pool->job_done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct pool_t *pool_create(unsigned int threads)
+{
+	struct pool_t *pool = malloc(sizeof(struct pool_t));
+	if(!pool)
+		return NULL;
+
+	pool->threads = malloc(threads * sizeof(pthread_t));
+	pool->capacity = threads > 64 ? threads : 64;
+	pool->jobs = malloc(pool->capacity * sizeof(struct pool_job_t));
+	if(!pool->threads || !pool->jobs)
+	{
+		printf("Failed to malloc worker pool\n");
+		free(pool->threads);
+		free(pool->jobs);
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_ready, NULL);
+	pthread_cond_init(&pool->job_done, NULL);
+	pool->head = 0;
+	pool->queued = 0;
+	pool->pending = 0;
+	pool->shutdown = 0;
+
+	for(pool->thread_count=0; pool->thread_count<threads; pool->thread_count++)
+	{
+		if(pthread_create(&pool->threads[pool->thread_count], NULL, worker, pool) != 0)
+		{
+			printf("Failed to create worker thread\n");
+			pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+int pool_submit(struct pool_t *pool, pool_task_t task, void *arg)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	if(pool->queued == pool->capacity)
+	{
+		/* Grow the ring, unwrapping it so head starts at 0 */
+		struct pool_job_t *jobs = malloc(pool->capacity * 2 * sizeof(struct pool_job_t));
+		if(!jobs)
+		{
+			printf("Failed to grow the worker pool queue\n");
+			pthread_mutex_unlock(&pool->lock);
+			return 0;
+		}
+
+		for(unsigned int i=0; i<pool->queued; i++)
+			jobs[i] = pool->jobs[(pool->head + i) % pool->capacity];
+
+		free(pool->jobs);
+		pool->jobs = jobs;
+		pool->head = 0;
+		pool->capacity *= 2;
+	}
+
+	struct pool_job_t *job = &pool->jobs[(pool->head + pool->queued) % pool->capacity];
+	job->task = task;
+	job->arg = arg;
+	pool->queued++;
+	pool->pending++;
+
+	pthread_cond_signal(&pool->job_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 1;
+}
+
+void pool_wait(struct pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while(pool->pending > 0)
+		pthread_cond_wait(&pool->job_done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(struct pool_t *pool)
+{
+	if(!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->job_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(unsigned int i=0; i<pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->job_ready);
+	pthread_cond_destroy(&pool->job_done);
+	free(pool->threads);
+	free(pool->jobs);
+	free(pool);
+}
+
+struct queue_t *queue_create(unsigned int capacity)
+{
+	struct queue_t *queue = malloc(sizeof(struct queue_t));
+	if(!queue)
+		return NULL;
+
+	queue->items = malloc(capacity * sizeof(void *));
+	if(!queue->items)
+	{
+		printf("Failed to malloc queue\n");
+		free(queue);
+		return NULL;
+	}
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->closed = 0;
+
+	return queue;
+}
+
+void queue_push(struct queue_t *queue, void *item)
+{
+	pthread_mutex_lock(&queue->lock);
+	while(queue->count == queue->capacity)
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+
+	queue->items[(queue->head + queue->count) % queue->capacity] = item;
+	queue->count++;
+
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void *queue_pop(struct queue_t *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	while(queue->count == 0 && !queue->closed)
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+	void *item = NULL;
+	if(queue->count > 0)
+	{
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+	return item;
+}
+
+void queue_close(struct queue_t *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void queue_destroy(struct queue_t *queue)
+{
+	if(!queue)
+		return;
+
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+	free(queue->items);
+	free(queue);
+}
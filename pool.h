@@ -0,0 +1,67 @@
+#pragma once
+
+#include <pthread.h>
+
+typedef void (*pool_task_t)(void *arg);
+
+struct pool_job_t
+{
+	pool_task_t task;
+	void *arg;
+};
+
+/* Fixed size worker pool with an unbounded job queue */
+struct pool_t
+{
+	pthread_t *threads;
+	unsigned int thread_count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready;	// signalled when a job is queued or the pool shuts down
+	pthread_cond_t job_done;	// signalled when the last pending job finishes
+
+	struct pool_job_t *jobs;	// ring buffer
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int queued;
+	unsigned int pending;		// queued plus running
+	int shutdown;
+};
+
+/* The queue starts with room for at least a job per thread */
+extern struct pool_t *pool_create(unsigned int threads);
+
+/* Returns 0 if the queue had to grow and couldn't, the job isn't queued then */
+extern int pool_submit(struct pool_t *pool, pool_task_t task, void *arg);
+
+/* Block until every submitted job has finished */
+extern void pool_wait(struct pool_t *pool);
+
+extern void pool_destroy(struct pool_t *pool);
+
+/* Bounded blocking queue, used to pass work between pipeline stages */
+struct queue_t
+{
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+
+	void **items;		// ring buffer
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int count;
+	int closed;
+};
+
+extern struct queue_t *queue_create(unsigned int capacity);
+
+/* Blocks while the queue is full */
+extern void queue_push(struct queue_t *queue, void *item);
+
+/* Blocks while the queue is empty, returns NULL once it is closed and drained */
+extern void *queue_pop(struct queue_t *queue);
+
+/* No more items will be pushed, wakes every waiting consumer */
+extern void queue_close(struct queue_t *queue);
+
+extern void queue_destroy(struct queue_t *queue);
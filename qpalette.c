@@ -3,32 +3,119 @@
 #include <limits.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
 
 #include "bmp.h"
 #include "png.h"
-#include "colormap.h"
+#include "palette.h"
+#include "convert.h"
+#include "batch.h"
+#include "stream.h"
+#include "image.h"
+#include "trace.h"
+#include "server.h"
+#include "incremental.h"
+#include "quality.h"
+#include "buffer.h"
 
 struct cli_options_t
 {
 	unsigned int allow_fullbrights; // set by -b
+	unsigned int match_method;		// set by -m
+	unsigned int metric;			// set by -c
+	unsigned int dither;			// set by -d
+	unsigned int threads;			// set by -j
+	unsigned int stream;			// set by -s
+	unsigned int verbose;			// set by -v
+	char *palette;					// set by -p
+	unsigned int stats;				// set by --stats
+	char *trace;					// set by --trace
+	char *serve;					// set by --serve
+	char *client;					// set by --client
+	char *incremental;				// set by --incremental
+	size_t memory;					// set by --memory, in bytes
+	char *wad;						// set by --wad
+	unsigned int quality;			// set by --quality, or to QUALITY_HEATMAP by --heatmap
 	unsigned char *output_dest; 	// set by -o
 	unsigned int output_type;		// set by -t
 	unsigned int input_type;		// discovered from file ext
 	unsigned char *file_src;		// <path to src image>
+	unsigned int output_type_set;	// -t was given
+	unsigned int batch;				// several sources, a directory or - (paths on stdin)
+	char **batch_src;
+	unsigned int batch_count;
 };
 
 struct cli_options_t arguments;
+struct incremental_t *incremental;
 
 void print_usage(char *argv0)
 {
 	printf("\n-- Usage --\n");
 	printf("%s [options] <path to image>\n", argv0);
+	printf("%s [options] <images, directories or - to read paths from stdin>...\n", argv0);
 	printf("\n-- Options --\n");
 	printf("-b  -  Allow use of fullbright colors from Quake 1 colormap\n");
-	printf("-o   -  Output file name, e.g -o out.png - default is input_conv.ext\n");
-	printf("-t   -  Output file type, Valid values are bmp, png - default is input filetype\n");
+	printf("-c   -  Color distance metric, Valid values are rgb, weighted, lab76, lab2000 - default is rgb\n");
+	printf("-d   -  Dithering, Valid values are none, ordered, fs (Floyd-Steinberg) - default is none\n");
+	printf("-f   -  Fullbright palette entries, e.g. -f 224-255 or none - default is 224-255\n");
+	printf("-j   -  Number of worker threads used for conversion - default is 1\n");
+	printf("-m   -  Color matching method, Valid values are auto, lut, simd, kdtree, scalar - default is auto\n");
+	printf("-o   -  Output file name, e.g -o out.png - default is input_conv.ext, single image only\n");
+	printf("-p   -  Palette file to convert to, .lmp, .gpl or .pal - default is the Quake 1 colormap\n");
+	printf("-r   -  Reserved palette entries that are never used, e.g. -r 0,255 - default is none\n");
+	printf("-s   -  Stream rows from source to output, memory use stays proportional to image width\n");
+	printf("-t   -  Output file type, Valid values are bmp, png, mip (Quake miptex), lmp (Quake qpic) - default is input filetype\n");
+	printf("-v   -  Verbose, print the color matcher and color cache hit rate\n");
+	printf("--stats         -  Print wall time, CPU time, bytes read and written and peak RSS per stage\n");
+	printf("--trace <file>  -  Write a Chrome trace of every stage, thread and file, e.g. --trace trace.json\n");
+	printf("--serve <sock>  -  Run a conversion server on a Unix domain socket, keeping the palette tables warm\n");
+	printf("--client <sock> -  Send the conversions to the server on a Unix domain socket\n");
+	printf("--incremental <dir> -  Keep outputs in a cache directory and skip sources that haven't changed\n");
+	printf("--png-level <n>     -  PNG deflate level 0-9 - default is zlib's, 6\n");
+	printf("--png-filter <f>    -  PNG row filter: none, sub, up, avg, paeth, adaptive - default is none\n");
+	printf("--png-fast          -  Fastest PNG writing, same as --png-level 1 --png-filter none\n");
+	printf("--memory <MB>       -  Memory budget for pixels, larger images are streamed in bands of rows that fit\n");
+	printf("--wad <file>        -  Convert the sources to miptex and pack them into a Quake WAD2, e.g. --wad textures.wad\n");
+	printf("--quality           -  Print each image's quantization error: Delta E mean, maximum and histogram, PSNR, fullbrights\n");
+	printf("--heatmap           -  --quality, and write the error as an image next to each output, e.g. texture_conv_error.png\n");
 }
 
+/* Long options only, their values are past the short option characters */
+enum long_option_t
+{
+	OPTION_STATS = 256,
+	OPTION_TRACE,
+	OPTION_SERVE,
+	OPTION_CLIENT,
+	OPTION_INCREMENTAL,
+	OPTION_PNG_LEVEL,
+	OPTION_PNG_FILTER,
+	OPTION_PNG_FAST,
+	OPTION_MEMORY,
+	OPTION_WAD,
+	OPTION_QUALITY,
+	OPTION_HEATMAP,
+};
+
+static const struct option long_options[] =
+{
+	{ "stats", no_argument, NULL, OPTION_STATS },
+	{ "trace", required_argument, NULL, OPTION_TRACE },
+	{ "serve", required_argument, NULL, OPTION_SERVE },
+	{ "client", required_argument, NULL, OPTION_CLIENT },
+	{ "incremental", required_argument, NULL, OPTION_INCREMENTAL },
+	{ "png-level", required_argument, NULL, OPTION_PNG_LEVEL },
+	{ "png-filter", required_argument, NULL, OPTION_PNG_FILTER },
+	{ "png-fast", no_argument, NULL, OPTION_PNG_FAST },
+	{ "memory", required_argument, NULL, OPTION_MEMORY },
+	{ "wad", required_argument, NULL, OPTION_WAD },
+	{ "quality", no_argument, NULL, OPTION_QUALITY },
+	{ "heatmap", no_argument, NULL, OPTION_HEATMAP },
+	{ NULL, 0, NULL, 0 },
+};
+
 int parse_typearg(char *arg)
 {
 	if(!arg)
@@ -40,9 +127,13 @@ int parse_typearg(char *arg)
 	}
 
 	if(!strcmp(arg, "bmp"))
-		return 0;
+		return IMAGE_BMP;
 	else if(!strcmp(arg, "png"))
-		return 1;
+		return IMAGE_PNG;
+	else if(!strcmp(arg, "mip"))
+		return IMAGE_MIP;
+	else if(!strcmp(arg, "lmp"))
+		return IMAGE_LMP;
 	else
 	{
 		printf("Invalid file format: %s\n", arg);
@@ -58,22 +149,44 @@ int parse_options(int argc, char **argv)
 		return 0;
 	}
 
-	int tflag, oflag = 0;
+	int tflag = 0, oflag = 0;
+	int server_side = 0;	// options the server's own command line sets, not sent by clients
 
 	extern char *optarg;
 	extern int optind;
 	int c, err = 0;
 
-	while ((c = getopt (argc, argv, "bho:t:")) != -1)
+	while ((c = getopt_long (argc, argv, "bc:d:f:hj:m:o:p:r:st:v", long_options, NULL)) != -1)
 	{
 		switch (c)
 		{
 			case 'b': arguments.allow_fullbrights = 1; break;
+			case 'c': if(parse_metric(optarg) < 0) return 0; arguments.metric = parse_metric(optarg); break;
+			case 'd': if(parse_dither_method(optarg) < 0) return 0; arguments.dither = parse_dither_method(optarg); break;
+			case 'f': if(!parse_palette_ranges(optarg, CMAP_FULLBRIGHT)) return 0; server_side = 1; break;
 			case 'h': print_usage(argv[0]); return 0;
+			case 'p': arguments.palette = optarg; server_side = 1; break;
+			case 'r': if(!parse_palette_ranges(optarg, CMAP_RESERVED)) return 0; server_side = 1; break;
+			case 's': arguments.stream = 1; break;
+			case 'v': arguments.verbose = 1; break;
 			case 't': tflag = 1; if(parse_typearg(optarg) < 0) return 0; arguments.output_type = parse_typearg(optarg); break;
+			case 'j': if(atoi(optarg) < 1) { printf("Invalid thread count: %s\n", optarg); return 0; } arguments.threads = atoi(optarg); break;
+			case 'm': if(parse_match_method(optarg) < 0) return 0; arguments.match_method = parse_match_method(optarg); break;
 			case 'o': arguments.output_dest = optarg; oflag = 1; break;
+			case OPTION_STATS: arguments.stats = 1; break;
+			case OPTION_TRACE: arguments.trace = optarg; break;
+			case OPTION_SERVE: arguments.serve = optarg; break;
+			case OPTION_CLIENT: arguments.client = optarg; break;
+			case OPTION_INCREMENTAL: arguments.incremental = optarg; break;
+			case OPTION_PNG_LEVEL: if(optarg[0] < '0' || optarg[0] > '9' || optarg[1]) { printf("Invalid PNG level: %s\n", optarg); return 0; } png_encode.level = atoi(optarg); server_side = 1; break;
+			case OPTION_PNG_FILTER: if(parse_png_filter(optarg) < 0) return 0; png_encode.filter = parse_png_filter(optarg); server_side = 1; break;
+			case OPTION_PNG_FAST: png_encode.level = 1; png_encode.filter = ROW_FILTER_NONE; server_side = 1; break;
+			case OPTION_WAD: arguments.wad = optarg; break;
+			case OPTION_QUALITY: if(!arguments.quality) arguments.quality = QUALITY_PRINT; break;
+			case OPTION_HEATMAP: arguments.quality = QUALITY_HEATMAP; break;
+			case OPTION_MEMORY: if(atoi(optarg) < 1) { printf("Invalid memory budget: %s\n", optarg); return 0; } arguments.memory = (size_t)atoi(optarg) << 20; server_side = 1; break;
 			case '?':
-				if (optopt == 'o' || optopt == 't')
+				if (optopt == 'c' || optopt == 'd' || optopt == 'f' || optopt == 'j' || optopt == 'm' || optopt == 'o' || optopt == 'p' || optopt == 'r' || optopt == 't')
 				  fprintf (stderr, "Option -%c requires an argument.\n", optopt);
 				else
 				  fprintf (stderr, "Unknown option character `\\x%x'.\n", optopt);
@@ -82,6 +195,30 @@ int parse_options(int argc, char **argv)
 		}
 	}
 
+	if(arguments.client && server_side)
+	{
+		fprintf(stderr, "%s: -p, -r, -f, --png-level, --png-filter, --png-fast and --memory are set when starting the server, they can't be used with --client\n", argv[0]);
+		return 0;
+	}
+
+	/* Errors are measured where the conversion runs */
+	if(arguments.quality && (arguments.serve || arguments.client))
+	{
+		fprintf(stderr, "%s: --quality and --heatmap can't be used with --serve or --client\n", argv[0]);
+		return 0;
+	}
+
+	/* The server gets its sources from clients */
+	if(arguments.serve)
+	{
+		if(optind < argc || arguments.client)
+		{
+			fprintf(stderr, "%s: --serve takes no source files\n", argv[0]);
+			return 0;
+		}
+		return 1;
+	}
+
 	// get file_src
 	if ((optind + 1) > argc) 
 	{	
@@ -90,6 +227,36 @@ int parse_options(int argc, char **argv)
 		return 0;
 	}
 
+	arguments.output_type_set = tflag;
+
+	/* A WAD packs any number of sources, each a miptex lump */
+	if(arguments.wad)
+	{
+		if(oflag || arguments.stream || arguments.incremental || arguments.client || (tflag && arguments.output_type != IMAGE_MIP))
+		{
+			fprintf(stderr, "%s: --wad writes miptex lumps into one file, it can't be used with -o, -s, -t, --incremental or --client\n", argv[0]);
+			return 0;
+		}
+		arguments.output_type = IMAGE_MIP;
+		arguments.output_type_set = 1;
+	}
+
+	/* Several sources, a directory or - convert everything in batch mode */
+	struct stat st;
+	if(arguments.wad || argc - optind > 1 || !strcmp(argv[optind], "-") || (stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode)))
+	{
+		if(oflag)
+		{
+			fprintf(stderr, "%s: -o can't be used with multiple source files\n", argv[0]);
+			return 0;
+		}
+
+		arguments.batch = 1;
+		arguments.batch_src = argv + optind;
+		arguments.batch_count = argc - optind;
+		return 1;
+	}
+
 	arguments.file_src = argv[optind];
 
 	/* If Type/Dest not specified, set them here */
@@ -98,12 +265,18 @@ int parse_options(int argc, char **argv)
 	if(!arguments.file_src || strlen(arguments.file_src) < 4)
 			return 0;
 
-	char ext[3];
+	char ext[4];
 	memcpy(ext, arguments.file_src+strlen(arguments.file_src)-3, 3);
+	ext[3] = '\0';
 
+	if(parse_typearg(ext) < 0)
+		return 0;
 	arguments.input_type = parse_typearg(ext);
-	if(arguments.input_type < 0)
+	if(!image_type_loadable(arguments.input_type))
+	{
+		fprintf(stderr, "%s: %s can't be used as a source image\n", argv[0], arguments.file_src);
 		return 0;
+	}
 
 	if(!tflag) // If -t wasn't specified, set output type to src filetype
 		arguments.output_type = arguments.input_type;
@@ -113,36 +286,203 @@ int parse_options(int argc, char **argv)
 		if(!arguments.file_src || strlen(arguments.file_src) < 4)
 			return 0;
 
-		unsigned int len = strlen(arguments.file_src) + 5;
-		char *dest = malloc(len);
-		memcpy(dest, arguments.file_src, strlen(arguments.file_src)-4);
-		strcat(dest, "_conv");
-		if(arguments.output_type == 0)
-			strcat(dest, ".bmp");
-		else if(arguments.output_type == 1)
-			strcat(dest, ".png");
-
-		arguments.output_dest = dest;
+		arguments.output_dest = (unsigned char *)image_default_dest(arguments.file_src, arguments.output_type);
 	}
 
 	return 1;
 }
 
-struct image_t *to_palette_rgb(struct image_t *src, int allow_fullbrights);
+void set_convert_options(struct convert_options_t *convert_options)
+{
+	convert_options->allow_fullbrights = arguments.allow_fullbrights;
+	convert_options->match_method = arguments.match_method;
+	convert_options->metric = arguments.metric;
+	convert_options->dither = arguments.dither;
+	convert_options->threads = arguments.threads;
+	convert_options->verbose = arguments.verbose;
+	convert_options->mip_levels = 1;
+	convert_options->memory = arguments.memory;
+	convert_options->quality = arguments.quality;
+}
 
-int main(int argc, char **argv)
+/* Every source file given on the command line, below directories or on stdin */
+struct batch_t *collect_sources(void)
 {
-	/* Argument handling */
-	if(!parse_options(argc, argv))
+	struct batch_t *batch = batch_create();
+	if(!batch)
+		return NULL;
+
+	for(unsigned int i=0; i<arguments.batch_count; i++)
+	{
+		int ok;
+		if(!strcmp(arguments.batch_src[i], "-"))
+			ok = batch_add_list(batch, stdin);
+		else
+			ok = batch_add_path(batch, arguments.batch_src[i]);
+
+		if(!ok)
+		{
+			batch_free(batch);
+			return NULL;
+		}
+	}
+
+	return batch;
+}
+
+int run_batch(void)
+{
+	struct batch_t *batch = collect_sources();
+	if(!batch)
 		return 1;
 
+	/* Files run concurrently on the pipeline, so each conversion stays on its worker */
+	struct batch_options_t options;
+	set_convert_options(&options.convert);
+	options.convert.threads = 1;
+	options.output_type = arguments.output_type_set ? (int)arguments.output_type : -1;
+	options.threads = arguments.threads;
+	options.stream = arguments.stream;
+	options.incremental = incremental;
+	options.wad = NULL;
+
+	if(arguments.wad && !(options.wad = wad_create(arguments.wad)))
+	{
+		batch_free(batch);
+		return 1;
+	}
+
+	unsigned int failed = batch_run(batch, &options);
+	batch_free(batch);
+
+	if(options.wad && !wad_close(options.wad))
+		failed++;
+
+	return failed ? 1 : 0;
+}
+
+/* The server runs in another directory, so it gets absolute paths */
+char *absolute_path(const char *path)
+{
+	if(path[0] == '/')
+		return strdup(path);
+
+	char cwd[PATH_MAX];
+	if(!getcwd(cwd, sizeof(cwd)))
+		return NULL;
+
+	char *abs = malloc(strlen(cwd) + strlen(path) + 2);
+	if(abs)
+		sprintf(abs, "%s/%s", cwd, path);
+	return abs;
+}
+
+int run_client(void)
+{
+	int fd = server_connect(arguments.client);
+	if(fd < 0)
+	{
+		printf("Error: Can't connect to a server on %s\n", arguments.client);
+		return 1;
+	}
+
+	struct convert_options_t convert_options;
+	set_convert_options(&convert_options);
+
+	unsigned int failed = 0;
+	if(arguments.batch)
+	{
+		struct batch_t *batch = collect_sources();
+		if(!batch)
+		{
+			server_disconnect(fd);
+			return 1;
+		}
+
+		int output_type = arguments.output_type_set ? (int)arguments.output_type : -1;
+		for(unsigned int i=0; i<batch->count; i++)
+		{
+			char *src = absolute_path(batch->paths[i]);
+			if(!src || !server_convert_file(fd, &convert_options, src, NULL, output_type, arguments.stream))
+				failed++;
+			free(src);
+		}
+
+		printf("Converted %u of %u files", batch->count - failed, batch->count);
+		if(failed)
+			printf(", %u failed", failed);
+		printf("\n");
+		batch_free(batch);
+	}
+	else
+	{
+		char *src = absolute_path(arguments.file_src);
+		char *dest = absolute_path((char *)arguments.output_dest);
+		if(!src || !dest || !server_convert_file(fd, &convert_options, src, dest, arguments.output_type, arguments.stream))
+			failed = 1;
+		free(src);
+		free(dest);
+	}
+
+	server_disconnect(fd);
+	return failed ? 1 : 0;
+}
+
+int run_stream(void)
+{
+	struct convert_options_t convert_options;
+	set_convert_options(&convert_options);
+
+	struct incremental_job_t job;
+	if(incremental && incremental_check(incremental, arguments.file_src, arguments.output_dest, arguments.output_type, &convert_options, &job))
+	{
+		printf("Up to date: %s\n", arguments.output_dest);
+		if(arguments.quality)
+			printf("Quality: %s not measured, its output was up to date\n", arguments.file_src);
+		return 0;
+	}
+
+	struct trace_span_t span;
+	trace_begin(&span, TRACE_STREAM, arguments.file_src);
+	int ok = convert_stream(arguments.file_src, arguments.input_type, arguments.output_dest, arguments.output_type, &convert_options);
+	trace_end(&span, trace_file_size(arguments.file_src), trace_file_size(arguments.output_dest));
+
+	if(!ok)
+	{
+		printf("Error: Failed to convert file.\n");
+		return 1;
+	}
+
+	if(incremental)
+		incremental_store(incremental, &job, arguments.output_dest);
+
+	printf("Converted file: %s\n", arguments.output_dest);
+	return 0;
+}
+
+int run_single(void)
+{
+	struct trace_span_t span;
+
+	struct convert_options_t convert_options;
+	set_convert_options(&convert_options);
+	convert_options.mip_levels = image_mip_levels(arguments.output_type);
+
+	struct incremental_job_t job;
+	if(incremental && incremental_check(incremental, arguments.file_src, arguments.output_dest, arguments.output_type, &convert_options, &job))
+	{
+		printf("Up to date: %s\n", arguments.output_dest);
+		if(arguments.quality)
+			printf("Quality: %s not measured, its output was up to date\n", arguments.file_src);
+		return 0;
+	}
+
 	/* Load input file */
 	struct image_t *img_src = NULL;
 
-	if(arguments.input_type == 0)
-		img_src = load_bmp(arguments.file_src);
-	else if(arguments.input_type == 1)
-		img_src = load_png(arguments.file_src);
+	trace_begin(&span, TRACE_LOAD, arguments.file_src);
+	img_src = load_image(arguments.file_src, arguments.input_type);
+	trace_end(&span, trace_file_size(arguments.file_src), 0);
 
 	if(img_src == NULL)
 	{
@@ -153,75 +493,110 @@ int main(int argc, char **argv)
 	/* Print image stats */
 	printf("Loaded image %s: %dx%dx%d\n", arguments.file_src, img_src->info->width, img_src->info->height, img_src->info->bpp);
 
-	/* Convert to indexed palette */
-	struct image_t *img_dst = to_palette_rgb(img_src, arguments.allow_fullbrights);
+	/* Convert to indexed palette, measuring the error on the way */
+	struct quality_t quality;
+	if(arguments.quality && !quality_begin(&quality, img_src->info->width, img_src->info->height, arguments.quality))
+	{
+		printf("Error: Failed to convert image, exiting\n");
+		free_image(img_src);
+		return 1;
+	}
+
+	trace_begin(&span, TRACE_CONVERT, arguments.file_src);
+	struct image_t *img_dst = to_palette_measured(img_src, &convert_options, arguments.quality ? &quality : NULL);
+	trace_end(&span, 0, 0);
+
+	if(img_dst == NULL)
+	{
+		printf("Error: Failed to convert image, exiting\n");
+		if(arguments.quality)
+			buffer_free(quality.heatmap);
+		free_image(img_src);
+		return 1;
+	}
 
 	/* Output converted file */
-	unsigned int ret = -1;
-	if(arguments.output_type == 0)
-		ret = write_bmp(img_dst, arguments.output_dest);
-	else if(arguments.output_type == 1)
-		ret = write_png(img_dst, arguments.output_dest);
+	trace_begin(&span, TRACE_WRITE, arguments.output_dest);
+	unsigned int ret = write_image(img_dst, arguments.output_dest, arguments.output_type);
+	trace_end(&span, 0, trace_file_size(arguments.output_dest));
+
+	if(ret && incremental)
+		incremental_store(incremental, &job, arguments.output_dest);
 
 	if(ret)
 		printf("Converted file: %s\n", arguments.output_dest);
 	else
 		printf("Error: Failed to convert file.\n");
 
+	if(arguments.quality)
+		quality_end(&quality, arguments.file_src, (char *)arguments.output_dest, arguments.output_type);
+
 	/* Cleanup and exit */
-	free(img_src->info);
-	free(img_src);
-	free(img_dst->info);
-	free(img_dst);
+	free_image(img_src);
+	free_image(img_dst);
 
 	return 0;
 }
 
-/* Simple RGB comparison */
-struct image_t *to_palette_rgb(struct image_t *src, int allow_fullbrights)
+/* Pool work of a conversion, traced as work for the calling thread's convert span */
+static void trace_task(pool_task_t task, void *arg, const char *name)
 {
-	unsigned char *dst = malloc(src->info->width * src->info->height);
+	struct trace_span_t span;
+	trace_begin_task(&span, TRACE_CONVERT, name);
+	task(arg);
+	trace_end(&span, 0, 0);
+}
 
-	unsigned int avail_colors = cmap_colors;
-	if(allow_fullbrights < 1)
-		avail_colors -= 32;
-	
-	for(unsigned int i=0; i<src->info->width * src->info->height; i++)
-	{
-		unsigned char r = src->data[i*3];
-		unsigned char g = src->data[i*3+1];
-		unsigned char b = src->data[i*3+2];
+int main(int argc, char **argv)
+{
+	/* Argument handling, timed as a stage once --stats or --trace turn collection on */
+	struct trace_span_t span;
+	trace_begin(&span, TRACE_PARSE, NULL);
 
-		/* Find closest match in colormap */
-		unsigned int delta = UINT_MAX;
-		unsigned int index = 0;
+	if(!parse_options(argc, argv))
+		return 1;
 
-		for(unsigned int j=0; j<avail_colors; j++)
-		{
-			unsigned char cr = cmap[j*3];
-			unsigned char cg = cmap[j*3+1];
-			unsigned char cb = cmap[j*3+2];
-
-			unsigned int d2 = abs(cr-r) + abs(cg-g) + abs(cb-b);
-			if(d2 < delta)
-			{
-				delta = d2;
-				index = j;
-			}
-		}
+	if(arguments.palette && !load_palette(arguments.palette))
+		return 1;
 
-		dst[i] = index;
+	if(!trace_start(arguments.trace, arguments.stats))
+		return 1;
+	trace_thread_name("main");
+	convert_task_runner = trace_task;
+	trace_end(&span, trace_file_size(arguments.palette), 0);
+
+	/* Batches and servers already run a file per thread */
+	png_encode.threads = arguments.batch || arguments.serve ? 1 : arguments.threads;
+
+	/* Clients and servers convert elsewhere, only local runs use the cache */
+	if(arguments.incremental && !arguments.serve && !arguments.client)
+	{
+		incremental = incremental_open(arguments.incremental);
+		if(!incremental)
+			return 1;
 	}
 
-	/* Create return structs */
-	struct image_t *img_dst = malloc(sizeof(struct image_t));
-	img_dst->info = malloc(sizeof(struct img_info_t));
+	int ret;
+	if(arguments.serve)
+	{
+		struct convert_options_t convert_options;
+		set_convert_options(&convert_options);
+		ret = server_run(arguments.serve, &convert_options) ? 0 : 1;
+	}
+	else if(arguments.client)
+		ret = run_client();
+	else if(arguments.batch)
+		ret = run_batch();
+	else if(arguments.stream || stream_exceeds(arguments.file_src, arguments.input_type, arguments.memory))
+		ret = run_stream();
+	else
+		ret = run_single();
+
+	if(!incremental_close(incremental))
+		ret = 1;
 
-	img_dst->info->bpp = 8;
-	img_dst->info->channels = 1;
-	img_dst->info->width = src->info->width;
-	img_dst->info->height = src->info->height;
-	img_dst->data = dst;
+	if(!trace_finish())
+		ret = 1;
 
-	return img_dst;
+	return ret;
 }
\ No newline at end of file
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "quality.h"
+#include "colormap.h"
+#include "simd.h"
+#include "buffer.h"
+
+/* Pixels measured at a time, sized for the stack */
+#define QUALITY_CHUNK 256
+
+/* Histogram bin of each whole Delta E below 20, and of 20 up */
+static const unsigned char bin_of[21] = { 0, 1, 2, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 6 };
+
+static const char *bin_names[QUALITY_BINS] = { "<1", "1-2", "2-3", "3-5", "5-10", "10-20", "20+" };
+
+struct quality_palette_t *quality_palette_create(void)
+{
+	struct quality_palette_t *qp = calloc(1, sizeof(struct quality_palette_t));
+	if(!qp)
+		return NULL;
+
+	qp->lab = metric_palette_create(cmap, cmap_colors, METRIC_LAB76);
+	if(!qp->lab)
+	{
+		free(qp);
+		return NULL;
+	}
+
+	for(unsigned int j=0; j<cmap_colors; j++)
+	{
+		for(unsigned int c=0; c<3; c++)
+		{
+			qp->color[PIXEL_RGB][j*3+c] = cmap[j*3+c];
+			qp->color[PIXEL_BGR][j*3+c] = cmap[j*3+2-c];
+		}
+		qp->fullbright[j] = (cmap_flags[j] & CMAP_FULLBRIGHT) != 0;
+	}
+
+	/* Black to red to yellow to white, in whatever entries the palette has closest */
+	for(unsigned int i=0; i<256; i++)
+	{
+		int ramp[3];
+		for(int c=0; c<3; c++)
+		{
+			int v = (int)i * 3 - c * 255;
+			ramp[c] = v < 0 ? 0 : v > 255 ? 255 : v;
+		}
+
+		unsigned int best = 0, best_dist = ~0u;
+		for(unsigned int j=0; j<cmap_colors; j++)
+		{
+			if(cmap_flags[j] & CMAP_RESERVED)
+				continue;
+
+			int dr = cmap[j*3] - ramp[0], dg = cmap[j*3+1] - ramp[1], db = cmap[j*3+2] - ramp[2];
+			unsigned int dist = dr * dr + dg * dg + db * db;
+			if(dist < best_dist)
+			{
+				best = j;
+				best_dist = dist;
+			}
+		}
+		qp->heat[i] = best;
+	}
+
+	return qp;
+}
+
+void quality_palette_free(struct quality_palette_t *qp)
+{
+	if(!qp)
+		return;
+
+	metric_palette_free(qp->lab);
+	free(qp);
+}
+
+/* Squared error runs over bytes, on the palette colors gathered into the source's order.
+   Delta E per pixel comes from the Lab tables, then the sums, maximum and histogram
+   are reduced in fixed point */
+void quality_row(struct quality_t *q, const unsigned char *src, enum pixel_order_t order, const unsigned char *indices, unsigned int width, unsigned char *heat)
+{
+	const struct quality_palette_t *qp = q->palette;
+	const unsigned char *color = qp->color[order];
+
+	unsigned char mapped[QUALITY_CHUNK * 3];
+	float de[QUALITY_CHUNK];
+
+	for(unsigned int x=0; x<width; x+=QUALITY_CHUNK)
+	{
+		unsigned int n = width - x < QUALITY_CHUNK ? width - x : QUALITY_CHUNK;
+		const unsigned char *s = src + (size_t)x * 3;
+		const unsigned char *idx = indices + x;
+
+		for(unsigned int i=0; i<n; i++)
+			memcpy(mapped + i*3, color + idx[i]*3, 3);
+		q->squared += simd_squared_error(s, mapped, n * 3);
+
+		metric_delta_e(qp->lab, s, order, idx, de, n);
+
+		unsigned long long sum = 0;
+		unsigned int max = q->max_delta_e;
+		unsigned int fullbrights = 0;
+		for(unsigned int i=0; i<n; i++)
+		{
+			unsigned int fixed = (unsigned int)(de[i] * QUALITY_SCALE + 0.5f);
+			sum += fixed;
+			max = fixed > max ? fixed : max;
+			fullbrights += qp->fullbright[idx[i]];
+
+			unsigned int whole = fixed / QUALITY_SCALE;
+			q->histogram[bin_of[whole < QUALITY_HEAT_MAX ? whole : QUALITY_HEAT_MAX]]++;
+
+			if(heat)
+			{
+				unsigned int step = fixed * 255 / (QUALITY_HEAT_MAX * QUALITY_SCALE);
+				heat[x+i] = qp->heat[step < 255 ? step : 255];
+			}
+		}
+
+		q->delta_e += sum;
+		q->max_delta_e = max;
+		q->fullbrights += fullbrights;
+	}
+
+	q->pixels += width;
+}
+
+void quality_add(struct quality_t *total, const struct quality_t *q)
+{
+	total->pixels += q->pixels;
+	total->squared += q->squared;
+	total->delta_e += q->delta_e;
+	if(q->max_delta_e > total->max_delta_e)
+		total->max_delta_e = q->max_delta_e;
+	for(unsigned int i=0; i<QUALITY_BINS; i++)
+		total->histogram[i] += q->histogram[i];
+	total->fullbrights += q->fullbrights;
+}
+
+int quality_begin(struct quality_t *q, unsigned int width, unsigned int height, enum quality_report_t report)
+{
+	memset(q, 0, sizeof(*q));
+	q->width = width;
+	q->height = height;
+
+	if(report == QUALITY_HEATMAP)
+	{
+		q->heatmap = buffer_alloc((size_t)width * height);
+		if(!q->heatmap)
+			return 0;
+	}
+
+	return 1;
+}
+
+int quality_end(struct quality_t *q, const char *src, const char *dest, enum image_type_t output_type)
+{
+	double pixels = q->pixels ? (double)q->pixels : 1.0;
+	double mse = q->squared / (pixels * 3);
+
+	char psnr[32];
+	if(q->squared)
+		snprintf(psnr, sizeof(psnr), "%.2f dB", 10.0 * log10(255.0 * 255.0 / mse));
+	else
+		strcpy(psnr, "lossless");
+
+	char bins[QUALITY_BINS * 20];
+	size_t len = 0;
+	for(unsigned int i=0; i<QUALITY_BINS; i++)
+		len += snprintf(bins + len, sizeof(bins) - len, " %s %.1f%%", bin_names[i], 100.0 * q->histogram[i] / pixels);
+
+	/* One printf, so lines from concurrent batch jobs don't interleave */
+	printf("Quality: %s Delta E mean %.2f max %.2f, PSNR %s, %.1f%% fullbright\n  Delta E histogram:%s\n", src,
+		q->delta_e / (pixels * QUALITY_SCALE), (double)q->max_delta_e / QUALITY_SCALE, psnr, 100.0 * q->fullbrights / pixels, bins);
+
+	if(!q->heatmap)
+		return 1;
+
+	enum image_type_t type;
+	char *path = quality_heatmap_path(src, dest, output_type, &type);
+	int ok = path != NULL;
+	if(ok)
+	{
+		struct img_info_t info = { 8, 1, q->width, q->height, q->width, PIXEL_RGB, 0, 1 };
+		struct image_t image = { &info, q->heatmap, NULL, 0 };
+
+		ok = write_image(&image, path, type);
+		if(!ok)
+			printf("Error: Failed to write heatmap %s\n", path);
+	}
+
+	free(path);
+	buffer_free(q->heatmap);
+	q->heatmap = NULL;
+
+	return ok;
+}
+
+char *quality_heatmap_path(const char *src, const char *dest, enum image_type_t output_type, enum image_type_t *type)
+{
+	const char *base = dest ? dest : src;
+	*type = dest && output_type == IMAGE_BMP ? IMAGE_BMP : IMAGE_PNG;
+
+	/* Extension of the file name, not of a directory */
+	size_t len = strlen(base);
+	const char *dot = strrchr(base, '.');
+	if(dot && !strpbrk(dot, "/\\"))
+		len = dot - base;
+
+	char *path = malloc(len + 12);
+	if(!path)
+		return NULL;
+
+	memcpy(path, base, len);
+	sprintf(path + len, "_error.%s", image_type_ext(*type));
+
+	return path;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "defs.h"
+#include "image.h"
+#include "metric.h"
+
+/* convert_options_t quality reports */
+enum quality_report_t
+{
+	QUALITY_NONE,
+	QUALITY_PRINT,		// print the error of each image
+	QUALITY_HEATMAP,	// and write an _error image of it next to the output
+};
+
+/* Delta E 1976 histogram: below 1, 1-2, 2-3, 3-5, 5-10, 10-20 and 20 up */
+#define QUALITY_BINS 7
+
+/* Delta E sums are kept in fixed point, so they come out the same for any split into bands */
+#define QUALITY_SCALE 1024
+
+/* Delta E where the heatmap ramp reaches white */
+#define QUALITY_HEAT_MAX 20
+
+/* Full colormap in Lab plus the heatmap ramp, built once per palette like the matchers */
+struct quality_palette_t
+{
+	struct metric_palette_t *lab;
+	unsigned char color[2][256*3];	// entries in RGB and in BGR order
+	unsigned char fullbright[256];
+	unsigned char heat[256];		// entry nearest to each step of the black, red, yellow, white ramp
+};
+
+/* Quantization error of the full size level, added up row by row while matching.
+   Each band or worker keeps its own, summed afterwards like the color cache counters */
+struct quality_t
+{
+	const struct quality_palette_t *palette;	// set by the conversion
+	unsigned char *heatmap;			// heat ramp entry per pixel, bottom-up like the output, NULL = none
+	unsigned int width;
+	unsigned int height;
+	unsigned long long pixels;
+	unsigned long long squared;		// sum of squared channel differences
+	unsigned long long delta_e;		// sum of Delta E 1976, in 1/QUALITY_SCALE
+	unsigned int max_delta_e;		// in 1/QUALITY_SCALE
+	unsigned long long histogram[QUALITY_BINS];
+	unsigned long long fullbrights;	// pixels mapped to fullbright entries
+};
+
+extern struct quality_palette_t *quality_palette_create(void);
+
+extern void quality_palette_free(struct quality_palette_t *qp);
+
+/* Measure one row of source pixels against the indices they were mapped to,
+   writing each pixel's heat ramp entry to 'heat' unless it is NULL */
+extern void quality_row(struct quality_t *q, const unsigned char *src, enum pixel_order_t order, const unsigned char *indices, unsigned int width, unsigned char *heat);
+
+/* Add another band's counters into 'total' */
+extern void quality_add(struct quality_t *total, const struct quality_t *q);
+
+/* Ready q for a width x height conversion, with a heatmap buffer for QUALITY_HEATMAP */
+extern int quality_begin(struct quality_t *q, unsigned int width, unsigned int height, enum quality_report_t report);
+
+/* Print the error of src, write the heatmap if there is one and free it */
+extern int quality_end(struct quality_t *q, const char *src, const char *dest, enum image_type_t output_type);
+
+/* Heatmap file for an output, dest_error.png or .bmp, or next to src when the output has
+   no file of its own (WAD lumps). *type is set to its image type */
+extern char *quality_heatmap_path(const char *src, const char *dest, enum image_type_t output_type, enum image_type_t *type);
@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "image.h"
+#include "stream.h"
+#include "buffer.h"
+
+#ifdef _WIN32
+
+int server_run(const char *socket_path, const struct convert_options_t *options)
+{
+	printf("Error: --serve needs Unix domain sockets, which this build doesn't have\n");
+	return 0;
+}
+
+int server_connect(const char *socket_path)
+{
+	printf("Error: --client needs Unix domain sockets, which this build doesn't have\n");
+	return -1;
+}
+
+int server_convert_file(int fd, const struct convert_options_t *options, const char *src, const char *dest, int output_type, int stream)
+{
+	return 0;
+}
+
+int server_convert_pixels(int fd, const struct convert_options_t *options, const unsigned char *rgb, unsigned int width, unsigned int height, unsigned char *indices)
+{
+	return 0;
+}
+
+void server_disconnect(int fd)
+{
+}
+
+#else
+
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVER_MAGIC 0x51504a42		// "QPJB"
+#define SERVER_PATH_MAX 4096
+#define SERVER_MAX_SIZE 8192		// largest width or height of a pixel job
+
+enum server_job_t
+{
+	JOB_FILE,		// paths follow the request
+	JOB_PIXELS,		// width * height * 3 bytes of top-down RGB follow the request
+};
+
+/* Both ends are the same binary on the same machine, so structs go over the socket as they are */
+struct server_request_t
+{
+	unsigned int magic;
+	unsigned int job;
+	unsigned int allow_fullbrights;
+	unsigned int match_method;
+	unsigned int metric;
+	unsigned int dither;
+	int output_type;
+	unsigned int stream;
+	unsigned int width;
+	unsigned int height;
+	unsigned int src_len;		// file jobs, lengths without terminators
+	unsigned int dest_len;		// 0 = default output name
+};
+
+struct server_reply_t
+{
+	unsigned int magic;
+	int ok;
+	unsigned int data_len;		// pixel jobs: the indices, file jobs: the output path or an error
+};
+
+static volatile sig_atomic_t stopping;
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	while(len > 0)
+	{
+		ssize_t n = read(fd, p, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	while(len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return 0;
+		p += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static int send_reply(int fd, int ok, const void *data, unsigned int data_len)
+{
+	struct server_reply_t reply = { SERVER_MAGIC, ok, data_len };
+	return write_full(fd, &reply, sizeof(reply)) && write_full(fd, data, data_len);
+}
+
+static int send_message(int fd, int ok, const char *message)
+{
+	return send_reply(fd, ok, message, strlen(message));
+}
+
+static int valid_request(const struct server_request_t *req)
+{
+	if(req->magic != SERVER_MAGIC || req->match_method > MATCH_KDTREE || req->metric >= METRIC_COUNT || req->dither > DITHER_FS)
+		return 0;
+
+	if(req->job == JOB_FILE)
+		return req->src_len > 0 && req->src_len < SERVER_PATH_MAX && req->dest_len < SERVER_PATH_MAX &&
+			req->output_type >= -1 && req->output_type <= IMAGE_LMP;
+
+	return req->job == JOB_PIXELS && req->width > 0 && req->height > 0 && req->width <= SERVER_MAX_SIZE && req->height <= SERVER_MAX_SIZE;
+}
+
+static int serve_file(int fd, const struct server_request_t *req, const struct convert_options_t *options)
+{
+	char src[SERVER_PATH_MAX], dest[SERVER_PATH_MAX];
+	if(!read_full(fd, src, req->src_len) || !read_full(fd, dest, req->dest_len))
+		return 0;
+	src[req->src_len] = '\0';
+	dest[req->dest_len] = '\0';
+
+	char message[SERVER_PATH_MAX + 64];
+	int input_type = image_type_from_path(src);
+	if(input_type < 0 || !image_type_loadable(input_type))
+	{
+		snprintf(message, sizeof(message), "Unsupported file type %s", src);
+		return send_message(fd, 0, message);
+	}
+
+	enum image_type_t output_type = req->output_type >= 0 ? (enum image_type_t)req->output_type : (enum image_type_t)input_type;
+	char *default_dest = req->dest_len ? NULL : image_default_dest(src, output_type);
+	const char *path = default_dest ? default_dest : dest;
+
+	int ok;
+	if(req->stream)
+		ok = convert_stream(src, input_type, path, output_type, options);
+	else
+		ok = convert_file(src, input_type, path, output_type, options);
+
+	if(ok)
+		snprintf(message, sizeof(message), "%s", path);
+	else
+		snprintf(message, sizeof(message), "Failed to convert %s", src);
+	free(default_dest);
+
+	return send_message(fd, ok, message);
+}
+
+static int serve_pixels(int fd, const struct server_request_t *req, const struct convert_options_t *options)
+{
+	unsigned int width = req->width, height = req->height;
+
+	struct img_info_t info = { 24, 3, width, height, width * 3, PIXEL_RGB, 1, 1 };
+	struct image_t src = { &info, buffer_alloc((size_t)width * height * 3), NULL, 0 };
+	unsigned char *indices = buffer_alloc((size_t)width * height);
+
+	if(!src.data || !indices || !read_full(fd, src.data, (size_t)width * height * 3))
+	{
+		buffer_free(src.data);
+		buffer_free(indices);
+		return 0;
+	}
+
+	struct image_t *dst = to_palette_rgb(&src, options);
+	buffer_free(src.data);
+	if(!dst)
+	{
+		buffer_free(indices);
+		return send_message(fd, 0, "Failed to convert pixels");
+	}
+
+	/* Results are bottom-up, like a BMP */
+	for(unsigned int y=0; y<height; y++)
+		memcpy(indices + (size_t)y * width, dst->data + (size_t)(height - 1 - y) * width, width);
+	free_image(dst);
+
+	int ok = send_reply(fd, 1, indices, width * height);
+	buffer_free(indices);
+	return ok;
+}
+
+static void *serve_connection(void *arg)
+{
+	int fd = *(int *)arg;
+	free(arg);
+
+	struct server_request_t req;
+	while(read_full(fd, &req, sizeof(req)))
+	{
+		if(!valid_request(&req))
+		{
+			printf("Error: Invalid request, closing connection\n");
+			break;
+		}
+
+		/* Connections convert concurrently, so each job stays on its thread */
+		struct convert_options_t options;
+		memset(&options, 0, sizeof(options));
+		options.allow_fullbrights = req.allow_fullbrights;
+		options.match_method = req.match_method;
+		options.metric = req.metric;
+		options.dither = req.dither;
+		options.threads = 1;
+		options.mip_levels = 1;
+
+		if(!(req.job == JOB_FILE ? serve_file(fd, &req, &options) : serve_pixels(fd, &req, &options)))
+			break;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void stop_server(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+static int bind_socket(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		printf("Error: Socket path %s is too long\n", socket_path);
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+	{
+		printf("Error: Failed to create a socket\n");
+		return -1;
+	}
+
+	/* A socket left behind by a server that died is replaced, a live one isn't */
+	int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	if(!bound && errno == EADDRINUSE)
+	{
+		int live = server_connect(socket_path);
+		if(live >= 0)
+		{
+			close(live);
+			printf("Error: A server is already running on %s\n", socket_path);
+			close(fd);
+			return -1;
+		}
+
+		unlink(socket_path);
+		bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	}
+
+	if(!bound)
+	{
+		printf("Error: Failed to bind %s\n", socket_path);
+		close(fd);
+		return -1;
+	}
+
+	if(listen(fd, 64) != 0)
+	{
+		printf("Error: Failed to listen on %s\n", socket_path);
+		close(fd);
+		unlink(socket_path);
+		return -1;
+	}
+
+	return fd;
+}
+
+int server_run(const char *socket_path, const struct convert_options_t *options)
+{
+	/* Build the lookup table now, later jobs of any size reuse it */
+	struct matcher_t matcher;
+	if(!prepare_matcher(options, (unsigned long)SERVER_MAX_SIZE * SERVER_MAX_SIZE, &matcher))
+		return 0;
+
+	int listener = bind_socket(socket_path);
+	if(listener < 0)
+		return 0;
+
+	/* No SA_RESTART, so accept returns on a signal and the socket gets removed. Connection
+	   threads are started with the signals blocked, so they are always delivered here */
+	sigset_t stop_signals, previous;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_server;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Serving on %s\n", socket_path);
+	fflush(stdout);
+
+	while(!stopping)
+	{
+		int fd = accept(listener, NULL, NULL);
+		if(fd < 0)
+			continue;
+
+		int *arg = malloc(sizeof(int));
+		pthread_t thread;
+		if(!arg)
+		{
+			close(fd);
+			continue;
+		}
+
+		*arg = fd;
+		pthread_sigmask(SIG_BLOCK, &stop_signals, &previous);
+		int created = pthread_create(&thread, NULL, serve_connection, arg) == 0;
+		pthread_sigmask(SIG_SETMASK, &previous, NULL);
+		if(!created)
+		{
+			free(arg);
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(listener);
+	unlink(socket_path);
+	return 1;
+}
+
+int server_connect(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(socket_path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+		return -1;
+
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void fill_request(struct server_request_t *req, enum server_job_t job, const struct convert_options_t *options)
+{
+	memset(req, 0, sizeof(*req));
+	req->magic = SERVER_MAGIC;
+	req->job = job;
+	req->allow_fullbrights = options->allow_fullbrights;
+	req->match_method = options->match_method;
+	req->metric = options->metric;
+	req->dither = options->dither;
+	req->output_type = -1;
+}
+
+/* Reads the reply header, the caller reads its data */
+static int read_reply(int fd, struct server_reply_t *reply)
+{
+	return read_full(fd, reply, sizeof(*reply)) && reply->magic == SERVER_MAGIC;
+}
+
+int server_convert_file(int fd, const struct convert_options_t *options, const char *src, const char *dest, int output_type, int stream)
+{
+	struct server_request_t req;
+	fill_request(&req, JOB_FILE, options);
+	req.output_type = output_type;
+	req.stream = stream;
+	req.src_len = strlen(src);
+	req.dest_len = dest ? strlen(dest) : 0;
+
+	if(req.src_len >= SERVER_PATH_MAX || req.dest_len >= SERVER_PATH_MAX)
+	{
+		printf("Error: Path too long: %s\n", src);
+		return 0;
+	}
+
+	struct server_reply_t reply;
+	char message[SERVER_PATH_MAX + 64];
+
+	if(!write_full(fd, &req, sizeof(req)) || !write_full(fd, src, req.src_len) || !write_full(fd, dest, req.dest_len) ||
+		!read_reply(fd, &reply) || reply.data_len >= sizeof(message) || !read_full(fd, message, reply.data_len))
+	{
+		printf("Error: Lost connection to the server\n");
+		return 0;
+	}
+	message[reply.data_len] = '\0';
+
+	if(reply.ok)
+		printf("Converted file: %s\n", message);
+	else
+		printf("Error: %s\n", message);
+
+	return reply.ok;
+}
+
+int server_convert_pixels(int fd, const struct convert_options_t *options, const unsigned char *rgb, unsigned int width, unsigned int height, unsigned char *indices)
+{
+	struct server_request_t req;
+	fill_request(&req, JOB_PIXELS, options);
+	req.width = width;
+	req.height = height;
+
+	struct server_reply_t reply;
+	if(!write_full(fd, &req, sizeof(req)) || !write_full(fd, rgb, (size_t)width * height * 3) || !read_reply(fd, &reply))
+		return 0;
+
+	if(reply.ok && reply.data_len == width * height)
+		return read_full(fd, indices, reply.data_len);
+
+	/* Failure message, or a size mismatch that leaves the connection unusable */
+	char message[256];
+	if(reply.data_len < sizeof(message) && read_full(fd, message, reply.data_len))
+	{
+		message[reply.data_len] = '\0';
+		printf("Error: %s\n", message);
+	}
+	return 0;
+}
+
+void server_disconnect(int fd)
+{
+	if(fd >= 0)
+		close(fd);
+}
+
+#endif
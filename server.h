@@ -0,0 +1,25 @@
+#pragma once
+
+#include "convert.h"
+
+/* Conversion server. It keeps the palette and matcher tables warm between jobs
+   and takes jobs from any number of clients over a Unix domain socket, serving
+   each connection on its own thread. A connection can send any number of jobs,
+   each answered before the next is read */
+
+/* Serve on socket_path until SIGINT or SIGTERM. The matcher tables for 'options'
+   are built up front; jobs bring their own options */
+extern int server_run(const char *socket_path, const struct convert_options_t *options);
+
+/* Returns the connection, -1 on failure */
+extern int server_connect(const char *socket_path);
+
+/* Convert the image at src into dest, both absolute or relative to the server's
+   working directory. dest NULL means src_conv.ext, output_type -1 the source type.
+   'stream' converts row by row as -s does */
+extern int server_convert_file(int fd, const struct convert_options_t *options, const char *src, const char *dest, int output_type, int stream);
+
+/* Map top-down packed RGB pixels to palette indices, also top-down */
+extern int server_convert_pixels(int fd, const struct convert_options_t *options, const unsigned char *rgb, unsigned int width, unsigned int height, unsigned char *indices);
+
+extern void server_disconnect(int fd);
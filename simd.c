@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+#include "simd.h"
+
+#define SIMD_WIDTH 16		// entries per AVX2 iteration, padding covers SSE too
+#define SIMD_PAD_VALUE 1000	// padded entries are further than any real color can be
+
+typedef void (*simd_kernel_t)(const struct simd_palette_t *pal, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count);
+
+static void map_scalar(const struct simd_palette_t *pal, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count)
+{
+	/* Channel offsets, BGR sources are read in place */
+	unsigned int ro = order == PIXEL_BGR ? 2 : 0;
+	unsigned int bo = 2 - ro;
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		int r = src[i*3+ro];
+		int g = src[i*3+1];
+		int b = src[i*3+bo];
+
+		unsigned int delta = UINT_MAX;
+		unsigned int index = 0;
+
+		for(unsigned int j=0; j<pal->colors; j++)
+		{
+			unsigned int d2 = abs(pal->r[j]-r) + abs(pal->g[j]-g) + abs(pal->b[j]-b);
+			if(d2 < delta)
+			{
+				delta = d2;
+				index = j;
+			}
+		}
+
+		dst[i] = index;
+	}
+}
+
+#ifdef SIMD_X86
+
+/* Both kernels compute all distances into a scratch row while tracking the
+   minimum, then return the first entry holding it so the lowest index wins ties */
+
+__attribute__((target("sse4.1")))
+static void map_sse41(const struct simd_palette_t *pal, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count)
+{
+	/* Channel offsets, BGR sources are read in place */
+	unsigned int ro = order == PIXEL_BGR ? 2 : 0;
+	unsigned int bo = 2 - ro;
+
+	unsigned short dist[256 + SIMD_WIDTH] __attribute__((aligned(16)));
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		__m128i r = _mm_set1_epi16(src[i*3+ro]);
+		__m128i g = _mm_set1_epi16(src[i*3+1]);
+		__m128i b = _mm_set1_epi16(src[i*3+bo]);
+		__m128i best = _mm_set1_epi16(-1);
+
+		for(unsigned int j=0; j<pal->padded; j+=8)
+		{
+			__m128i d = _mm_abs_epi16(_mm_sub_epi16(_mm_loadu_si128((const __m128i *)(pal->r+j)), r));
+			d = _mm_add_epi16(d, _mm_abs_epi16(_mm_sub_epi16(_mm_loadu_si128((const __m128i *)(pal->g+j)), g)));
+			d = _mm_add_epi16(d, _mm_abs_epi16(_mm_sub_epi16(_mm_loadu_si128((const __m128i *)(pal->b+j)), b)));
+
+			_mm_store_si128((__m128i *)(dist+j), d);
+			best = _mm_min_epu16(best, d);
+		}
+
+		__m128i target = _mm_set1_epi16(_mm_extract_epi16(_mm_minpos_epu16(best), 0));
+
+		for(unsigned int j=0; j<pal->padded; j+=8)
+		{
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_load_si128((const __m128i *)(dist+j)), target));
+			if(mask)
+			{
+				dst[i] = j + __builtin_ctz(mask) / 2;
+				break;
+			}
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void map_avx2(const struct simd_palette_t *pal, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count)
+{
+	/* Channel offsets, BGR sources are read in place */
+	unsigned int ro = order == PIXEL_BGR ? 2 : 0;
+	unsigned int bo = 2 - ro;
+
+	unsigned short dist[256 + SIMD_WIDTH] __attribute__((aligned(32)));
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		__m256i r = _mm256_set1_epi16(src[i*3+ro]);
+		__m256i g = _mm256_set1_epi16(src[i*3+1]);
+		__m256i b = _mm256_set1_epi16(src[i*3+bo]);
+		__m256i best = _mm256_set1_epi16(-1);
+
+		for(unsigned int j=0; j<pal->padded; j+=16)
+		{
+			__m256i d = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(pal->r+j)), r));
+			d = _mm256_add_epi16(d, _mm256_abs_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(pal->g+j)), g)));
+			d = _mm256_add_epi16(d, _mm256_abs_epi16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(pal->b+j)), b)));
+
+			_mm256_store_si256((__m256i *)(dist+j), d);
+			best = _mm256_min_epu16(best, d);
+		}
+
+		__m128i half = _mm_min_epu16(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+		__m256i target = _mm256_set1_epi16(_mm_extract_epi16(_mm_minpos_epu16(half), 0));
+
+		for(unsigned int j=0; j<pal->padded; j+=16)
+		{
+			unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_load_si256((const __m256i *)(dist+j)), target));
+			if(mask)
+			{
+				dst[i] = j + __builtin_ctz(mask) / 2;
+				break;
+			}
+		}
+	}
+}
+
+#endif
+
+static void downsample_scalar(const unsigned char *row0, const unsigned char *row1, unsigned char *dst, unsigned int x, unsigned int out_width)
+{
+	for(; x<out_width; x++)
+	{
+		for(unsigned int c=0; c<3; c++)
+			dst[x*3+c] = (row0[x*6+c] + row0[x*6+c+3] + row1[x*6+c] + row1[x*6+c+3] + 2) >> 2;
+	}
+}
+
+#ifdef SIMD_X86
+
+/* 8 output pixels per iteration. Both rows are summed as 16 bit lanes, then each
+   lane gets the lane 3 over (the next pixel's same channel) added; every other
+   group of three lanes is a finished 2x2 sum, gathered with byte shuffles */
+__attribute__((target("ssse3")))
+static void downsample_ssse3(const unsigned char *row0, const unsigned char *row1, unsigned char *dst, unsigned int out_width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i two = _mm_set1_epi16(2);
+
+	/* Finished sums sit at bytes 0-2, 6-8, 12-14, ... of the 48 packed results */
+	const __m128i lo_from0 = _mm_setr_epi8(0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i lo_from1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 3, 4, 8, 9, 10, 14);
+	const __m128i hi_from1 = _mm_setr_epi8(15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i hi_from2 = _mm_setr_epi8(-1, 0, 4, 5, 6, 10, 11, 12, -1, -1, -1, -1, -1, -1, -1, -1);
+
+	unsigned int x = 0;
+	for(; x + 8 <= out_width; x += 8)
+	{
+		__m128i s[6], t[6];
+		for(int k=0; k<3; k++)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i *)(row0 + x*6 + k*16));
+			__m128i b = _mm_loadu_si128((const __m128i *)(row1 + x*6 + k*16));
+			s[k*2] = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			s[k*2+1] = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+		}
+
+		/* The last three lanes of t[5] pair with the next block and are never gathered */
+		for(int k=0; k<5; k++)
+			t[k] = _mm_add_epi16(s[k], _mm_alignr_epi8(s[k+1], s[k], 6));
+		t[5] = _mm_add_epi16(s[5], _mm_srli_si128(s[5], 6));
+
+		__m128i p[3];
+		for(int k=0; k<3; k++)
+			p[k] = _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(t[k*2], two), 2), _mm_srli_epi16(_mm_add_epi16(t[k*2+1], two), 2));
+
+		__m128i lo = _mm_or_si128(_mm_shuffle_epi8(p[0], lo_from0), _mm_shuffle_epi8(p[1], lo_from1));
+		__m128i hi = _mm_or_si128(_mm_shuffle_epi8(p[1], hi_from1), _mm_shuffle_epi8(p[2], hi_from2));
+		_mm_storeu_si128((__m128i *)(dst + x*3), lo);
+		_mm_storel_epi64((__m128i *)(dst + x*3 + 16), hi);
+	}
+
+	downsample_scalar(row0, row1, dst, x, out_width);
+}
+
+#endif
+
+static unsigned long long squared_error_scalar(const unsigned char *a, const unsigned char *b, size_t i, size_t count)
+{
+	unsigned long long sum = 0;
+	for(; i<count; i++)
+	{
+		int d = a[i] - b[i];
+		sum += d * d;
+	}
+
+	return sum;
+}
+
+#ifdef SIMD_X86
+
+/* 32 bit lanes gain at most 2 * 2 * 255^2 per iteration, so they're widened
+   into the 64 bit total before they could overflow */
+#define SQUARED_ERROR_BLOCK 8192
+
+__attribute__((target("sse2")))
+static unsigned long long squared_error_sse2(const unsigned char *a, const unsigned char *b, size_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i total = zero;
+
+	size_t i = 0;
+	while(i + 16 <= count)
+	{
+		__m128i acc = zero;
+		for(unsigned int n=0; n<SQUARED_ERROR_BLOCK && i + 16 <= count; n++, i += 16)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+			__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+			__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(y, zero));
+			__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(y, zero));
+			acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+		}
+
+		total = _mm_add_epi64(total, _mm_add_epi64(_mm_unpacklo_epi32(acc, zero), _mm_unpackhi_epi32(acc, zero)));
+	}
+
+	unsigned long long lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, total);
+	return lanes[0] + lanes[1] + squared_error_scalar(a, b, i, count);
+}
+
+__attribute__((target("avx2")))
+static unsigned long long squared_error_avx2(const unsigned char *a, const unsigned char *b, size_t count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i total = zero;
+
+	size_t i = 0;
+	while(i + 32 <= count)
+	{
+		__m256i acc = zero;
+		for(unsigned int n=0; n<SQUARED_ERROR_BLOCK && i + 32 <= count; n++, i += 32)
+		{
+			__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+			__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+			__m256i lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(x, zero), _mm256_unpacklo_epi8(y, zero));
+			__m256i hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(x, zero), _mm256_unpackhi_epi8(y, zero));
+			acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+		}
+
+		total = _mm256_add_epi64(total, _mm256_add_epi64(_mm256_unpacklo_epi32(acc, zero), _mm256_unpackhi_epi32(acc, zero)));
+	}
+
+	unsigned long long lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, total);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + squared_error_scalar(a, b, i, count);
+}
+
+#endif
+
+static simd_kernel_t kernel = NULL;
+static const char *kernel_name = "scalar";
+
+static void select_kernel(void)
+{
+	kernel = map_scalar;
+	kernel_name = "scalar";
+
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		kernel = map_avx2;
+		kernel_name = "avx2";
+	}
+	else if(__builtin_cpu_supports("sse4.1"))
+	{
+		kernel = map_sse41;
+		kernel_name = "sse4.1";
+	}
+#endif
+}
+
+struct simd_palette_t *simd_palette_create(const unsigned char *palette, unsigned int colors)
+{
+	if(kernel == NULL)
+		select_kernel();
+
+	struct simd_palette_t *pal = malloc(sizeof(struct simd_palette_t));
+	if(!pal)
+		return NULL;
+
+	pal->colors = colors;
+	pal->padded = (colors + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+	pal->r = malloc(pal->padded * sizeof(short));
+	pal->g = malloc(pal->padded * sizeof(short));
+	pal->b = malloc(pal->padded * sizeof(short));
+
+	if(!pal->r || !pal->g || !pal->b)
+	{
+		printf("Failed to malloc SIMD palette\n");
+		simd_palette_free(pal);
+		return NULL;
+	}
+
+	for(unsigned int j=0; j<pal->padded; j++)
+	{
+		pal->r[j] = j < colors ? palette[j*3] : SIMD_PAD_VALUE;
+		pal->g[j] = j < colors ? palette[j*3+1] : SIMD_PAD_VALUE;
+		pal->b[j] = j < colors ? palette[j*3+2] : SIMD_PAD_VALUE;
+	}
+
+	return pal;
+}
+
+void simd_palette_free(struct simd_palette_t *pal)
+{
+	if(!pal)
+		return;
+
+	free(pal->r);
+	free(pal->g);
+	free(pal->b);
+	free(pal);
+}
+
+void simd_map(const struct simd_palette_t *pal, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count)
+{
+	kernel(pal, src, order, dst, count);
+}
+
+const char *simd_kernel_name(void)
+{
+	if(kernel == NULL)
+		select_kernel();
+
+	return kernel_name;
+}
+
+int simd_force_kernel(const char *name)
+{
+	if(name == NULL)
+	{
+		select_kernel();
+		return 1;
+	}
+
+	if(!strcmp(name, "scalar"))
+	{
+		kernel = map_scalar;
+		kernel_name = "scalar";
+		return 1;
+	}
+
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if(!strcmp(name, "sse4.1") && __builtin_cpu_supports("sse4.1"))
+	{
+		kernel = map_sse41;
+		kernel_name = "sse4.1";
+		return 1;
+	}
+	if(!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+	{
+		kernel = map_avx2;
+		kernel_name = "avx2";
+		return 1;
+	}
+#endif
+
+	return 0;
+}
+
+
+void simd_downsample(const unsigned char *row0, const unsigned char *row1, unsigned char *dst, unsigned int out_width)
+{
+#ifdef SIMD_X86
+	/* Checked per call, it's a load of a flag libgcc fills in at startup */
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		downsample_ssse3(row0, row1, dst, out_width);
+		return;
+	}
+#endif
+
+	downsample_scalar(row0, row1, dst, 0, out_width);
+}
+
+unsigned long long simd_squared_error(const unsigned char *a, const unsigned char *b, size_t count)
+{
+#ifdef SIMD_X86
+	if(__builtin_cpu_supports("avx2"))
+		return squared_error_avx2(a, b, count);
+	if(__builtin_cpu_supports("sse2"))
+		return squared_error_sse2(a, b, count);
+#endif
+
+	return squared_error_scalar(a, b, 0, count);
+}
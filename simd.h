@@ -0,0 +1,33 @@
+#pragma once
+
+#include "defs.h"
+
+/* Structure-of-arrays copy of a palette for the vectorized nearest color kernels */
+struct simd_palette_t
+{
+	unsigned int colors;
+	unsigned int padded;	// colors rounded up to a multiple of the widest kernel
+	short *r;
+	short *g;
+	short *b;
+};
+
+extern struct simd_palette_t *simd_palette_create(const unsigned char *palette, unsigned int colors);
+
+extern void simd_palette_free(struct simd_palette_t *pal);
+
+/* Map count RGB or BGR pixels to palette indices using the best kernel this CPU supports */
+extern void simd_map(const struct simd_palette_t *pal, const unsigned char *src, enum pixel_order_t order, unsigned char *dst, unsigned int count);
+
+extern const char *simd_kernel_name(void);
+
+/* Use the "scalar", "sse4.1" or "avx2" kernel instead of the best one, NULL goes back to the
+   best. Returns 0 if this CPU doesn't support it. Nothing may be mapping meanwhile */
+extern int simd_force_kernel(const char *name);
+
+/* Average 2x2 blocks of two rows of packed 24bit pixels into one row of out_width
+   pixels, rounding to nearest. Works per byte, so RGB and BGR keep their order */
+extern void simd_downsample(const unsigned char *row0, const unsigned char *row1, unsigned char *dst, unsigned int out_width);
+
+/* Sum of the squared differences of count bytes */
+extern unsigned long long simd_squared_error(const unsigned char *a, const unsigned char *b, size_t count);
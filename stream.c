@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stream.h"
+#include "bmp.h"
+#include "png.h"
+#include "miptex.h"
+#include "buffer.h"
+
+static int open_reader(const char *path, enum image_type_t type, struct row_reader_t *reader)
+{
+	if(type == IMAGE_BMP)
+		return bmp_open_reader(path, reader);
+	else if(type == IMAGE_PNG)
+		return png_open_reader(path, reader);
+
+	return 0;
+}
+
+static int open_writer(const char *path, enum image_type_t type, unsigned int width, unsigned int height, struct row_writer_t *writer)
+{
+	if(type == IMAGE_BMP)
+		return bmp_open_writer(path, width, height, writer);
+	else if(type == IMAGE_PNG)
+		return png_open_writer(path, width, height, writer);
+	else if(type == IMAGE_LMP)
+		return lmp_open_writer(path, width, height, writer);
+
+	return 0;
+}
+
+/* Whole-image path for sources that can't be streamed, and for miptex output
+   whose smaller levels need the whole source */
+int convert_file(const char *src, enum image_type_t input_type, const char *dest, enum image_type_t output_type, const struct convert_options_t *options)
+{
+	struct image_t *img_src = load_image(src, input_type);
+	if(img_src == NULL)
+		return 0;
+
+	struct convert_options_t whole = *options;
+	whole.mip_levels = image_mip_levels(output_type);
+
+	struct quality_t quality;
+	if(options->quality && !quality_begin(&quality, img_src->info->width, img_src->info->height, options->quality))
+	{
+		free_image(img_src);
+		return 0;
+	}
+
+	struct image_t *img_dst = to_palette_measured(img_src, &whole, options->quality ? &quality : NULL);
+	free_image(img_src);
+	if(img_dst == NULL)
+	{
+		if(options->quality)
+			buffer_free(quality.heatmap);
+		return 0;
+	}
+
+	int ret = write_image(img_dst, dest, output_type);
+	free_image(img_dst);
+
+	if(options->quality && !quality_end(&quality, src, dest, output_type))
+		ret = 0;
+
+	return ret;
+}
+
+/* Rows held per band: as many as fit the memory budget, in multiples of 8 so ordered dither
+   lines up with the whole image. 1 without a budget or for Floyd-Steinberg, whose error
+   rows carry over from row to row anyway */
+static unsigned int band_rows(const struct row_reader_t *reader, const struct convert_options_t *options)
+{
+	if(options->memory == 0 || options->dither == DITHER_FS)
+		return 1;
+
+	/* RGB in and indices out */
+	size_t rows = options->memory / ((size_t)reader->width * 4);
+	if(rows >= reader->height)
+		return reader->height;
+	if(rows < 8)
+		return 1;
+
+	return rows & ~(size_t)7;
+}
+
+/* One source and one output row is all that is ever held, plus
+   a scratch row for ordered dither or two error rows for Floyd-Steinberg.
+   With a heat writer, each row's heatmap goes out next to it */
+static int stream_rows(const struct matcher_t *matcher, struct row_reader_t *reader, struct row_writer_t *writer, const struct convert_options_t *options, struct memo_t *stats,
+	struct quality_t *quality, struct row_writer_t *heat_writer)
+{
+	unsigned char *rgb = buffer_alloc((size_t)reader->width * 3);
+	unsigned char *indices = buffer_alloc(reader->width);
+	unsigned char *heat = heat_writer ? buffer_alloc(reader->width) : NULL;
+	unsigned char *scratch = NULL;
+	int *err = NULL;
+	struct memo_t *memo = memo_create();
+
+	int ok = rgb && indices && (heat || !heat_writer);
+	if(options->dither == DITHER_ORDERED)
+		ok = ok && (scratch = buffer_alloc((size_t)reader->width * 3));
+	else if(options->dither == DITHER_FS)
+		ok = ok && (err = buffer_calloc(DITHER_ERR_SIZE(reader->width) * 2 * sizeof(int)));
+
+	for(unsigned int y=0; ok && y<reader->height; y++)
+	{
+		ok = reader->read_row(reader->state, rgb);
+		if(ok)
+		{
+			if(scratch)
+				dither_ordered_row(matcher, memo, rgb, reader->order, indices, reader->width, y, scratch);
+			else if(err)
+				dither_fs_row(matcher, memo, rgb, reader->order, indices, reader->width,
+					err + (y & 1) * DITHER_ERR_SIZE(reader->width), err + ((y + 1) & 1) * DITHER_ERR_SIZE(reader->width), NULL, NULL);
+			else
+				memo_map(memo, matcher, rgb, reader->order, indices, reader->width);
+			ok = writer->write_row(writer->state, indices);
+
+			if(quality)
+				quality_row(quality, rgb, reader->order, indices, reader->width, heat);
+			if(heat)
+				ok = ok && heat_writer->write_row(heat_writer->state, heat);
+		}
+	}
+
+	buffer_free(rgb);
+	buffer_free(indices);
+	buffer_free(heat);
+	buffer_free(scratch);
+	buffer_free(err);
+	memo_add_stats(stats, memo);
+	memo_free(memo);
+
+	return ok;
+}
+
+/* Bands of 'rows' rows are read whole and converted like an image of their own, on the
+   worker threads when there are several */
+static int stream_bands(const struct matcher_t *matcher, struct row_reader_t *reader, struct row_writer_t *writer, unsigned int rows, const struct convert_options_t *options, struct memo_t *stats,
+	struct quality_t *quality, struct row_writer_t *heat_writer)
+{
+	size_t row_size = (size_t)reader->width * 3;
+	unsigned char *rgb = buffer_alloc(row_size * rows);
+	unsigned char *indices = buffer_alloc((size_t)reader->width * rows);
+	unsigned char *heat = heat_writer ? buffer_alloc((size_t)reader->width * rows) : NULL;
+
+	struct img_info_t info = { 24, 3, reader->width, rows, reader->width * 3, reader->order, 1, 1 };
+	struct image_t band = { &info, rgb, NULL, 0 };
+
+	if(quality)
+		quality->heatmap = heat;
+
+	int ok = rgb && indices && (heat || !heat_writer);
+	for(unsigned int y=0; ok && y<reader->height; y+=info.height)
+	{
+		info.height = reader->height - y < rows ? reader->height - y : rows;
+
+		for(unsigned int r=0; ok && r<info.height; r++)
+			ok = reader->read_row(reader->state, rgb + r * row_size);
+
+		ok = ok && convert_strip(matcher, &band, indices, options, stats, quality);
+
+		/* Converted rows are bottom-up */
+		for(unsigned int r=0; ok && r<info.height; r++)
+		{
+			size_t offset = (size_t)(info.height - 1 - r) * reader->width;
+			ok = writer->write_row(writer->state, indices + offset) && (!heat || heat_writer->write_row(heat_writer->state, heat + offset));
+		}
+	}
+
+	if(quality)
+		quality->heatmap = NULL;
+
+	buffer_free(rgb);
+	buffer_free(indices);
+	buffer_free(heat);
+
+	return ok;
+}
+
+int convert_stream(const char *src, enum image_type_t input_type, const char *dest, enum image_type_t output_type, const struct convert_options_t *options)
+{
+	if(image_mip_levels(output_type) > 1)
+		return convert_file(src, input_type, dest, output_type, options);
+
+	struct row_reader_t reader;
+	int opened = open_reader(src, input_type, &reader);
+	if(opened < 0)
+		return convert_file(src, input_type, dest, output_type, options);
+	if(!opened)
+		return 0;
+
+	struct matcher_t matcher;
+	if(!prepare_matcher(options, (unsigned long)reader.width * reader.height, &matcher))
+	{
+		reader.close(reader.state);
+		return 0;
+	}
+
+	struct row_writer_t writer;
+	if(!open_writer(dest, output_type, reader.width, reader.height, &writer))
+	{
+		reader.close(reader.state);
+		return 0;
+	}
+
+	/* The heatmap is streamed to its own file alongside the output */
+	struct quality_t quality;
+	struct row_writer_t heat_writer;
+	int heat_opened = 0;
+	int ok = !options->quality || (quality_begin(&quality, reader.width, reader.height, QUALITY_PRINT) && prepare_quality(&quality));
+	if(ok && options->quality == QUALITY_HEATMAP)
+	{
+		enum image_type_t heat_type;
+		char *heat_path = quality_heatmap_path(src, dest, output_type, &heat_type);
+		heat_opened = heat_path && open_writer(heat_path, heat_type, reader.width, reader.height, &heat_writer);
+		if(!heat_opened)
+			printf("Error: Failed to write heatmap %s\n", heat_path ? heat_path : dest);
+		free(heat_path);
+		ok = heat_opened;
+	}
+
+	struct memo_t stats = { 0 };
+	unsigned int rows = band_rows(&reader, options);
+	if(ok)
+	{
+		struct quality_t *q = options->quality ? &quality : NULL;
+		struct row_writer_t *heat = heat_opened ? &heat_writer : NULL;
+		ok = rows > 1 ? stream_bands(&matcher, &reader, &writer, rows, options, &stats, q, heat) : stream_rows(&matcher, &reader, &writer, options, &stats, q, heat);
+	}
+
+	reader.close(reader.state);
+	if(!writer.close(writer.state))
+		ok = 0;
+	if(heat_opened && !heat_writer.close(heat_writer.state))
+		ok = 0;
+	if(ok && options->quality)
+		quality_end(&quality, src, dest, output_type);
+
+	if(options->verbose)
+	{
+		printf("Matcher: %s\n", match_method_name(&matcher));
+		memo_print_stats(&stats);
+	}
+
+	return ok;
+}
+
+int source_dimensions(const char *src, enum image_type_t input_type, unsigned int *width, unsigned int *height)
+{
+	struct row_reader_t reader;
+	int opened = open_reader(src, input_type, &reader);
+	if(opened == 0)
+		return 0;
+
+	*width = reader.width;
+	*height = reader.height;
+	if(opened > 0)
+		reader.close(reader.state);
+
+	return 1;
+}
+
+int stream_exceeds(const char *src, enum image_type_t input_type, size_t budget)
+{
+	struct row_reader_t reader;
+	if(budget == 0 || open_reader(src, input_type, &reader) <= 0)
+		return 0;
+
+	/* RGB source and indices, as convert_file holds them */
+	int exceeds = (unsigned long long)reader.width * reader.height * 4 > budget;
+	reader.close(reader.state);
+
+	return exceeds;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "convert.h"
+#include "image.h"
+
+/* Sources hand out RGB rows and outputs take index rows, both top to bottom */
+struct row_reader_t
+{
+	unsigned int width;
+	unsigned int height;
+	enum pixel_order_t order;
+	void *state;
+	int (*read_row)(void *state, unsigned char *rgb);
+	void (*close)(void *state);
+};
+
+struct row_writer_t
+{
+	void *state;
+	int (*write_row)(void *state, const unsigned char *indices);
+	int (*close)(void *state);
+};
+
+/* Convert src to dest one row at a time, so memory use is proportional to the
+   image width, or in bands of rows that fit options->memory. Falls back to
+   whole-image conversion for sources that can't be read row by row (interlaced PNGs) */
+extern int convert_stream(const char *src, enum image_type_t input_type, const char *dest, enum image_type_t output_type, const struct convert_options_t *options);
+
+/* Whether converting src as a whole image would hold more than 'budget' bytes of
+   pixels, so it should be streamed. 0 without a budget or if src can't be streamed */
+extern int stream_exceeds(const char *src, enum image_type_t input_type, size_t budget);
+
+/* Width and height of src, from its header only */
+extern int source_dimensions(const char *src, enum image_type_t input_type, unsigned int *width, unsigned int *height);
+
+/* Load, convert and write src as whole images */
+extern int convert_file(const char *src, enum image_type_t input_type, const char *dest, enum image_type_t output_type, const struct convert_options_t *options);
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "trace.h"
+
+struct trace_event_t
+{
+	const char *name;
+	char *file;
+	enum trace_stage_t stage;
+	int task;
+	unsigned int tid;
+	double start;
+	double end;
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+};
+
+struct trace_thread_t
+{
+	unsigned int tid;
+	const char *name;
+};
+
+struct trace_stats_t
+{
+	unsigned int spans;
+	double wall;
+	double cpu;
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	long peak_rss;				// KB
+};
+
+static const char *stage_names[] = { "parse_options", "load", "convert", "write", "stream", "file" };
+
+static int enabled;
+static int print_stats;
+static char *trace_path;
+static double first_start;
+static unsigned int active;		// stage spans running, the RSS peak is only reset while this is 0
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_stats_t stats[TRACE_STAGES];
+static struct trace_event_t *events;
+static unsigned int event_count;
+static unsigned int event_capacity;
+static struct trace_thread_t threads[256];
+static unsigned int thread_count;
+
+static unsigned int next_tid;
+static __thread unsigned int thread_tid;
+
+static double wall_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu_time(clockid_t clock)
+{
+	struct timespec ts;
+	if(clock_gettime(clock, &ts) != 0)
+		return 0;
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned int current_tid(void)
+{
+	if(thread_tid == 0)
+		thread_tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+	return thread_tid;
+}
+
+/* High water mark of the resident set in KB. Linux can reset it, so it covers a single
+   stage when nothing else runs alongside; elsewhere it is the peak of the whole process */
+static long peak_rss(void)
+{
+	long kb = 0;
+
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/status", "r");
+	if(f)
+	{
+		char line[256];
+		while(fgets(line, sizeof(line), f))
+		{
+			if(!strncmp(line, "VmHWM:", 6))
+			{
+				kb = atol(line + 6);
+				break;
+			}
+		}
+		fclose(f);
+	}
+#endif
+
+#ifndef _WIN32
+	if(kb == 0)
+	{
+		struct rusage ru;
+		if(getrusage(RUSAGE_SELF, &ru) == 0)
+			kb = ru.ru_maxrss;
+	}
+#endif
+
+	return kb;
+}
+
+static void reset_peak_rss(void)
+{
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if(f)
+	{
+		fputs("5", f);
+		fclose(f);
+	}
+#endif
+}
+
+int trace_start(const char *path, int stats)
+{
+	if(path)
+	{
+		trace_path = strdup(path);
+		if(!trace_path)
+			return 0;
+	}
+
+	print_stats = stats;
+	enabled = path || stats;
+	return 1;
+}
+
+static void begin(struct trace_span_t *span, enum trace_stage_t stage, const char *name, const char *file, int task)
+{
+	span->stage = stage;
+	span->name = name;
+	span->file = file;
+	span->task = task;
+
+	if(enabled && !task && stage != TRACE_FILE)
+	{
+		pthread_mutex_lock(&trace_lock);
+		if(active++ == 0)
+			reset_peak_rss();
+		pthread_mutex_unlock(&trace_lock);
+	}
+
+	span->cpu = cpu_time(CLOCK_THREAD_CPUTIME_ID);
+	span->wall = wall_time();
+
+	if(first_start == 0)
+		first_start = span->wall;
+}
+
+void trace_begin(struct trace_span_t *span, enum trace_stage_t stage, const char *file)
+{
+	begin(span, stage, NULL, file, 0);
+}
+
+void trace_begin_task(struct trace_span_t *span, enum trace_stage_t stage, const char *name)
+{
+	begin(span, stage, name, NULL, 1);
+}
+
+void trace_end(struct trace_span_t *span, unsigned long long bytes_read, unsigned long long bytes_written)
+{
+	if(!enabled)
+		return;
+
+	double end = wall_time();
+	double cpu = cpu_time(CLOCK_THREAD_CPUTIME_ID) - span->cpu;
+	int stage_span = !span->task && span->stage != TRACE_FILE;
+	long rss = stage_span ? peak_rss() : 0;
+	unsigned int tid = current_tid();
+	char *file = trace_path && span->file ? strdup(span->file) : NULL;
+
+	pthread_mutex_lock(&trace_lock);
+
+	if(span->stage < TRACE_STAGES)
+	{
+		struct trace_stats_t *s = &stats[span->stage];
+		s->cpu += cpu;
+		s->bytes_read += bytes_read;
+		s->bytes_written += bytes_written;
+		if(stage_span)
+		{
+			s->spans++;
+			s->wall += end - span->wall;
+			if(rss > s->peak_rss)
+				s->peak_rss = rss;
+			if(active > 0) // the parse span begins before collection is enabled
+				active--;
+		}
+	}
+
+	if(trace_path && event_count == event_capacity)
+	{
+		unsigned int capacity = event_capacity ? event_capacity * 2 : 256;
+		struct trace_event_t *grown = realloc(events, capacity * sizeof(struct trace_event_t));
+		if(grown)
+		{
+			events = grown;
+			event_capacity = capacity;
+		}
+	}
+
+	if(trace_path && event_count < event_capacity)
+	{
+		struct trace_event_t *e = &events[event_count++];
+		e->name = span->name ? span->name : stage_names[span->stage];
+		e->file = file;
+		e->stage = span->stage;
+		e->task = span->task;
+		e->tid = tid;
+		e->start = span->wall;
+		e->end = end;
+		e->bytes_read = bytes_read;
+		e->bytes_written = bytes_written;
+		file = NULL;
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+	free(file);
+}
+
+void trace_thread_name(const char *name)
+{
+	if(!enabled || !trace_path)
+		return;
+
+	unsigned int tid = current_tid();
+
+	pthread_mutex_lock(&trace_lock);
+	if(thread_count < sizeof(threads)/sizeof(threads[0]))
+	{
+		threads[thread_count].tid = tid;
+		threads[thread_count].name = name;
+		thread_count++;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+unsigned long long trace_file_size(const char *path)
+{
+	struct stat st;
+	if(!enabled || !path || stat(path, &st) != 0)
+		return 0;
+	return st.st_size;
+}
+
+static void write_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for(; *s; s++)
+	{
+		unsigned char c = *s;
+		if(c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if(c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+/* Chrome trace event format, loads in chrome://tracing and Perfetto. Stage spans are
+   complete events on their thread, files are async spans as they move between threads */
+static int write_trace(void)
+{
+	FILE *f = fopen(trace_path, "w");
+	if(!f)
+	{
+		printf("Failed to open %s for writing\n", trace_path);
+		return 0;
+	}
+
+	int pid = (int)getpid();
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+	for(unsigned int i=0; i<thread_count; i++)
+	{
+		fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %u, \"args\": {\"name\": ", pid, threads[i].tid);
+		write_json_string(f, threads[i].name);
+		fprintf(f, "}},\n");
+	}
+
+	for(unsigned int i=0; i<event_count; i++)
+	{
+		const struct trace_event_t *e = &events[i];
+		double ts = (e->start - first_start) * 1e6;
+		double dur = (e->end - e->start) * 1e6;
+
+		if(e->stage == TRACE_FILE)
+		{
+			fprintf(f, "{\"name\": ");
+			write_json_string(f, e->file ? e->file : "file");
+			fprintf(f, ", \"cat\": \"file\", \"ph\": \"b\", \"id\": %u, \"ts\": %.3f, \"pid\": %d, \"tid\": %u},\n", i, ts, pid, e->tid);
+			fprintf(f, "{\"name\": ");
+			write_json_string(f, e->file ? e->file : "file");
+			fprintf(f, ", \"cat\": \"file\", \"ph\": \"e\", \"id\": %u, \"ts\": %.3f, \"pid\": %d, \"tid\": %u}", i, ts + dur, pid, e->tid);
+		}
+		else
+		{
+			fprintf(f, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %u, \"args\": {",
+				e->name, e->task ? "task" : "stage", ts, dur, pid, e->tid);
+			if(e->file)
+			{
+				fprintf(f, "\"file\": ");
+				write_json_string(f, e->file);
+				fprintf(f, ", ");
+			}
+			fprintf(f, "\"bytes_read\": %llu, \"bytes_written\": %llu}}", e->bytes_read, e->bytes_written);
+		}
+
+		fprintf(f, "%s\n", i + 1 < event_count ? "," : "");
+	}
+
+	fprintf(f, "]}\n");
+	return fclose(f) == 0;
+}
+
+static void write_stats(void)
+{
+	printf("\n%-14s %6s %10s %10s %10s %10s %12s\n", "Stage", "Spans", "Wall ms", "CPU ms", "Read MB", "Written MB", "Peak RSS MB");
+
+	for(int s=0; s<TRACE_STAGES; s++)
+	{
+		if(stats[s].spans == 0)
+			continue;
+
+		printf("%-14s %6u %10.2f %10.2f %10.2f %10.2f %12.1f\n", stage_names[s], stats[s].spans, stats[s].wall * 1e3, stats[s].cpu * 1e3,
+			stats[s].bytes_read / (1024.0 * 1024.0), stats[s].bytes_written / (1024.0 * 1024.0), stats[s].peak_rss / 1024.0);
+	}
+
+	printf("%-14s %6s %10.2f %10.2f\n", "total", "", (wall_time() - first_start) * 1e3, cpu_time(CLOCK_PROCESS_CPUTIME_ID) * 1e3);
+}
+
+int trace_finish(void)
+{
+	if(!enabled)
+		return 1;
+
+	int ok = 1;
+	if(print_stats)
+		write_stats();
+	if(trace_path)
+		ok = write_trace();
+
+	for(unsigned int i=0; i<event_count; i++)
+		free(events[i].file);
+	free(events);
+	free(trace_path);
+	events = NULL;
+	trace_path = NULL;
+	event_count = event_capacity = 0;
+	enabled = 0;
+
+	return ok;
+}
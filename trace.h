@@ -0,0 +1,44 @@
+#pragma once
+
+/* Stage timing for --stats and Chrome trace event output for --trace. Spans are
+   cheap to begin and end while neither is enabled */
+enum trace_stage_t
+{
+	TRACE_PARSE,	// option parsing and palette loading
+	TRACE_LOAD,
+	TRACE_CONVERT,
+	TRACE_WRITE,
+	TRACE_STREAM,	// load, convert and write a row at a time
+	TRACE_STAGES,
+	TRACE_FILE = TRACE_STAGES,	// one source image from load to write, in batch mode
+};
+
+struct trace_span_t
+{
+	enum trace_stage_t stage;
+	const char *name;	// event name, the stage's when NULL
+	const char *file;	// image the span works on, NULL if none
+	int task;			// pool work for a span on another thread, only adds CPU time to the stage
+	double wall;		// start
+	double cpu;			// CPU time of the thread at the start
+};
+
+/* Start collecting. Writes a trace to trace_path if it isn't NULL and prints the
+   per stage table if 'stats' is set. Spans begun earlier are counted too */
+extern int trace_start(const char *trace_path, int stats);
+
+extern void trace_begin(struct trace_span_t *span, enum trace_stage_t stage, const char *file);
+
+/* Work done on a pool worker on behalf of a 'stage' span */
+extern void trace_begin_task(struct trace_span_t *span, enum trace_stage_t stage, const char *name);
+
+extern void trace_end(struct trace_span_t *span, unsigned long long bytes_read, unsigned long long bytes_written);
+
+/* Name the calling thread in the trace */
+extern void trace_thread_name(const char *name);
+
+/* Size of the file at path, 0 if it doesn't exist. For the bytes read and written */
+extern unsigned long long trace_file_size(const char *path);
+
+/* Print the stage table and write the trace, returns 0 if the trace couldn't be written */
+extern int trace_finish(void);
@@ -0,0 +1,755 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <png.h>
+
+#include "convert.h"
+#include "image.h"
+#include "palette.h"
+#include "buffer.h"
+#include "batch.h"
+#include "png.h"
+#include "simd.h"
+#include "stream.h"
+
+/* Differential check of the accelerated conversion paths, built and run by make verify.
+   Every color of the RGB cube is matched by the scalar palette scan and by each faster
+   matcher, then random images go through to_palette_rgb with each match method, thread
+   count, dither and pixel order and are compared with the scalar single threaded result,
+   along with the error measured on the way and its heatmap. Last, a directory batch is run
+   twice to check the second run doesn't pick up the first one's outputs.
+   Differing indices are reported and make the exit status 1 */
+
+/* Differing colors or pixels printed per check, the rest are only counted */
+#define VERIFY_MAX_REPORTS 8
+
+/* Largest random image side */
+#define VERIFY_MAX_SIZE 320
+
+#define VERIFY_DITHERS 3
+
+struct verify_options_t
+{
+	unsigned int metrics[METRIC_COUNT];
+	unsigned int metric_count;
+	unsigned int step;			// sweep every step-th value of each channel, 1 = all 16.7M colors
+	unsigned int images;
+	unsigned int threads;		// workers for the threaded conversions
+	unsigned int seed;
+};
+
+/* One random image and the scalar results it is checked against */
+struct verify_image_t
+{
+	unsigned char *rgb;			// top-down packed RGB
+	unsigned char *bgr;			// the same pixels in BGR order
+	unsigned int width;
+	unsigned int height;
+	unsigned int levels;
+	unsigned char *reference[2][VERIFY_DITHERS];	// by fullbrights and dither
+	struct quality_t quality[2][VERIFY_DITHERS];
+};
+
+static const enum dither_method_t dithers[VERIFY_DITHERS] = { DITHER_NONE, DITHER_ORDERED, DITHER_FS };
+static const char *dither_names[VERIFY_DITHERS] = { "none", "ordered", "fs" };
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned int xorshift(unsigned int *state)
+{
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void print_row(enum metric_t metric, const char *test, const char *fullbrights, const char *path, unsigned long long checked, unsigned long long mismatches, double seconds, double reference)
+{
+	printf("%-8s %-6s %-3s %-10s %12llu %10llu %10.1f %8.2f\n", metric_name(metric), test, fullbrights, path,
+		checked, mismatches, seconds * 1e3, seconds > 0 ? reference / seconds : 0);
+}
+
+/* Match the sweep with the scalar scan and the faster matchers of the metric, every
+   red value is one plane of green and blue values */
+static int sweep(enum metric_t metric, unsigned int fullbrights, unsigned int step, unsigned long long *mismatches)
+{
+	unsigned char palette[768], index[256];
+	unsigned int colors = palette_usable(fullbrights, palette, index);
+	if(colors == 0)
+	{
+		printf("No palette colors left to match after the reserved and fullbright ranges\n");
+		return 0;
+	}
+
+	/* The perceptual metrics only have the candidate grid, which auto builds for large images */
+	static const enum match_method_t rgb_methods[] = { MATCH_SIMD, MATCH_LUT, MATCH_KDTREE };
+	enum match_method_t methods[3] = { MATCH_AUTO };
+	unsigned int count = 1;
+	if(metric == METRIC_RGB)
+	{
+		memcpy(methods, rgb_methods, sizeof(rgb_methods));
+		count = 3;
+	}
+
+	struct matcher_t *reference = matcher_create(palette, colors, index, MATCH_SCALAR, metric);
+	struct matcher_t *paths[3] = { NULL };
+	int ok = reference && matcher_prepare(reference, 0);
+	for(unsigned int p=0; ok && p<count; p++)
+		ok = (paths[p] = matcher_create(palette, colors, index, methods[p], metric)) && matcher_prepare(paths[p], (unsigned long)1 << 30);
+
+	unsigned char *src = malloc(256 * 256 * 3);
+	unsigned char *expected = malloc(256 * 256);
+	unsigned char *actual = malloc(256 * 256);
+	if(!src || !expected || !actual)
+		ok = 0;
+
+	double reference_time = 0, times[3] = { 0 };
+	unsigned long long checked = 0, wrong[3] = { 0 };
+
+	for(unsigned int r=0; ok && r<256; r+=step)
+	{
+		unsigned int n = 0;
+		for(unsigned int g=0; g<256; g+=step)
+		{
+			for(unsigned int b=0; b<256; b+=step, n++)
+			{
+				src[n*3] = r;
+				src[n*3+1] = g;
+				src[n*3+2] = b;
+			}
+		}
+
+		double start = now();
+		matcher_map(reference, src, PIXEL_RGB, expected, n);
+		reference_time += now() - start;
+		checked += n;
+
+		for(unsigned int p=0; p<count; p++)
+		{
+			start = now();
+			matcher_map(paths[p], src, PIXEL_RGB, actual, n);
+			times[p] += now() - start;
+
+			for(unsigned int i=0; i<n; i++)
+			{
+				if(actual[i] != expected[i] && wrong[p]++ < VERIFY_MAX_REPORTS)
+					printf("Mismatch: %s %s fullbrights %s, color %u,%u,%u is %u, scalar gives %u\n", metric_name(metric),
+						match_method_name(paths[p]), fullbrights ? "yes" : "no", src[i*3], src[i*3+1], src[i*3+2], actual[i], expected[i]);
+			}
+		}
+	}
+
+	if(ok)
+	{
+		const char *fb = fullbrights ? "yes" : "no";
+		print_row(metric, "sweep", fb, "scalar", checked, 0, reference_time, reference_time);
+		for(unsigned int p=0; p<count; p++)
+		{
+			print_row(metric, "sweep", fb, metric == METRIC_RGB ? match_method_name(paths[p]) : "cells", checked, wrong[p], times[p], reference_time);
+			*mismatches += wrong[p];
+		}
+	}
+	else
+		printf("Failed to set up the %s sweep\n", metric_name(metric));
+
+	free(src);
+	free(expected);
+	free(actual);
+	matcher_free(reference);
+	for(unsigned int p=0; p<count; p++)
+		matcher_free(paths[p]);
+
+	return ok;
+}
+
+/* Blocks of noise, gradients, palette colors with a little jitter and colors halfway
+   between two palette entries, where ties between entries are most likely */
+static int generate_image(struct verify_image_t *image, unsigned int *seed, unsigned int levels)
+{
+	unsigned int align = levels > 1 ? 16 : 1;
+	image->width = (1 + xorshift(seed) % VERIFY_MAX_SIZE + align - 1) / align * align;
+	image->height = (1 + xorshift(seed) % VERIFY_MAX_SIZE + align - 1) / align * align;
+	image->levels = levels;
+
+	size_t size = (size_t)image->width * image->height * 3;
+	image->rgb = malloc(size);
+	image->bgr = malloc(size);
+	if(!image->rgb || !image->bgr)
+		return 0;
+
+	unsigned int kinds = ((image->width + 7) / 8) * ((image->height + 7) / 8);
+	unsigned char *block_kind = malloc(kinds);
+	if(!block_kind)
+		return 0;
+	for(unsigned int i=0; i<kinds; i++)
+		block_kind[i] = xorshift(seed) & 3;
+
+	for(unsigned int y=0; y<image->height; y++)
+	{
+		for(unsigned int x=0; x<image->width; x++)
+		{
+			unsigned char *p = image->rgb + ((size_t)y * image->width + x) * 3;
+			unsigned int r = xorshift(seed);
+			const unsigned char *a = cmap + (r % cmap_colors) * 3;
+			const unsigned char *b = cmap + ((r >> 8) % cmap_colors) * 3;
+
+			switch(block_kind[(y / 8) * ((image->width + 7) / 8) + x / 8])
+			{
+				case 0:
+					p[0] = r;
+					p[1] = r >> 8;
+					p[2] = r >> 16;
+					break;
+				case 1:
+					p[0] = x * 255 / image->width;
+					p[1] = y * 255 / image->height;
+					p[2] = (x + y) * 255 / (image->width + image->height);
+					break;
+				case 2:
+					for(int c=0; c<3; c++)
+					{
+						int v = a[c] + (int)((r >> (16 + c * 2)) & 3) - 1;
+						p[c] = v < 0 ? 0 : v > 255 ? 255 : v;
+					}
+					break;
+				default:
+					for(int c=0; c<3; c++)
+						p[c] = (a[c] + b[c] + ((r >> 24) & 1)) / 2;
+					break;
+			}
+
+			unsigned char *q = image->bgr + ((size_t)y * image->width + x) * 3;
+			q[0] = p[2];
+			q[1] = p[1];
+			q[2] = p[0];
+		}
+	}
+
+	free(block_kind);
+	return 1;
+}
+
+static struct image_t *convert_image(const struct verify_image_t *image, enum pixel_order_t order, const struct convert_options_t *options, struct quality_t *quality)
+{
+	struct img_info_t info = { 24, 3, image->width, image->height, image->width * 3, order, 1, 1 };
+	struct image_t src = { &info, order == PIXEL_BGR ? image->bgr : image->rgb, NULL, 0 };
+	if(!quality_begin(quality, image->width, image->height, QUALITY_HEATMAP))
+		return NULL;
+
+	struct image_t *dst = to_palette_measured(&src, options, quality);
+	if(!dst)
+		buffer_free(quality->heatmap);
+	return dst;
+}
+
+/* Differing heatmap pixels, plus one if any of the totals differ */
+static unsigned long long quality_mismatches(const struct quality_t *a, const struct quality_t *b)
+{
+	unsigned long long wrong = 0;
+	for(size_t j=0; j<(size_t)a->width * a->height; j++)
+		wrong += a->heatmap[j] != b->heatmap[j];
+
+	int same = a->pixels == b->pixels && a->squared == b->squared && a->delta_e == b->delta_e && a->max_delta_e == b->max_delta_e &&
+		a->fullbrights == b->fullbrights && !memcmp(a->histogram, b->histogram, sizeof(a->histogram));
+	return wrong + !same;
+}
+
+/* Convert every image with every fullbright setting and dither, checking against the
+   scalar results or storing them when 'store' is set */
+static int check_images(struct verify_image_t *images, const struct verify_options_t *options, struct convert_options_t *convert,
+	const char *path, int store, unsigned long long *checked, unsigned long long *mismatches, double *seconds)
+{
+	for(unsigned int i=0; i<options->images; i++)
+	{
+		struct verify_image_t *image = &images[i];
+		size_t size = image_level_offset(image->width, image->height, image->levels);
+		convert->mip_levels = image->levels;
+
+		for(unsigned int f=0; f<2; f++)
+		{
+			convert->allow_fullbrights = f;
+			for(unsigned int d=0; d<VERIFY_DITHERS; d++)
+			{
+				convert->dither = dithers[d];
+
+				for(enum pixel_order_t order=PIXEL_RGB; order<=PIXEL_BGR; order++)
+				{
+					struct quality_t quality;
+					double start = now();
+					struct image_t *dst = convert_image(image, order, convert, &quality);
+					if(order == PIXEL_RGB)
+						*seconds += now() - start;
+					if(!dst)
+						return 0;
+
+					if(store)
+					{
+						image->reference[f][d] = malloc(size);
+						if(!image->reference[f][d])
+						{
+							free_image(dst);
+							return 0;
+						}
+						memcpy(image->reference[f][d], dst->data, size);
+						image->quality[f][d] = quality;
+						free_image(dst);
+						*checked += size;
+						break;
+					}
+
+					unsigned long long wrong = 0;
+					size_t first = 0;
+					for(size_t j=0; j<size; j++)
+						if(dst->data[j] != image->reference[f][d][j] && wrong++ == 0)
+							first = j;
+
+					*checked += size;
+					*mismatches += wrong;
+					if(wrong && *mismatches == wrong)
+						printf("Mismatch: %s %s, %u threads, dither %s, fullbrights %s, %s image %u (%ux%u, %u levels): %llu pixels differ, first at %zu\n",
+							metric_name(convert->metric), path,
+							convert->threads, dither_names[d], f ? "yes" : "no", order == PIXEL_BGR ? "bgr" : "rgb", i, image->width, image->height, image->levels, wrong, first);
+
+					/* The error is measured on the same indices, so it has to match too */
+					unsigned long long measured = quality_mismatches(&quality, &image->quality[f][d]);
+					*mismatches += measured;
+					if(measured && *mismatches == measured)
+						printf("Mismatch: %s %s, %u threads, dither %s, fullbrights %s, %s image %u: measured error differs, %llu heatmap pixels or totals\n",
+							metric_name(convert->metric), path, convert->threads, dither_names[d], f ? "yes" : "no", order == PIXEL_BGR ? "bgr" : "rgb", i, measured);
+					buffer_free(quality.heatmap);
+
+					free_image(dst);
+				}
+			}
+		}
+	}
+
+	return 1;
+}
+
+/* The whole conversion, color cache, dithering, mip levels and row bands included */
+static int check_conversions(enum metric_t metric, struct verify_image_t *images, const struct verify_options_t *options, unsigned long long *mismatches)
+{
+	static const enum match_method_t rgb_methods[] = { MATCH_AUTO, MATCH_SIMD, MATCH_LUT, MATCH_KDTREE };
+	static const char *names[] = { "auto", "simd", "lut", "kdtree" };
+	unsigned int count = metric == METRIC_RGB ? 4 : 1;
+
+	struct convert_options_t convert = { 0 };
+	convert.metric = metric;
+	convert.match_method = MATCH_SCALAR;
+	convert.threads = 1;
+
+	/* Each method starts from a reset, so it is checked on tables it built itself */
+	double reference_time = 0;
+	unsigned long long checked = 0, wrong = 0;
+	convert_reset();
+	if(!check_images(images, options, &convert, "scalar", 1, &checked, &wrong, &reference_time))
+		return 0;
+	print_row(metric, "images", "all", "scalar", checked, 0, reference_time, reference_time);
+
+	for(unsigned int m=0; m<count; m++)
+	{
+		const char *name = rgb_methods[m] == MATCH_SIMD ? simd_kernel_name() : names[m];
+		convert.match_method = rgb_methods[m];
+		convert_reset();
+
+		double seconds = 0, threaded = 0;
+		checked = wrong = 0;
+		convert.threads = 1;
+		if(!check_images(images, options, &convert, name, 0, &checked, &wrong, &seconds))
+			return 0;
+		convert.threads = options->threads;
+		if(!check_images(images, options, &convert, name, 0, &checked, &wrong, &threaded))
+			return 0;
+
+		print_row(metric, "images", "all", name, checked, wrong, seconds, reference_time);
+		*mismatches += wrong;
+	}
+
+	for(unsigned int i=0; i<options->images; i++)
+	{
+		for(unsigned int f=0; f<2; f++)
+		{
+			for(unsigned int d=0; d<VERIFY_DITHERS; d++)
+			{
+				free(images[i].reference[f][d]);
+				images[i].reference[f][d] = NULL;
+				buffer_free(images[i].quality[f][d].heatmap);
+				images[i].quality[f][d].heatmap = NULL;
+			}
+		}
+	}
+
+	return 1;
+}
+
+static void remove_dir(const char *path)
+{
+	DIR *dir = opendir(path);
+	if(!dir)
+		return;
+
+	struct dirent *entry;
+	char child[PATH_MAX];
+	while((entry = readdir(dir)) != NULL)
+	{
+		snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+		if(strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+			remove(child);
+	}
+
+	closedir(dir);
+	rmdir(path);
+}
+
+/* A directory batch with --heatmap, run twice: the second run should find the one
+   source again and none of the outputs or heatmaps written next to it */
+static int check_batch_rerun(unsigned long long *mismatches)
+{
+	char dir[] = "/tmp/qpalette-verify-XXXXXX";
+	if(!mkdtemp(dir))
+	{
+		printf("Failed to create a directory for the batch check\n");
+		return 0;
+	}
+
+	/* Every palette entry once, the source is written through the palette like any output */
+	unsigned char data[256];
+	for(unsigned int i=0; i<256; i++)
+		data[i] = i;
+	struct img_info_t info = { 8, 1, 16, 16, 16, PIXEL_RGB, 0, 1 };
+	struct image_t image = { &info, data, NULL, 0 };
+
+	char src[PATH_MAX];
+	snprintf(src, sizeof(src), "%s/texture.png", dir);
+	int ok = write_png(&image, src);
+
+	struct batch_options_t options;
+	memset(&options, 0, sizeof(options));
+	options.convert.threads = 1;
+	options.convert.mip_levels = 1;
+	options.convert.quality = QUALITY_HEATMAP;
+	options.output_type = -1;
+	options.threads = 1;
+
+	unsigned int found[2] = { 0, 0 }, failed = 0;
+	for(unsigned int run=0; ok && run<2; run++)
+	{
+		struct batch_t *batch = batch_create();
+		ok = batch && batch_add_path(batch, dir);
+		if(ok)
+		{
+			found[run] = batch->count;
+			failed += batch_run(batch, &options);
+		}
+		batch_free(batch);
+	}
+	remove_dir(dir);
+
+	if(!ok || failed)
+	{
+		printf("Failed to run the batch check\n");
+		return 0;
+	}
+
+	printf("batch rerun: %u source found on the first run, %u on the second\n", found[0], found[1]);
+	if(found[1] != found[0])
+	{
+		printf("Mismatch: the second batch run picked up %u outputs of the first\n", found[1] - found[0]);
+		*mismatches += found[1] - found[0];
+	}
+
+	return 1;
+}
+
+/* Write a paletted PNG with a tRNS chunk, index i on pixel i of 'width' x 'height' */
+static int write_trns_png(const char *path, const unsigned char *palette, unsigned int width, unsigned int height)
+{
+	FILE *f = fopen(path, "wb");
+	if(!f)
+		return 0;
+
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	if(!info || setjmp(png_jmpbuf(png)))
+	{
+		png_destroy_write_struct(&png, &info);
+		fclose(f);
+		return 0;
+	}
+
+	png_color colors[256];
+	unsigned char alpha[256];
+	for(unsigned int i=0; i<256; i++)
+	{
+		colors[i].red = palette[i*3];
+		colors[i].green = palette[i*3+1];
+		colors[i].blue = palette[i*3+2];
+		alpha[i] = i;
+	}
+
+	png_init_io(png, f);
+	png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_PLTE(png, info, colors, 256);
+	png_set_tRNS(png, info, alpha, 256, NULL);
+	png_write_info(png, info);
+
+	unsigned char row[256];
+	for(unsigned int y=0; y<height; y++)
+	{
+		for(unsigned int x=0; x<width; x++)
+			row[x] = (y * width + x) & 255;
+		png_write_row(png, row);
+	}
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+
+	return fclose(f) == 0;
+}
+
+/* Pixels of one decoded row that aren't the palette color of their index */
+static unsigned long long trns_row_errors(const unsigned char *rgb, const unsigned char *palette, unsigned int width, unsigned int y)
+{
+	unsigned long long wrong = 0;
+	for(unsigned int x=0; x<width; x++)
+		wrong += memcmp(rgb + x*3, palette + ((y * width + x) & 255) * 3, 3) != 0;
+
+	return wrong;
+}
+
+/* Palette expansion turns tRNS into alpha, which has to be dropped again so every
+   loader hands out packed RGB: whole file, from memory and row by row */
+static int check_png_trns(unsigned long long *mismatches)
+{
+	char dir[] = "/tmp/qpalette-verify-XXXXXX";
+	if(!mkdtemp(dir))
+	{
+		printf("Failed to create a directory for the PNG check\n");
+		return 0;
+	}
+
+	const unsigned int width = 48, height = 16;
+	unsigned char palette[768];
+	for(unsigned int i=0; i<768; i++)
+		palette[i] = i * 37 + (i / 3) * 11;
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/trns.png", dir);
+	int ok = write_trns_png(path, palette, width, height);
+
+	size_t size = 0;
+	unsigned char *file = NULL;
+	FILE *f = ok ? fopen(path, "rb") : NULL;
+	if(f)
+	{
+		fseek(f, 0, SEEK_END);
+		size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		file = malloc(size);
+		ok = file && fread(file, size, 1, f) == 1;
+		fclose(f);
+	}
+	else
+		ok = 0;
+
+	unsigned long long checked = 0, wrong = 0;
+	for(unsigned int memory=0; ok && memory<2; memory++)
+	{
+		struct image_t *img = memory ? load_png_memory(file, size) : load_png(path);
+		if(!img || img->info->stride != width * 3)
+		{
+			printf("Mismatch: palette PNG with tRNS %s isn't loaded as packed RGB\n", memory ? "in memory" : "from a file");
+			wrong += (unsigned long long)width * height;
+		}
+		else
+		{
+			for(unsigned int y=0; y<height; y++)
+				wrong += trns_row_errors(img->data + (size_t)(height - 1 - y) * img->info->stride, palette, width, y);
+		}
+		checked += (unsigned long long)width * height;
+		free_image(img);
+	}
+
+	struct row_reader_t reader;
+	unsigned char row[256 * 3];
+	if(ok && png_open_reader(path, &reader) > 0)
+	{
+		for(unsigned int y=0; y<height; y++)
+		{
+			if(!reader.read_row(reader.state, row))
+			{
+				wrong += width;
+				continue;
+			}
+			wrong += trns_row_errors(row, palette, width, y);
+		}
+		checked += (unsigned long long)width * height;
+		reader.close(reader.state);
+	}
+	else if(ok)
+	{
+		printf("Mismatch: palette PNG with tRNS can't be read row by row\n");
+		wrong += (unsigned long long)width * height;
+	}
+
+	free(file);
+	remove_dir(dir);
+
+	if(!ok)
+	{
+		printf("Failed to run the PNG tRNS check\n");
+		return 0;
+	}
+
+	printf("png tRNS: %llu pixels checked, %llu wrong\n", checked, wrong);
+	*mismatches += wrong;
+	return 1;
+}
+
+static void print_usage(char *argv0)
+{
+	printf("\n-- Usage --\n");
+	printf("%s [options]\n", argv0);
+	printf("\n-- Options --\n");
+	printf("-c   -  Color distance metrics to check, e.g. -c rgb,weighted - default is all\n");
+	printf("-i   -  Random images converted per metric - default is 8\n");
+	printf("-j   -  Number of worker threads for the threaded conversions - default is 3\n");
+	printf("-p   -  Palette file to check with, as for qpalette - default is the Quake 1 colormap\n");
+	printf("-r   -  Reserved palette entries, as for qpalette - default is none\n");
+	printf("-s   -  Sweep every nth value of each channel - default is 1, all 16.7M colors\n");
+	printf("-x   -  Seed of the random images - default is 1\n");
+}
+
+static int parse_metrics(char *arg, struct verify_options_t *options)
+{
+	options->metric_count = 0;
+	for(char *p = strtok(arg, ","); p; p = strtok(NULL, ","))
+	{
+		int metric = parse_metric(p);
+		if(metric < 0 || options->metric_count == METRIC_COUNT)
+			return 0;
+		options->metrics[options->metric_count++] = metric;
+	}
+
+	return options->metric_count > 0;
+}
+
+static int parse_options(int argc, char **argv, struct verify_options_t *options)
+{
+	memset(options, 0, sizeof(*options));
+	for(unsigned int m=0; m<METRIC_COUNT; m++)
+		options->metrics[m] = m;
+	options->metric_count = METRIC_COUNT;
+	options->step = 1;
+	options->images = 8;
+	options->threads = 3;
+	options->seed = 1;
+
+	int c;
+	while ((c = getopt(argc, argv, "c:hi:j:p:r:s:x:")) != -1)
+	{
+		switch (c)
+		{
+			case 'c': if(!parse_metrics(optarg, options)) return 0; break;
+			case 'i': options->images = atoi(optarg); break;
+			case 'j': if(atoi(optarg) < 1) { printf("Invalid thread count: %s\n", optarg); return 0; } options->threads = atoi(optarg); break;
+			case 'p': if(!load_palette(optarg)) return 0; break;
+			case 'r': if(!parse_palette_ranges(optarg, CMAP_RESERVED)) return 0; break;
+			case 's': if(atoi(optarg) < 1 || atoi(optarg) > 255) { printf("Invalid sweep step: %s\n", optarg); return 0; } options->step = atoi(optarg); break;
+			case 'x': options->seed = strtoul(optarg, NULL, 0) ? strtoul(optarg, NULL, 0) : 1; break;
+			default: print_usage(argv[0]); return 0;
+		}
+	}
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct verify_options_t options;
+	if(!parse_options(argc, argv, &options))
+		return 1;
+
+	struct verify_image_t *images = calloc(options.images ? options.images : 1, sizeof(struct verify_image_t));
+	if(!images)
+		return 1;
+
+	/* Every other image is a miptex, its smaller levels come from a separate pass */
+	unsigned int seed = options.seed;
+	for(unsigned int i=0; i<options.images; i++)
+	{
+		if(!generate_image(&images[i], &seed, i & 1 ? MAX_MIP_LEVELS : 1))
+		{
+			printf("Failed to malloc verification image\n");
+			return 1;
+		}
+	}
+
+	printf("%-8s %-6s %-3s %-10s %12s %10s %10s %8s\n", "metric", "test", "fb", "path", "checked", "mismatches", "ms", "speedup");
+
+	unsigned long long mismatches = 0;
+	int ok = 1;
+
+	for(unsigned int m=0; ok && m<options.metric_count; m++)
+	{
+		enum metric_t metric = options.metrics[m];
+		for(unsigned int f=0; ok && f<2; f++)
+			ok = sweep(metric, f, options.step, &mismatches);
+
+		ok = ok && (options.images == 0 || check_conversions(metric, images, &options, &mismatches));
+	}
+
+	/* The simd matcher runs the best kernel above, the others the CPU supports are forced in turn */
+	static const char *kernels[] = { "scalar", "sse4.1", "avx2" };
+	const char *best = simd_kernel_name();
+	for(unsigned int m=0; ok && m<options.metric_count; m++)
+	{
+		if(options.metrics[m] != METRIC_RGB)
+			continue;
+
+		for(unsigned int k=0; ok && k<sizeof(kernels)/sizeof(kernels[0]); k++)
+		{
+			if(!strcmp(kernels[k], best) || !simd_force_kernel(kernels[k]))
+				continue;
+
+			for(unsigned int f=0; ok && f<2; f++)
+				ok = sweep(METRIC_RGB, f, options.step, &mismatches);
+			ok = ok && (options.images == 0 || check_conversions(METRIC_RGB, images, &options, &mismatches));
+		}
+		simd_force_kernel(NULL);
+	}
+
+	ok = ok && check_batch_rerun(&mismatches);
+	ok = ok && check_png_trns(&mismatches);
+
+	for(unsigned int i=0; i<options.images; i++)
+	{
+		free(images[i].rgb);
+		free(images[i].bgr);
+	}
+	free(images);
+	convert_reset();
+
+	if(!ok)
+		return 1;
+
+	if(mismatches)
+	{
+		printf("FAILED: %llu differences from the scalar reference\n", mismatches);
+		return 1;
+	}
+
+	printf("OK: every path matches the scalar reference\n");
+	return 0;
+}
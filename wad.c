@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <pthread.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "wad.h"
+#include "miptex.h"
+#include "image.h"
+
+#define WAD_TYPE_MIPTEX 'D'
+
+#pragma pack(push, 1)
+struct wad_header_t
+{
+	char magic[4];		// WAD2
+	int lumps;
+	int directory;		// offset of the lump directory, behind the lumps
+};
+
+struct wad_lump_t
+{
+	int offset;
+	int disk_size;
+	int size;
+	char type;
+	char compression;
+	char pad[2];
+	char name[MIPTEX_NAME_LEN];
+};
+#pragma pack(pop)
+
+struct wad_entry_t
+{
+	char name[MIPTEX_NAME_LEN];
+	unsigned int width;
+	unsigned int height;
+	size_t offset;
+	size_t size;
+	int written;		// set by the thread writing the lump, read once every writer is done
+};
+
+struct wad_t
+{
+	char *path;
+	struct wad_entry_t *entries;
+	unsigned int count;
+	unsigned int capacity;
+	size_t directory;
+	int laid_out;
+#ifdef _WIN32
+	FILE *f;
+	pthread_mutex_t lock;	// lumps are written through the one FILE
+#else
+	int fd;
+	unsigned char *map;		// the whole file, lumps are encoded straight into it
+	size_t size;
+#endif
+};
+
+static int same_name(const char *a, const char *b)
+{
+	for(unsigned int i=0; i<MIPTEX_NAME_LEN; i++)
+	{
+		if(tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+			return 0;
+		if(a[i] == '\0')
+			return 1;
+	}
+
+	return 1;
+}
+
+struct wad_t *wad_create(const char *path)
+{
+	struct wad_t *wad = calloc(1, sizeof(struct wad_t));
+	if(!wad)
+		return NULL;
+
+	wad->path = strdup(path);
+	if(!wad->path)
+	{
+		free(wad);
+		return NULL;
+	}
+
+	return wad;
+}
+
+int wad_add(struct wad_t *wad, const char *name, unsigned int width, unsigned int height)
+{
+	if(name[0] == '\0' || width == 0 || height == 0 || width % 16 || height % 16)
+	{
+		printf("Error: Texture %s is %ux%u, WAD textures need sizes in multiples of 16\n", name, width, height);
+		return -1;
+	}
+
+	for(unsigned int i=0; i<wad->count; i++)
+	{
+		if(same_name(wad->entries[i].name, name))
+		{
+			printf("Error: Texture name %s is already in the WAD\n", name);
+			return -1;
+		}
+	}
+
+	if(wad->count == wad->capacity)
+	{
+		unsigned int capacity = wad->capacity ? wad->capacity * 2 : 64;
+		struct wad_entry_t *entries = realloc(wad->entries, capacity * sizeof(struct wad_entry_t));
+		if(!entries)
+			return -1;
+		wad->entries = entries;
+		wad->capacity = capacity;
+	}
+
+	struct wad_entry_t *e = &wad->entries[wad->count];
+	memset(e, 0, sizeof(*e));
+	strncpy(e->name, name, MIPTEX_NAME_LEN - 1);
+	e->width = width;
+	e->height = height;
+	e->size = miptex_size(width, height);
+
+	return wad->count++;
+}
+
+const char *wad_lump_name(const struct wad_t *wad, unsigned int index)
+{
+	return wad->entries[index].name;
+}
+
+int wad_layout(struct wad_t *wad)
+{
+	size_t offset = sizeof(struct wad_header_t);
+	for(unsigned int i=0; i<wad->count; i++)
+	{
+		wad->entries[i].offset = offset;
+		offset += wad->entries[i].size;
+	}
+
+	wad->directory = offset;
+	size_t size = offset + (size_t)wad->count * sizeof(struct wad_lump_t);
+
+	/* Offsets in the directory are 32 bit */
+	if(size > INT_MAX)
+	{
+		printf("Error: %u textures need %zu bytes, more than a WAD2 can address\n", wad->count, size);
+		return 0;
+	}
+
+#ifdef _WIN32
+	wad->f = fopen(wad->path, "wb");
+	if(!wad->f)
+	{
+		printf("Failed to open %s for writing\n", wad->path);
+		return 0;
+	}
+	pthread_mutex_init(&wad->lock, NULL);
+#else
+	wad->fd = open(wad->path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if(wad->fd < 0)
+	{
+		printf("Failed to open %s for writing\n", wad->path);
+		return 0;
+	}
+
+	/* Reserve the blocks up front, running out of space in a mapping is a SIGBUS instead of an error */
+#ifdef __linux__
+	int sized = posix_fallocate(wad->fd, 0, size) == 0;
+#else
+	int sized = ftruncate(wad->fd, size) == 0;
+#endif
+	wad->map = sized ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, wad->fd, 0) : MAP_FAILED;
+	if(wad->map == MAP_FAILED)
+	{
+		printf("Failed to allocate %zu bytes for %s\n", size, wad->path);
+		wad->map = NULL;
+		close(wad->fd);
+		remove(wad->path);
+		return 0;
+	}
+	wad->size = size;
+#endif
+
+	wad->laid_out = 1;
+	return 1;
+}
+
+int wad_write_miptex(struct wad_t *wad, unsigned int index, const struct image_t *image)
+{
+	struct wad_entry_t *e = &wad->entries[index];
+	if(image->info->width != e->width || image->info->height != e->height)
+	{
+		printf("Error: Texture %s changed size since the WAD was laid out\n", e->name);
+		return 0;
+	}
+
+#ifdef _WIN32
+	size_t size;
+	unsigned char *lump = miptex_build(image, e->name, &size);
+	if(!lump)
+		return 0;
+
+	pthread_mutex_lock(&wad->lock);
+	int ok = _fseeki64(wad->f, e->offset, SEEK_SET) == 0 && fwrite(lump, size, 1, wad->f) == 1;
+	pthread_mutex_unlock(&wad->lock);
+	free(lump);
+#else
+	int ok = miptex_encode(image, e->name, wad->map + e->offset);
+#endif
+
+	e->written = ok;
+	return ok;
+}
+
+int wad_close(struct wad_t *wad)
+{
+	if(!wad)
+		return 1;
+
+	int ok = wad->laid_out;
+	if(ok)
+	{
+		/* A lump that failed leaves unused bytes behind, only the others are listed */
+		struct wad_header_t header = { { 'W', 'A', 'D', '2' }, 0, wad->directory };
+		struct wad_lump_t *lumps = calloc(wad->count ? wad->count : 1, sizeof(struct wad_lump_t));
+		ok = lumps != NULL;
+
+		for(unsigned int i=0; ok && i<wad->count; i++)
+		{
+			const struct wad_entry_t *e = &wad->entries[i];
+			if(!e->written)
+				continue;
+
+			struct wad_lump_t *lump = &lumps[header.lumps++];
+			lump->offset = e->offset;
+			lump->disk_size = e->size;
+			lump->size = e->size;
+			lump->type = WAD_TYPE_MIPTEX;
+			memcpy(lump->name, e->name, MIPTEX_NAME_LEN);
+		}
+
+		size_t size = wad->directory + header.lumps * sizeof(struct wad_lump_t);
+
+#ifdef _WIN32
+		ok = ok && _fseeki64(wad->f, wad->directory, SEEK_SET) == 0 && fwrite(lumps, sizeof(struct wad_lump_t), header.lumps, wad->f) == (size_t)header.lumps;
+		ok = ok && _fseeki64(wad->f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, wad->f) == 1;
+		ok = ok && fflush(wad->f) == 0 && _chsize_s(_fileno(wad->f), size) == 0;
+		if(fclose(wad->f) != 0)
+			ok = 0;
+		pthread_mutex_destroy(&wad->lock);
+#else
+		if(ok)
+		{
+			memcpy(wad->map, &header, sizeof(header));
+			memcpy(wad->map + wad->directory, lumps, header.lumps * sizeof(struct wad_lump_t));
+		}
+
+		munmap(wad->map, wad->size);
+		ok = ok && ftruncate(wad->fd, size) == 0;
+		if(close(wad->fd) != 0)
+			ok = 0;
+#endif
+
+		free(lumps);
+		if(!ok)
+			printf("Failed to write %s\n", wad->path);
+	}
+
+	free(wad->entries);
+	free(wad->path);
+	free(wad);
+
+	return ok;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "defs.h"
+
+/* Quake WAD2 archives of miptex lumps. A lump's size follows from its texture's size,
+   so every offset is fixed before anything is converted: textures are added first,
+   then wad_layout sizes the file and each conversion writes its lump straight to
+   its place in it, from any thread */
+struct wad_t;
+
+extern struct wad_t *wad_create(const char *path);
+
+/* Add a width x height texture, returns its lump index or -1 if the name is taken
+   (WAD2 names are case insensitive) or the size can't hold mip levels */
+extern int wad_add(struct wad_t *wad, const char *name, unsigned int width, unsigned int height);
+
+/* Size the file for the lumps added so far and open it for wad_write_miptex */
+extern int wad_layout(struct wad_t *wad);
+
+extern const char *wad_lump_name(const struct wad_t *wad, unsigned int index);
+
+/* Encode an image with MIPTEX_LEVELS levels as lump 'index' */
+extern int wad_write_miptex(struct wad_t *wad, unsigned int index, const struct image_t *image);
+
+/* Write the directory of the lumps written, lumps that failed are left out.
+   Returns 0 if the archive couldn't be completed */
+extern int wad_close(struct wad_t *wad);